@@ -22,8 +22,16 @@
 #define POLYGON 4
 #define MULTIPOLYGON 5
 
+// A Feature message found while scanning the file, not yet decoded
 struct queued_feature {
-	protozero::pbf_reader pbf{};
+	const char *data = NULL;
+	size_t len = 0;
+};
+
+struct geobuf_queue {
+	std::vector<queued_feature> features{};
+	const char *src = NULL;	    // start of the file, for sequence numbers
+	long long initial_offset = 0;  // sequence number of the start of the file
 	size_t dim = 0;
 	double e = 0;
 	std::vector<std::string> *keys = NULL;
@@ -32,8 +40,6 @@ struct queued_feature {
 	std::string layername = "";
 };
 
-static std::vector<queued_feature> feature_queue;
-
 void ensureDim(size_t dim) {
 	if (dim < 2) {
 		fprintf(stderr, "Geometry has fewer than 2 dimensions: %zu\n", dim);
@@ -424,28 +430,35 @@ void readFeature(protozero::pbf_reader &pbf, size_t dim, double e, std::vector<s
 }
 
 struct queue_run_arg {
+	geobuf_queue *q;
 	size_t start;
 	size_t end;
 	size_t segment;
 
-	queue_run_arg(size_t start1, size_t end1, size_t segment1)
-	    : start(start1), end(end1), segment(segment1) {
+	queue_run_arg(geobuf_queue *q1, size_t start1, size_t end1, size_t segment1)
+	    : q(q1), start(start1), end(end1), segment(segment1) {
 	}
 };
 
 void *run_parse_feature(void *v) {
 	struct queue_run_arg *qra = (struct queue_run_arg *) v;
+	geobuf_queue *q = qra->q;
 
 	for (size_t i = qra->start; i < qra->end; i++) {
-		struct queued_feature &qf = feature_queue[i];
-		readFeature(qf.pbf, qf.dim, qf.e, *qf.keys, &(*qf.sst)[qra->segment], qf.layer, qf.layername);
+		protozero::pbf_reader pbf(q->features[i].data, q->features[i].len);
+		readFeature(pbf, q->dim, q->e, *q->keys, &(*q->sst)[qra->segment], q->layer, q->layername);
 	}
 
 	return NULL;
 }
 
-void runQueue() {
-	if (feature_queue.size() == 0) {
+// Decode all the queued features at once, each thread taking a contiguous
+// range of them. As with parallel GeoJSON input, each thread's sequence
+// numbers start at the file offset of its first feature, so the features
+// sort back into file order and a Feature that expands into several
+// geometries can't collide with the next thread's.
+void runQueue(geobuf_queue *q) {
+	if (q->features.size() == 0) {
 		return;
 	}
 
@@ -455,12 +468,14 @@ void runQueue() {
 	pthreads.resize(CPUS);
 
 	for (size_t i = 0; i < CPUS; i++) {
-		*((*(feature_queue[0].sst))[i].layer_seq) = *((*(feature_queue[0].sst))[0].layer_seq) + feature_queue.size() * i / CPUS;
+		size_t start = q->features.size() * i / CPUS;
+		size_t end = q->features.size() * (i + 1) / CPUS;
 
-		qra.push_back(queue_run_arg(
-			feature_queue.size() * i / CPUS,
-			feature_queue.size() * (i + 1) / CPUS,
-			i));
+		if (start < end) {
+			*((*q->sst)[i].layer_seq) = q->initial_offset + (q->features[start].data - q->src);
+		}
+
+		qra.push_back(queue_run_arg(q, start, end, i));
 	}
 
 	for (size_t i = 0; i < CPUS; i++) {
@@ -479,26 +494,29 @@ void runQueue() {
 	}
 
 	// Lack of atomicity is OK, since we are single-threaded again here
-	long long was = *((*(feature_queue[0].sst))[CPUS - 1].layer_seq);
-	*((*(feature_queue[0].sst))[0].layer_seq) = was;
-	feature_queue.clear();
+	long long was = *((*q->sst)[0].layer_seq);
+	for (size_t i = 0; i < CPUS; i++) {
+		if (*((*q->sst)[i].layer_seq) > was) {
+			was = *((*q->sst)[i].layer_seq);
+		}
+	}
+	*((*q->sst)[0].layer_seq) = was;
+	q->features.clear();
 }
 
-void queueFeature(protozero::pbf_reader &pbf, size_t dim, double e, std::vector<std::string> &keys, std::vector<struct serialization_state> *sst, int layer, std::string layername) {
-	struct queued_feature qf;
-	qf.pbf = pbf;
-	qf.dim = dim;
-	qf.e = e;
-	qf.keys = &keys;
-	qf.sst = sst;
-	qf.layer = layer;
-	qf.layername = layername;
-
-	feature_queue.push_back(qf);
-
-	if (feature_queue.size() > CPUS * 500) {
-		runQueue();
+void queueFeature(protozero::data_view const &view, size_t dim, double e, geobuf_queue *q) {
+	// Features are only decoded after the scan, so if the precision changes
+	// partway through, decode the ones that used the old precision first.
+	if (q->features.size() > 0 && (dim != q->dim || e != q->e)) {
+		runQueue(q);
 	}
+	q->dim = dim;
+	q->e = e;
+
+	queued_feature qf;
+	qf.data = view.data();
+	qf.len = view.size();
+	q->features.push_back(qf);
 }
 
 void outBareGeometry(drawvec const &dv, int type, struct serialization_state *sst, int layer, std::string layername) {
@@ -518,12 +536,11 @@ void outBareGeometry(drawvec const &dv, int type, struct serialization_state *ss
 	serialize_feature(sst, sf);
 }
 
-void readFeatureCollection(protozero::pbf_reader &pbf, size_t dim, double e, std::vector<std::string> &keys, std::vector<struct serialization_state> *sst, int layer, std::string layername) {
+void readFeatureCollection(protozero::pbf_reader &pbf, size_t dim, double e, geobuf_queue *q) {
 	while (pbf.next()) {
 		switch (pbf.tag()) {
 		case 1: {
-			protozero::pbf_reader feature_reader(pbf.get_message());
-			queueFeature(feature_reader, dim, e, keys, sst, layer, layername);
+			queueFeature(pbf.get_view(), dim, e, q);
 			break;
 		}
 
@@ -540,6 +557,16 @@ void parse_geobuf(std::vector<struct serialization_state> *sst, const char *src,
 	double e = 1e6;
 	std::vector<std::string> keys;
 
+	// Scan the whole file for its features before decoding any of them,
+	// so that they can be split evenly among the threads
+	geobuf_queue q;
+	q.src = src;
+	q.initial_offset = *((*sst)[0].layer_seq);
+	q.keys = &keys;
+	q.sst = sst;
+	q.layer = layer;
+	q.layername = layername;
+
 	while (pbf.next()) {
 		switch (pbf.tag()) {
 		case 1:
@@ -556,17 +583,19 @@ void parse_geobuf(std::vector<struct serialization_state> *sst, const char *src,
 
 		case 4: {
 			protozero::pbf_reader feature_collection_reader(pbf.get_message());
-			readFeatureCollection(feature_collection_reader, dim, e, keys, sst, layer, layername);
+			readFeatureCollection(feature_collection_reader, dim, e, &q);
 			break;
 		}
 
 		case 5: {
-			protozero::pbf_reader feature_reader(pbf.get_message());
-			queueFeature(feature_reader, dim, e, keys, sst, layer, layername);
+			queueFeature(pbf.get_view(), dim, e, &q);
 			break;
 		}
 
 		case 6: {
+			// Keep file order with any features before it
+			runQueue(&q);
+
 			protozero::pbf_reader geometry_reader(pbf.get_message());
 			std::vector<drawvec_type> dv = readGeometry(geometry_reader, dim, e, keys);
 			for (size_t i = 0; i < dv.size(); i++) {
@@ -581,5 +610,5 @@ void parse_geobuf(std::vector<struct serialization_state> *sst, const char *src,
 		}
 	}
 
-	runQueue();
+	runQueue(&q);
 }
@@ -1,5 +1,12 @@
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <algorithm>
+#include <atomic>
 #include "geocsv.hpp"
 #include "mvt.hpp"
 #include "serial.hpp"
@@ -10,29 +17,19 @@
 #include "milo/dtoa_milo.h"
 #include "options.hpp"
 
-void parse_geocsv(std::vector<struct serialization_state> &sst, std::string fname, int layer, std::string layername) {
-	FILE *f;
+static std::atomic<int> warned_null(0);
 
-	if (fname.size() == 0) {
-		f = stdin;
-	} else {
-		f = fopen(fname.c_str(), "r");
-		if (f == NULL) {
-			perror(fname.c_str());
-			exit(EXIT_FAILURE);
-		}
+static void csv_check_utf8(std::string const &fname, std::string const &s) {
+	std::string err = check_utf8(s);
+	if (err != "") {
+		fprintf(stderr, "%s: %s\n", fname.c_str(), err.c_str());
+		exit(EXIT_FAILURE);
 	}
+}
 
-	std::string s;
-	std::vector<std::string> header;
-	ssize_t latcol = -1, loncol = -1;
-
-	if ((s = csv_getline(f)).size() > 0) {
-		std::string err = check_utf8(s);
-		if (err != "") {
-			fprintf(stderr, "%s: %s\n", fname.c_str(), err.c_str());
-			exit(EXIT_FAILURE);
-		}
+static void csv_header(std::string const &fname, std::string const &s, std::vector<std::string> &header, ssize_t &latcol, ssize_t &loncol) {
+	if (s.size() > 0) {
+		csv_check_utf8(fname, s);
 
 		header = csv_split(s.c_str());
 
@@ -55,79 +52,242 @@ void parse_geocsv(std::vector<struct serialization_state> &sst, std::string fnam
 		fprintf(stderr, "%s: Can't find \"lat\" and \"lon\" columns\n", fname.c_str());
 		exit(EXIT_FAILURE);
 	}
+}
 
-	size_t seq = 0;
-	while ((s = csv_getline(f)).size() > 0) {
-		std::string err = check_utf8(s);
-		if (err != "") {
-			fprintf(stderr, "%s: %s\n", fname.c_str(), err.c_str());
+struct csv_context {
+	std::string fname;
+	std::vector<std::string> header;
+	ssize_t latcol = -1;
+	ssize_t loncol = -1;
+	int layer = 0;
+	std::string layername;
+
+	// Only set when reading from a mapped file, to report line numbers from parallel chunks
+	const char *map = NULL;
+};
+
+// Line number of the record that starts at `where` within a mapped file,
+// or of the `seq`th record after the header when reading sequentially.
+// Only called when reporting an error, so counting newlines is not a concern.
+static size_t csv_lineno(csv_context const &ctx, const char *where, size_t seq) {
+	if (ctx.map == NULL) {
+		return seq + 1;
+	}
+
+	size_t line = 1;
+	for (const char *cp = ctx.map; cp < where; cp++) {
+		if (*cp == '\n') {
+			line++;
+		}
+	}
+	return line;
+}
+
+static void csv_feature(csv_context const &ctx, struct serialization_state *sst, std::string const &s, const char *where, size_t seq) {
+	csv_check_utf8(ctx.fname, s);
+
+	std::vector<std::string> line = csv_split(s.c_str());
+
+	if (line.size() != ctx.header.size()) {
+		fprintf(stderr, "%s:%zu: Mismatched column count: %zu in line, %zu in header\n", ctx.fname.c_str(), csv_lineno(ctx, where, seq), line.size(), ctx.header.size());
+		exit(EXIT_FAILURE);
+	}
+
+	if (line[ctx.loncol].empty() || line[ctx.latcol].empty()) {
+		if (!warned_null.exchange(1)) {
+			fprintf(stderr, "%s:%zu: null geometry (additional not reported)\n", ctx.fname.c_str(), csv_lineno(ctx, where, seq));
+		}
+		return;
+	}
+	double lon = atof(line[ctx.loncol].c_str());
+	double lat = atof(line[ctx.latcol].c_str());
+
+	long long x, y;
+	projection->project(lon, lat, 32, &x, &y);
+	drawvec dv;
+	dv.push_back(draw(VT_MOVETO, x, y));
+
+	std::vector<std::string> full_keys;
+	std::vector<serial_val> full_values;
+
+	for (size_t i = 0; i < line.size(); i++) {
+		if (i != (size_t) ctx.latcol && i != (size_t) ctx.loncol) {
+			line[i] = csv_dequote(line[i]);
+
+			serial_val sv;
+			if (is_number(line[i])) {
+				sv.type = mvt_double;
+			} else if (line[i].size() == 0 && prevent[P_EMPTY_CSV_COLUMNS]) {
+				sv.type = mvt_null;
+				line[i] = "null";
+			} else {
+				sv.type = mvt_string;
+			}
+			sv.s = line[i];
+
+			full_keys.push_back(ctx.header[i]);
+			full_values.push_back(sv);
+		}
+	}
+
+	serial_feature sf;
+
+	sf.layer = ctx.layer;
+	sf.layername = ctx.layername;
+	sf.segment = sst->segment;
+	sf.has_id = false;
+	sf.id = 0;
+	sf.has_tippecanoe_minzoom = false;
+	sf.has_tippecanoe_maxzoom = false;
+	sf.feature_minzoom = false;
+	sf.seq = *(sst->layer_seq);
+	sf.geometry = dv;
+	sf.t = 1;  // POINT
+	sf.full_keys = full_keys;
+	sf.full_values = full_values;
+
+	serialize_feature(sst, sf);
+}
+
+// The end of the line that `s` is part of, including its newline
+static const char *csv_line_end(const char *s, const char *end) {
+	const char *nl = (const char *) memchr(s, '\n', end - s);
+	if (nl == NULL) {
+		return end;
+	}
+	return nl + 1;
+}
+
+struct csv_chunk_arg {
+	csv_context const *ctx;
+	struct serialization_state *sst;
+	const char *start;
+	const char *end;
+};
+
+static void *run_parse_csv_chunk(void *v) {
+	csv_chunk_arg *a = (csv_chunk_arg *) v;
+
+	for (const char *s = a->start; s < a->end;) {
+		const char *e = csv_line_end(s, a->end);
+		csv_feature(*a->ctx, a->sst, std::string(s, e - s), s, 0);
+		s = e;
+	}
+
+	return NULL;
+}
+
+// Records are newline-terminated (csv_getline() never continues a record across
+// a newline, even within quotes), so the body of a mapped file can be cut at any
+// newline and the pieces parsed independently. Each chunk gets its own
+// serialization state and sequence numbers starting from its byte offset,
+// so features still sort into their original order.
+static void parse_geocsv_map(std::vector<struct serialization_state> &sst, csv_context &ctx, const char *map, size_t len) {
+	ctx.map = map;
+
+	const char *end = map + len;
+	const char *body = csv_line_end(map, end);
+	csv_header(ctx.fname, std::string(map, body - map), ctx.header, ctx.latcol, ctx.loncol);
+
+	size_t nchunks = sst.size();
+	std::vector<const char *> starts;
+	starts.push_back(body);
+	for (size_t i = 1; i < nchunks; i++) {
+		const char *s = body + (end - body) * i / nchunks;
+		if (s < starts.back()) {
+			s = starts.back();
+		}
+		if (s > body && s[-1] != '\n') {
+			s = csv_line_end(s, end);
+		}
+		starts.push_back(s);
+	}
+	starts.push_back(end);
+
+	long long initial_offset = *(sst[0].layer_seq);
+
+	std::vector<csv_chunk_arg> args;
+	args.resize(nchunks);
+	std::vector<pthread_t> pthreads;
+	pthreads.resize(nchunks);
+
+	for (size_t i = 0; i < nchunks; i++) {
+		*(sst[i].layer_seq) = initial_offset + (starts[i] - map);
+
+		args[i].ctx = &ctx;
+		args[i].sst = &sst[i];
+		args[i].start = starts[i];
+		args[i].end = starts[i + 1];
+
+		if (pthread_create(&pthreads[i], NULL, run_parse_csv_chunk, &args[i]) != 0) {
+			perror("pthread_create");
 			exit(EXIT_FAILURE);
 		}
+	}
 
-		seq++;
-		std::vector<std::string> line = csv_split(s.c_str());
+	for (size_t i = 0; i < nchunks; i++) {
+		void *retval;
+
+		if (pthread_join(pthreads[i], &retval) != 0) {
+			perror("pthread_join");
+		}
+	}
 
-		if (line.size() != header.size()) {
-			fprintf(stderr, "%s:%zu: Mismatched column count: %zu in line, %zu in header\n", fname.c_str(), seq + 1, line.size(), header.size());
+	// The last chunk's sequence is past every other chunk's
+	long long was = *(sst[nchunks - 1].layer_seq);
+	*(sst[0].layer_seq) = was;
+}
+
+void parse_geocsv(std::vector<struct serialization_state> &sst, std::string fname, int layer, std::string layername) {
+	csv_context ctx;
+	ctx.fname = fname;
+	ctx.layer = layer;
+	ctx.layername = layername;
+
+	FILE *f;
+
+	if (fname.size() == 0) {
+		f = stdin;
+	} else {
+		int fd = open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			perror(fname.c_str());
 			exit(EXIT_FAILURE);
 		}
 
-		if (line[loncol].empty() || line[latcol].empty()) {
-			static int warned = 0;
-			if (!warned) {
-				fprintf(stderr, "%s:%zu: null geometry (additional not reported)\n", fname.c_str(), seq + 1);
-				warned = 1;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+			char *map = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map != MAP_FAILED) {
+				madvise(map, st.st_size, MADV_SEQUENTIAL);
+				parse_geocsv_map(sst, ctx, map, st.st_size);
+
+				if (munmap(map, st.st_size) != 0) {
+					perror("munmap source file");
+					exit(EXIT_FAILURE);
+				}
+				if (close(fd) != 0) {
+					perror("close");
+					exit(EXIT_FAILURE);
+				}
+				return;
 			}
-			continue;
 		}
-		double lon = atof(line[loncol].c_str());
-		double lat = atof(line[latcol].c_str());
-
-		long long x, y;
-		projection->project(lon, lat, 32, &x, &y);
-		drawvec dv;
-		dv.push_back(draw(VT_MOVETO, x, y));
-
-		std::vector<std::string> full_keys;
-		std::vector<serial_val> full_values;
-
-		for (size_t i = 0; i < line.size(); i++) {
-			if (i != (size_t) latcol && i != (size_t) loncol) {
-				line[i] = csv_dequote(line[i]);
-
-				serial_val sv;
-				if (is_number(line[i])) {
-					sv.type = mvt_double;
-				} else if (line[i].size() == 0 && prevent[P_EMPTY_CSV_COLUMNS]) {
-					sv.type = mvt_null;
-					line[i] = "null";
-				} else {
-					sv.type = mvt_string;
-				}
-				sv.s = line[i];
 
-				full_keys.push_back(header[i]);
-				full_values.push_back(sv);
-			}
+		f = fdopen(fd, "r");
+		if (f == NULL) {
+			perror(fname.c_str());
+			exit(EXIT_FAILURE);
 		}
+	}
+
+	csv_header(fname, csv_getline(f), ctx.header, ctx.latcol, ctx.loncol);
 
-		serial_feature sf;
-
-		sf.layer = layer;
-		sf.layername = layername;
-		sf.segment = sst[0].segment;
-		sf.has_id = false;
-		sf.id = 0;
-		sf.has_tippecanoe_minzoom = false;
-		sf.has_tippecanoe_maxzoom = false;
-		sf.feature_minzoom = false;
-		sf.seq = *(sst[0].layer_seq);
-		sf.geometry = dv;
-		sf.t = 1;  // POINT
-		sf.full_keys = full_keys;
-		sf.full_values = full_values;
-
-		serialize_feature(&sst[0], sf);
+	std::string s;
+	size_t seq = 0;
+	while ((s = csv_getline(f)).size() > 0) {
+		seq++;
+		csv_feature(ctx, &sst[0], s, NULL, seq);
 	}
 
 	if (fname.size() != 0) {
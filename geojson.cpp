@@ -59,7 +59,7 @@ int serialize_geojson_feature(struct serialization_state *sst, json_object *geom
 	}
 
 	json_object *coordinates = json_hash_get(geometry, "coordinates");
-	if (coordinates == NULL || coordinates->type != JSON_ARRAY) {
+	if (coordinates == NULL || (coordinates->type != JSON_ARRAY && coordinates->type != JSON_COORDINATES)) {
 		fprintf(stderr, "%s:%d: feature without coordinates array\n", sst->fname, sst->line);
 		json_context(feature);
 		return 0;
@@ -293,6 +293,14 @@ void parse_json(struct serialization_state *sst, json_pull *jp, int layer, std::
 	jsa.layer = layer;
 	jsa.layername = layername;
 
+	// Coordinates are only ever walked by parse_geometry(),
+	// which can read them without an object per number
+	jp->pack_coordinates = 1;
+
+	// Each feature is freed as soon as it has been serialized,
+	// so its objects can come from a block that is then reused
+	jp->use_arena = 1;
+
 	parse_json(&jsa, jp);
 }
 
@@ -24,7 +24,7 @@
 static int pnpoly(drawvec &vert, size_t start, size_t nvert, long long testx, long long testy);
 static int clip(double *x0, double *y0, double *x1, double *y1, double xmin, double ymin, double xmax, double ymax);
 
-drawvec decode_geometry(FILE *meta, std::atomic<long long> *geompos, int z, unsigned tx, unsigned ty, long long *bbox, unsigned initial_x, unsigned initial_y) {
+drawvec decode_geometry(char **meta, int z, unsigned tx, unsigned ty, long long *bbox, unsigned initial_x, unsigned initial_y) {
 	drawvec out;
 
 	bbox[0] = LLONG_MAX;
@@ -37,10 +37,7 @@ drawvec decode_geometry(FILE *meta, std::atomic<long long> *geompos, int z, unsi
 	while (1) {
 		draw d;
 
-		if (!deserialize_byte_io(meta, &d.op, geompos)) {
-			fprintf(stderr, "Internal error: Unexpected end of file in geometry\n");
-			exit(EXIT_FAILURE);
-		}
+		deserialize_byte(meta, &d.op);
 		if (d.op == VT_END) {
 			break;
 		}
@@ -48,8 +45,8 @@ drawvec decode_geometry(FILE *meta, std::atomic<long long> *geompos, int z, unsi
 		if (d.op == VT_MOVETO || d.op == VT_LINETO) {
 			long long dx, dy;
 
-			deserialize_long_long_io(meta, &dx, geompos);
-			deserialize_long_long_io(meta, &dy, geompos);
+			deserialize_long_long(meta, &dx);
+			deserialize_long_long(meta, &dy);
 
 			wx += dx * (1 << geometry_scale);
 			wy += dy * (1 << geometry_scale);
@@ -93,30 +90,36 @@ void to_tile_scale(drawvec &geom, int z, int detail) {
 }
 
 drawvec remove_noop(drawvec geom, int type, int shift) {
+	remove_noop_in_place(geom, type, shift);
+	return geom;
+}
+
+// Each pass compacts the geometry toward its start. Nothing is written
+// beyond the point being read, and a point is only ever overwritten by
+// itself before the next one looks back at it.
+void remove_noop_in_place(drawvec &geom, int type, int shift) {
 	// first pass: remove empty linetos
 
 	long long x = 0, y = 0;
-	drawvec out;
+	size_t out = 0;
 
 	for (size_t i = 0; i < geom.size(); i++) {
 		if (geom[i].op == VT_LINETO && (geom[i].x >> shift) == x && (geom[i].y >> shift) == y) {
 			continue;
 		}
 
-		if (geom[i].op == VT_CLOSEPATH) {
-			out.push_back(geom[i]);
-		} else { /* moveto or lineto */
-			out.push_back(geom[i]);
+		if (geom[i].op != VT_CLOSEPATH) { /* moveto or lineto */
 			x = geom[i].x >> shift;
 			y = geom[i].y >> shift;
 		}
+		geom[out++] = geom[i];
 	}
+	geom.resize(out);
 
 	// second pass: remove unused movetos
 
 	if (type != VT_POINT) {
-		geom = out;
-		out.resize(0);
+		out = 0;
 
 		for (size_t i = 0; i < geom.size(); i++) {
 			if (geom[i].op == VT_MOVETO) {
@@ -135,15 +138,15 @@ drawvec remove_noop(drawvec geom, int type, int shift) {
 				}
 			}
 
-			out.push_back(geom[i]);
+			geom[out++] = geom[i];
 		}
+		geom.resize(out);
 	}
 
 	// second pass: remove empty movetos
 
 	if (type == VT_LINE) {
-		geom = out;
-		out.resize(0);
+		out = 0;
 
 		for (size_t i = 0; i < geom.size(); i++) {
 			if (geom[i].op == VT_MOVETO) {
@@ -152,11 +155,10 @@ drawvec remove_noop(drawvec geom, int type, int shift) {
 				}
 			}
 
-			out.push_back(geom[i]);
+			geom[out++] = geom[i];
 		}
+		geom.resize(out);
 	}
-
-	return out;
 }
 
 double get_area(drawvec &geom, size_t i, size_t j) {
@@ -223,7 +225,7 @@ static void decode_clipped(mapbox::geometry::multi_polygon<long long> &t, drawve
 drawvec clean_or_clip_poly(drawvec &geom, int z, int buffer, bool clip) {
 	mapbox::geometry::wagyu::wagyu<long long> wagyu;
 
-	geom = remove_noop(geom, VT_POLYGON, 0);
+	remove_noop_in_place(geom, VT_POLYGON, 0);
 	for (size_t i = 0; i < geom.size(); i++) {
 		if (geom[i].op == VT_MOVETO) {
 			size_t j;
@@ -347,7 +349,7 @@ static int pnpoly(drawvec &vert, size_t start, size_t nvert, long long testx, lo
 }
 
 void check_polygon(drawvec &geom) {
-	geom = remove_noop(geom, VT_POLYGON, 0);
+	remove_noop_in_place(geom, VT_POLYGON, 0);
 
 	mapbox::geometry::multi_polygon<long long> mp;
 	for (size_t i = 0; i < geom.size(); i++) {
@@ -432,7 +434,15 @@ void check_polygon(drawvec &geom) {
 }
 
 drawvec close_poly(drawvec &geom) {
-	drawvec out;
+	drawvec out = geom;
+	close_poly_in_place(out);
+	return out;
+}
+
+// Each ring keeps its length, trading its closing point for a closepath,
+// so it can always be moved down over whatever was dropped before it.
+void close_poly_in_place(drawvec &geom) {
+	size_t out = 0;
 
 	for (size_t i = 0; i < geom.size(); i++) {
 		if (geom[i].op == VT_MOVETO) {
@@ -450,15 +460,15 @@ drawvec close_poly(drawvec &geom) {
 			}
 
 			for (size_t n = i; n < j - 1; n++) {
-				out.push_back(geom[n]);
+				geom[out++] = geom[n];
 			}
-			out.push_back(draw(VT_CLOSEPATH, 0, 0));
+			geom[out++] = draw(VT_CLOSEPATH, 0, 0);
 
 			i = j - 1;
 		}
 	}
 
-	return out;
+	geom.resize(out);
 }
 
 drawvec simple_clip_poly(drawvec &geom, long long minx, long long miny, long long maxx, long long maxy) {
@@ -659,7 +669,26 @@ drawvec clip_lines(drawvec &geom, int z, long long buffer) {
 }
 
 drawvec clip_lines(drawvec &geom, long long minx, long long miny, long long maxx, long long maxy) {
+	drawvec out = geom;
+	clip_lines_in_place(out, minx, miny, maxx, maxy);
+	return out;
+}
+
+void clip_lines_in_place(drawvec &geom, int z, long long buffer) {
+	long long min = 0;
+	long long area = 1LL << (32 - z);
+	min -= buffer * area / 256;
+	area += buffer * area / 256;
+
+	clip_lines_in_place(geom, min, min, area, area);
+}
+
+// Segments that are inside or entirely outside the bounds are handled
+// in place. Only once a segment has to be cut in two is a new geometry
+// started, copying what has been done so far.
+void clip_lines_in_place(drawvec &geom, long long minx, long long miny, long long maxx, long long maxy) {
 	drawvec out;
+	bool copying = false;
 
 	for (size_t i = 0; i < geom.size(); i++) {
 		if (i > 0 && (geom[i - 1].op == VT_MOVETO || geom[i - 1].op == VT_LINETO) && geom[i].op == VT_LINETO) {
@@ -672,20 +701,29 @@ drawvec clip_lines(drawvec &geom, long long minx, long long miny, long long maxx
 			int c = clip(&x1, &y1, &x2, &y2, minx, miny, maxx, maxy);
 
 			if (c > 1) {  // clipped
+				if (!copying) {
+					out.reserve(geom.size() + 2);
+					out.insert(out.end(), geom.begin(), geom.begin() + i);
+					copying = true;
+				}
+
 				out.push_back(draw(VT_MOVETO, x1, y1));
 				out.push_back(draw(VT_LINETO, x2, y2));
 				out.push_back(draw(VT_MOVETO, geom[i].x, geom[i].y));
-			} else if (c == 1) {  // unchanged
-				out.push_back(geom[i]);
-			} else {  // clipped away entirely
-				out.push_back(draw(VT_MOVETO, geom[i].x, geom[i].y));
+				continue;
+			} else if (c == 0) {  // clipped away entirely
+				geom[i] = draw(VT_MOVETO, geom[i].x, geom[i].y);
 			}
-		} else {
+		}
+
+		if (copying) {
 			out.push_back(geom[i]);
 		}
 	}
 
-	return out;
+	if (copying) {
+		geom.swap(out);
+	}
 }
 
 static double square_distance_from_line(long long point_x, long long point_y, long long segA_x, long long segA_y, long long segB_x, long long segB_y) {
@@ -802,7 +840,8 @@ drawvec impose_tile_boundaries(drawvec &geom, long long extent) {
 	return out;
 }
 
-drawvec simplify_lines(drawvec &geom, int z, int detail, bool mark_tile_bounds, double simplification, size_t retain, drawvec const &shared_nodes) {
+// Marks the points of the geometry that simplification keeps, returning how many there are
+static size_t mark_necessary(drawvec &geom, int z, int detail, bool mark_tile_bounds, double simplification, size_t retain, drawvec const &shared_nodes) {
 	int res = 1 << (32 - detail - z);
 	long long area = 1LL << (32 - z);
 
@@ -846,6 +885,19 @@ drawvec simplify_lines(drawvec &geom, int z, int detail, bool mark_tile_bounds,
 		}
 	}
 
+	size_t necessary = 0;
+	for (size_t i = 0; i < geom.size(); i++) {
+		if (geom[i].necessary) {
+			necessary++;
+		}
+	}
+
+	return necessary;
+}
+
+drawvec simplify_lines(drawvec &geom, int z, int detail, bool mark_tile_bounds, double simplification, size_t retain, drawvec const &shared_nodes) {
+	mark_necessary(geom, z, detail, mark_tile_bounds, simplification, retain, shared_nodes);
+
 	drawvec out;
 	for (size_t i = 0; i < geom.size(); i++) {
 		if (geom[i].necessary) {
@@ -856,6 +908,25 @@ drawvec simplify_lines(drawvec &geom, int z, int detail, bool mark_tile_bounds,
 	return out;
 }
 
+// Simplifies the geometry in place, unless that would leave fewer than
+// min_points points, in which case it is left as it was before the
+// unnecessary points would have been removed. Returns whether it was simplified.
+bool simplify_lines_in_place(drawvec &geom, int z, int detail, bool mark_tile_bounds, double simplification, size_t retain, drawvec const &shared_nodes, size_t min_points) {
+	if (mark_necessary(geom, z, detail, mark_tile_bounds, simplification, retain, shared_nodes) < min_points) {
+		return false;
+	}
+
+	size_t out = 0;
+	for (size_t i = 0; i < geom.size(); i++) {
+		if (geom[i].necessary) {
+			geom[out++] = geom[i];
+		}
+	}
+	geom.resize(out);
+
+	return true;
+}
+
 drawvec reorder_lines(drawvec &geom) {
 	// Only reorder simple linestrings with a single moveto
 
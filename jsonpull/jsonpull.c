@@ -4,8 +4,15 @@
 #include <ctype.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include "jsonpull.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define BUFFER 10000
 
 json_pull *json_begin(ssize_t (*read)(struct json_pull *, char *buffer, size_t n), void *source) {
@@ -19,6 +26,9 @@ json_pull *json_begin(ssize_t (*read)(struct json_pull *, char *buffer, size_t n
 	j->line = 1;
 	j->container = NULL;
 	j->root = NULL;
+	j->pack_coordinates = 0;
+	j->use_arena = 0;
+	j->arena = NULL;
 
 	j->read = read;
 	j->source = source;
@@ -85,8 +95,13 @@ json_pull *json_begin_string(const char *s) {
 	return json_begin(read_string, (void *) s);
 }
 
+static void arena_retire(struct json_arena *a);
+
 void json_end(json_pull *p) {
 	json_free(p->root);
+	if (p->arena != NULL) {
+		arena_retire(p->arena);
+	}
 	free(p->buffer);
 	free(p);
 }
@@ -101,20 +116,394 @@ static inline int read_wrap(json_pull *j) {
 	return c;
 }
 
-#define SIZE_FOR(i, size) ((size_t)((((i) + 31) & ~31) * size))
+/////////////////////////// Scanning
+
+// The scanners below look ahead in the buffer for the end of a run of
+// characters that need no individual attention, 32 or 16 bytes at a time
+// where the instruction set allows, so the tokenizer can skip or copy the
+// whole run at once instead of going through next() for each byte.
+
+// How many bytes at the start of s[0..n) are neither a quote, a backslash,
+// nor a control character, and so can be copied into a string as they are
+static size_t string_span(const char *s, size_t n) {
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	const __m256i quote = _mm256_set1_epi8('"');
+	const __m256i backslash = _mm256_set1_epi8('\\');
+	const __m256i control = _mm256_set1_epi8(' ' - 1);
+
+	for (; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+		__m256i special = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)),
+						  _mm256_cmpeq_epi8(_mm256_min_epu8(v, control), v));
+		unsigned mask = _mm256_movemask_epi8(special);
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+#elif defined(__SSE2__)
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i control = _mm_set1_epi8(' ' - 1);
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+					       _mm_cmpeq_epi8(_mm_min_epu8(v, control), v));
+		unsigned mask = _mm_movemask_epi8(special);
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+#endif
 
-static json_object *fabricate_object(json_pull *jp, json_object *parent, json_type type) {
-	json_object *o = malloc(sizeof(struct json_object));
-	if (o == NULL) {
+	for (; i < n; i++) {
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\' || c < ' ') {
+			break;
+		}
+	}
+
+	return i;
+}
+
+// How many bytes at the start of s[0..n) are spaces, tabs, or line breaks,
+// adding the number of newlines among them to *lines
+static size_t whitespace_span(const char *s, size_t n, int *lines) {
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	const __m256i space = _mm256_set1_epi8(' ');
+	const __m256i tab = _mm256_set1_epi8('\t');
+	const __m256i cr = _mm256_set1_epi8('\r');
+	const __m256i nl = _mm256_set1_epi8('\n');
+
+	for (; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+		__m256i newline = _mm256_cmpeq_epi8(v, nl);
+		__m256i white = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, tab)),
+						_mm256_or_si256(_mm256_cmpeq_epi8(v, cr), newline));
+		unsigned other = ~(unsigned) _mm256_movemask_epi8(white);
+		unsigned newlines = _mm256_movemask_epi8(newline);
+		if (other != 0) {
+			int stop = __builtin_ctz(other);
+			*lines += __builtin_popcount(newlines & ((1U << stop) - 1));
+			return i + stop;
+		}
+		*lines += __builtin_popcount(newlines);
+	}
+#elif defined(__SSE2__)
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i nl = _mm_set1_epi8('\n');
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i newline = _mm_cmpeq_epi8(v, nl);
+		__m128i white = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab)),
+					     _mm_or_si128(_mm_cmpeq_epi8(v, cr), newline));
+		unsigned other = ~(unsigned) _mm_movemask_epi8(white) & 0xFFFF;
+		unsigned newlines = _mm_movemask_epi8(newline);
+		if (other != 0) {
+			int stop = __builtin_ctz(other);
+			*lines += __builtin_popcount(newlines & ((1U << stop) - 1));
+			return i + stop;
+		}
+		*lines += __builtin_popcount(newlines);
+	}
+#endif
+
+	for (; i < n; i++) {
+		char c = s[i];
+		if (c == '\n') {
+			(*lines)++;
+		} else if (c != ' ' && c != '\t' && c != '\r') {
+			break;
+		}
+	}
+
+	return i;
+}
+
+static int is_digit(char c) {
+	return c >= '0' && c <= '9';
+}
+
+// Powers of ten that can be represented exactly as doubles
+static const double exact_powers[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// If a complete, well-formed number starts at s[0] and ends before s[n],
+// return its length and set *value to what atof() would return for it.
+// Otherwise return 0, so the caller can go through the general case,
+// which also produces the error messages for malformed numbers.
+static size_t number_span(const char *s, size_t n, double *value) {
+	size_t i = 0;
+	int negative = 0;
+	uint64_t mantissa = 0;
+	int digits_ok = 1;  // whether the mantissa still holds every digit
+	long exponent = 0;
+
+	if (i < n && s[i] == '-') {
+		negative = 1;
+		i++;
+	}
+
+	if (i < n && s[i] == '0') {
+		i++;
+	} else if (i < n && s[i] >= '1' && s[i] <= '9') {
+		for (; i < n && is_digit(s[i]); i++) {
+			if (mantissa > (UINT64_MAX - 9) / 10) {
+				digits_ok = 0;
+			} else {
+				mantissa = mantissa * 10 + (s[i] - '0');
+			}
+		}
+	} else {
+		return 0;
+	}
+
+	if (i < n && s[i] == '.') {
+		i++;
+		if (i >= n || !is_digit(s[i])) {
+			return 0;
+		}
+		for (; i < n && is_digit(s[i]); i++) {
+			if (mantissa > (UINT64_MAX - 9) / 10) {
+				digits_ok = 0;
+			} else {
+				mantissa = mantissa * 10 + (s[i] - '0');
+				exponent--;
+			}
+		}
+	}
+
+	if (i < n && (s[i] == 'e' || s[i] == 'E')) {
+		int exponent_negative = 0;
+		long e = 0;
+
+		i++;
+		if (i < n && (s[i] == '+' || s[i] == '-')) {
+			exponent_negative = s[i] == '-';
+			i++;
+		}
+		if (i >= n || !is_digit(s[i])) {
+			return 0;
+		}
+		for (; i < n && is_digit(s[i]); i++) {
+			if (e < 100000) {
+				e = e * 10 + (s[i] - '0');
+			}
+		}
+
+		exponent += exponent_negative ? -e : e;
+	}
+
+	// The number might continue into the next buffer
+	if (i >= n) {
+		return 0;
+	}
+
+	// A mantissa and power of ten that are both exact give a correctly
+	// rounded result from a single multiplication or division, the same
+	// as atof(). Anything else goes to atof() itself.
+	if (digits_ok && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+		double d = (double) mantissa;
+		if (exponent < 0) {
+			d /= exact_powers[-exponent];
+		} else {
+			d *= exact_powers[exponent];
+		}
+		*value = negative ? -d : d;
+	} else {
+		char *tmp = malloc(i + 1);
+		if (tmp == NULL) {
+			perror("Out of memory");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(tmp, s, i);
+		tmp[i] = '\0';
+		*value = atof(tmp);
+		free(tmp);
+	}
+
+	return i;
+}
+
+/////////////////////////// Arena
+
+// With use_arena, objects and the strings and arrays they point to are
+// carved out of large blocks instead of being allocated individually.
+// Each block counts its allocations that have not been released yet.
+// When that reaches zero, as it does after each feature of a stream of
+// features has been freed, the parser's current block starts over from
+// the beginning, and any older block is freed as a whole.
+
+#define ARENA_BLOCK 65536
+
+struct json_arena {
+	size_t live;
+	size_t used;
+	size_t size;
+	int retired;  // no longer the current block of any parser
+};
+
+// Each allocation is preceded by a pointer back to its block,
+// padded to keep the allocation aligned
+#define ARENA_HEADER 16
+#define ARENA_ROUND(n) (((n) + 15) & ~((size_t) 15))
+#define ARENA_DATA(a) ((char *) (a) + ARENA_ROUND(sizeof(struct json_arena)))
+
+// Whether an allocation is small enough to share a block with others
+#define ARENA_SHARED(n) (ARENA_HEADER + ARENA_ROUND(n) <= ARENA_BLOCK / 8)
+
+static struct json_arena *arena_block(size_t size) {
+	struct json_arena *a = malloc(ARENA_ROUND(sizeof(struct json_arena)) + size);
+	if (a == NULL) {
 		perror("Out of memory");
 		exit(EXIT_FAILURE);
 	}
+
+	a->live = 0;
+	a->used = 0;
+	a->size = size;
+	a->retired = 0;
+	return a;
+}
+
+static void arena_retire(struct json_arena *a) {
+	if (a->live == 0) {
+		free(a);
+	} else {
+		a->retired = 1;
+	}
+}
+
+static void *arena_alloc(json_pull *j, size_t n) {
+	size_t need = ARENA_HEADER + ARENA_ROUND(n);
+	struct json_arena *a;
+
+	if (j == NULL || !ARENA_SHARED(n)) {
+		// Too big to share a block, or for an object
+		// that has been disconnected from its parser
+		a = arena_block(need);
+		a->retired = 1;
+	} else {
+		a = j->arena;
+		if (a == NULL || a->used + need > a->size) {
+			if (a != NULL) {
+				arena_retire(a);
+			}
+			a = j->arena = arena_block(ARENA_BLOCK);
+		}
+	}
+
+	char *p = ARENA_DATA(a) + a->used;
+	*(struct json_arena **) p = a;
+	a->used += need;
+	a->live++;
+	return p + ARENA_HEADER;
+}
+
+static void arena_release(void *p) {
+	struct json_arena *a = *(struct json_arena **) ((char *) p - ARENA_HEADER);
+
+	a->live--;
+	if (a->live == 0) {
+		if (a->retired) {
+			free(a);
+		} else {
+			a->used = 0;
+		}
+	}
+}
+
+// Allocation for an object or anything it points to,
+// from the arena if the object belongs to one
+static void *object_alloc(json_pull *j, int arena, size_t n) {
+	if (arena) {
+		return arena_alloc(j, n);
+	}
+
+	void *p = malloc(n);
+	if (p == NULL) {
+		perror("Out of memory");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static void *object_realloc(json_pull *j, int arena, void *p, size_t old, size_t n) {
+	if (arena) {
+		void *q = arena_alloc(j, n);
+		if (p != NULL) {
+			memcpy(q, p, old < n ? old : n);
+			arena_release(p);
+		}
+		return q;
+	}
+
+	p = realloc(p, n);
+	if (p == NULL) {
+		perror("Out of memory");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static void object_free(int arena, void *p) {
+	if (p == NULL) {
+		return;
+	}
+
+	if (arena) {
+		arena_release(p);
+	} else {
+		free(p);
+	}
+}
+
+// Which of an arena object's string and numbers were left in malloc
+#define MALLOCED_STRING 1
+#define MALLOCED_NUMBERS 2
+
+// Hand over something built with malloc to an object,
+// moving it into the arena if the object belongs to one
+// and it is small enough to share a block. Anything larger
+// would get a block of its own anyway, so it stays where it is.
+static void *object_adopt(json_object *o, void *p, size_t n, int which) {
+	if (!o->arena || p == NULL) {
+		return p;
+	}
+	if (!ARENA_SHARED(n)) {
+		o->malloced |= which;
+		return p;
+	}
+
+	void *q = arena_alloc(o->parser, n);
+	memcpy(q, p, n);
+	free(p);
+	return q;
+}
+
+#define SIZE_FOR(i, size) ((size_t)((((i) + 31) & ~31) * size))
+
+static json_object *fabricate_object(json_pull *jp, json_object *parent, json_type type) {
+	int arena = jp != NULL && jp->use_arena;
+	json_object *o = object_alloc(jp, arena, sizeof(struct json_object));
+	o->arena = arena;
 	o->type = type;
 	o->parent = parent;
 	o->array = NULL;
 	o->keys = NULL;
 	o->values = NULL;
 	o->length = 0;
+	o->numbers = NULL;
+	o->malloced = 0;
 	o->parser = jp;
 	return o;
 }
@@ -131,18 +520,14 @@ static json_object *add_object(json_pull *j, json_type type) {
 						fprintf(stderr, "Array size overflow\n");
 						exit(EXIT_FAILURE);
 					}
-					c->array = realloc(c->array, SIZE_FOR(c->length + 1, sizeof(json_object *)));
-					if (c->array == NULL) {
-						perror("Out of memory");
-						exit(EXIT_FAILURE);
-					}
+					c->array = object_realloc(j, c->arena, c->array, SIZE_FOR(c->length, sizeof(json_object *)), SIZE_FOR(c->length + 1, sizeof(json_object *)));
 				}
 
 				c->array[c->length++] = o;
 				c->expect = JSON_COMMA;
 			} else {
 				j->error = "Expected a comma, not a list item";
-				free(o);
+				object_free(o->arena, o);
 				return NULL;
 			}
 		} else if (c->type == JSON_HASH) {
@@ -152,7 +537,7 @@ static json_object *add_object(json_pull *j, json_type type) {
 			} else if (c->expect == JSON_KEY) {
 				if (type != JSON_STRING) {
 					j->error = "Hash key is not a string";
-					free(o);
+					object_free(o->arena, o);
 					return NULL;
 				}
 
@@ -161,12 +546,8 @@ static json_object *add_object(json_pull *j, json_type type) {
 						fprintf(stderr, "Hash size overflow\n");
 						exit(EXIT_FAILURE);
 					}
-					c->keys = realloc(c->keys, SIZE_FOR(c->length + 1, sizeof(json_object *)));
-					c->values = realloc(c->values, SIZE_FOR(c->length + 1, sizeof(json_object *)));
-					if (c->keys == NULL || c->values == NULL) {
-						perror("Out of memory");
-						exit(EXIT_FAILURE);
-					}
+					c->keys = object_realloc(j, c->arena, c->keys, SIZE_FOR(c->length, sizeof(json_object *)), SIZE_FOR(c->length + 1, sizeof(json_object *)));
+					c->values = object_realloc(j, c->arena, c->values, SIZE_FOR(c->length, sizeof(json_object *)), SIZE_FOR(c->length + 1, sizeof(json_object *)));
 				}
 
 				c->keys[c->length] = o;
@@ -175,7 +556,7 @@ static json_object *add_object(json_pull *j, json_type type) {
 				c->expect = JSON_COLON;
 			} else {
 				j->error = "Expected a comma or colon";
-				free(o);
+				object_free(o->arena, o);
 				return NULL;
 			}
 		}
@@ -227,7 +608,7 @@ static void string_init(struct string *s) {
 static void string_append(struct string *s, char c) {
 	if (s->n + 2 >= s->nalloc) {
 		size_t prev = s->nalloc;
-		s->nalloc += 500;
+		s->nalloc += 500 + s->nalloc / 2;
 		if (s->nalloc <= prev) {
 			fprintf(stderr, "String size overflowed\n");
 			exit(EXIT_FAILURE);
@@ -243,12 +624,32 @@ static void string_append(struct string *s, char c) {
 	s->buf[s->n] = '\0';
 }
 
+static void string_append_n(struct string *s, const char *add, size_t len) {
+	if (s->n + len + 1 >= s->nalloc) {
+		size_t prev = s->nalloc;
+		s->nalloc += 500 + len + s->nalloc / 2;
+		if (s->nalloc <= prev) {
+			fprintf(stderr, "String size overflowed\n");
+			exit(EXIT_FAILURE);
+		}
+		s->buf = realloc(s->buf, s->nalloc);
+		if (s->buf == NULL) {
+			perror("Out of memory");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	memcpy(s->buf + s->n, add, len);
+	s->n += len;
+	s->buf[s->n] = '\0';
+}
+
 static void string_append_string(struct string *s, char *add) {
 	size_t len = strlen(add);
 
 	if (s->n + len + 1 >= s->nalloc) {
 		size_t prev = s->nalloc;
-		s->nalloc += 500 + len;
+		s->nalloc += 500 + len + s->nalloc / 2;
 		if (s->nalloc <= prev) {
 			fprintf(stderr, "String size overflowed\n");
 			exit(EXIT_FAILURE);
@@ -271,6 +672,255 @@ static void string_free(struct string *s) {
 	free(s->buf);
 }
 
+// Reads the rest of a number, whose first character c has already been read,
+// into val. Returns 0, with j->error set, if the number is malformed.
+static int read_number(json_pull *j, int c, struct string *val) {
+	if (c == '-') {
+		string_append(val, c);
+		c = read_wrap(j);
+	}
+
+	if (c == '0') {
+		string_append(val, c);
+	} else if (c >= '1' && c <= '9') {
+		string_append(val, c);
+		c = peek(j);
+
+		while (c >= '0' && c <= '9') {
+			string_append(val, read_wrap(j));
+			c = peek(j);
+		}
+	}
+
+	if (peek(j) == '.') {
+		string_append(val, read_wrap(j));
+
+		c = peek(j);
+		if (c < '0' || c > '9') {
+			j->error = "Decimal point without digits";
+			return 0;
+		}
+		while (c >= '0' && c <= '9') {
+			string_append(val, read_wrap(j));
+			c = peek(j);
+		}
+	}
+
+	c = peek(j);
+	if (c == 'e' || c == 'E') {
+		string_append(val, read_wrap(j));
+
+		c = peek(j);
+		if (c == '+' || c == '-') {
+			string_append(val, read_wrap(j));
+		}
+
+		c = peek(j);
+		if (c < '0' || c > '9') {
+			j->error = "Exponent without digits";
+			return 0;
+		}
+		while (c >= '0' && c <= '9') {
+			string_append(val, read_wrap(j));
+			c = peek(j);
+		}
+	}
+
+	return 1;
+}
+
+/////////////////////////// Coordinates
+
+// Whether the array that is about to begin is the value of a "coordinates" key
+// that should be read as a single JSON_COORDINATES object
+static int packable_coordinates(json_pull *j) {
+	json_object *c = j->container;
+
+	if (c == NULL || c->type != JSON_HASH || c->expect != JSON_VALUE) {
+		return 0;
+	}
+	if (c->keys[c->length - 1]->type != JSON_STRING || strcmp(c->keys[c->length - 1]->string, "coordinates") != 0) {
+		return 0;
+	}
+
+	// Anything within properties must keep its full structure
+	// so that it can be canonicalized as an attribute value
+	for (; c->parent != NULL; c = c->parent) {
+		json_object *p = c->parent;
+		if (p->type == JSON_HASH && p->values[p->length - 1] == c &&
+		    p->keys[p->length - 1]->type == JSON_STRING && strcmp(p->keys[p->length - 1]->string, "properties") == 0) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// The text of a number that was read into a JSON_COORDINATES object, which
+// keeps only its value: the shortest that reads back as the same value
+static void string_append_number(struct string *s, double d) {
+	char buf[40];
+	int precision;
+
+	if (d > -1e18 && d < 1e18 && d == (long long) d) {
+		snprintf(buf, sizeof(buf), "%lld", (long long) d);
+		string_append_string(s, buf);
+		return;
+	}
+
+	for (precision = 1; precision < 17; precision++) {
+		snprintf(buf, sizeof(buf), "%.*g", precision, d);
+		if (strtod(buf, NULL) == d) {
+			break;
+		}
+	}
+	if (precision == 17) {
+		snprintf(buf, sizeof(buf), "%.17g", d);
+	}
+
+	string_append_string(s, buf);
+}
+
+// Turn the part of a coordinates array that has been read so far back into
+// ordinary objects, so the general case can continue where it left off,
+// expecting what the innermost array expected next.
+// Returns 0, with j->error set, if the objects could not be added.
+static int unpack_coordinates(json_pull *j, const char *shape, const double *numbers, int expect) {
+	size_t n = 0;
+
+	for (; *shape != '\0'; shape++) {
+		if (*shape == ']') {
+			j->container = j->container->parent;
+			continue;
+		}
+
+		// The shape has no commas, so each array element after the first
+		// has to be let in explicitly
+		if (j->container->type == JSON_ARRAY) {
+			j->container->expect = JSON_ITEM;
+		}
+
+		if (*shape == '[') {
+			json_object *o = add_object(j, JSON_ARRAY);
+			if (o == NULL) {
+				return 0;
+			}
+			j->container = o;
+			j->container->expect = JSON_ITEM;
+		} else {
+			json_object *o = add_object(j, JSON_NUMBER);
+			if (o == NULL) {
+				return 0;
+			}
+
+			struct string val;
+			string_init(&val);
+			string_append_number(&val, numbers[n]);
+			o->string = object_alloc(j, o->arena, val.n + 1);
+			memcpy(o->string, val.buf, val.n + 1);
+			o->length = val.n;
+			o->number = numbers[n++];
+			string_free(&val);
+		}
+	}
+
+	j->container->expect = expect;
+	return 1;
+}
+
+// Read an array of numbers and nested arrays, whose opening bracket has
+// already been read, into a JSON_COORDINATES object: its shape, with the
+// brackets of each array and a # for each number, and the number values.
+// If it contains anything else, returns NULL having unpacked what it has
+// read so far, or with j->error set if a number was malformed or the
+// unpacking failed.
+static json_object *read_coordinates(json_pull *j) {
+	struct string text;
+	string_init(&text);
+	string_append(&text, '[');
+
+	double *numbers = NULL;
+	size_t nnumbers = 0;
+	size_t nalloc = 0;
+
+	size_t depth = 1;
+	int expect = JSON_ITEM;
+
+	while (depth > 0) {
+		if (j->buffer_head < j->buffer_tail) {
+			j->buffer_head += whitespace_span(j->buffer + j->buffer_head, j->buffer_tail - j->buffer_head, &j->line);
+		}
+
+		int c = peek(j);
+
+		if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+			read_wrap(j);
+		} else if (c == '[' && expect == JSON_ITEM) {
+			read_wrap(j);
+			string_append(&text, '[');
+			depth++;
+		} else if (c == ']' && (expect == JSON_COMMA || text.buf[text.n - 1] == '[')) {
+			read_wrap(j);
+			string_append(&text, ']');
+			depth--;
+			expect = JSON_COMMA;
+		} else if (c == ',' && expect == JSON_COMMA) {
+			read_wrap(j);
+			expect = JSON_ITEM;
+		} else if ((c == '-' || (c >= '0' && c <= '9')) && expect == JSON_ITEM) {
+			if (nnumbers >= nalloc) {
+				nalloc = nalloc * 2 + 32;
+				numbers = realloc(numbers, nalloc * sizeof(double));
+				if (numbers == NULL) {
+					perror("Out of memory");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			size_t len = number_span(j->buffer + j->buffer_head, j->buffer_tail - j->buffer_head, &numbers[nnumbers]);
+			if (len > 0) {
+				j->buffer_head += len;
+			} else {
+				struct string val;
+				string_init(&val);
+
+				if (!read_number(j, read_wrap(j), &val)) {
+					string_free(&val);
+					unpack_coordinates(j, text.buf, numbers, expect);
+					string_free(&text);
+					free(numbers);
+					return NULL;
+				}
+
+				numbers[nnumbers] = atof(val.buf);
+				string_free(&val);
+			}
+
+			string_append(&text, '#');
+			nnumbers++;
+			expect = JSON_COMMA;
+		} else {
+			// If this fails, j->error is set and is returned to the caller
+			unpack_coordinates(j, text.buf, numbers, expect);
+			string_free(&text);
+			free(numbers);
+			return NULL;
+		}
+	}
+
+	json_object *o = add_object(j, JSON_COORDINATES);
+	if (o == NULL) {
+		string_free(&text);
+		free(numbers);
+		return NULL;
+	}
+
+	o->string = object_adopt(o, text.buf, text.n + 1, MALLOCED_STRING);
+	o->length = text.n;
+	o->numbers = object_adopt(o, numbers, nnumbers * sizeof(double), MALLOCED_NUMBERS);
+	return o;
+}
+
 json_object *json_read_separators(json_pull *j, json_separator_callback cb, void *state) {
 	int c;
 
@@ -286,6 +936,10 @@ json_object *json_read_separators(json_pull *j, json_separator_callback cb, void
 again:
 	/////////////////////////// Whitespace
 
+	if (j->buffer_head < j->buffer_tail) {
+		j->buffer_head += whitespace_span(j->buffer + j->buffer_head, j->buffer_tail - j->buffer_head, &j->line);
+	}
+
 	do {
 		c = read_wrap(j);
 		if (c == EOF) {
@@ -316,6 +970,17 @@ again:
 	/////////////////////////// Arrays
 
 	if (c == '[') {
+		if (j->pack_coordinates && cb == NULL && packable_coordinates(j)) {
+			json_object *o = read_coordinates(j);
+			if (o != NULL || j->error != NULL) {
+				return o;
+			}
+
+			// Otherwise it has been unpacked into ordinary arrays
+			// and the general case can carry on reading it
+			goto again;
+		}
+
 		json_object *o = add_object(j, JSON_ARRAY);
 		if (o == NULL) {
 			return NULL;
@@ -496,66 +1161,39 @@ again:
 	/////////////////////////// Numbers
 
 	if (c == '-' || (c >= '0' && c <= '9')) {
-		struct string val;
-		string_init(&val);
-
-		if (c == '-') {
-			string_append(&val, c);
-			c = read_wrap(j);
-		}
-
-		if (c == '0') {
-			string_append(&val, c);
-		} else if (c >= '1' && c <= '9') {
-			string_append(&val, c);
-			c = peek(j);
-
-			while (c >= '0' && c <= '9') {
-				string_append(&val, read_wrap(j));
-				c = peek(j);
-			}
-		}
-
-		if (peek(j) == '.') {
-			string_append(&val, read_wrap(j));
-
-			c = peek(j);
-			if (c < '0' || c > '9') {
-				j->error = "Decimal point without digits";
-				string_free(&val);
-				return NULL;
-			}
-			while (c >= '0' && c <= '9') {
-				string_append(&val, read_wrap(j));
-				c = peek(j);
+		// The common case: the whole number is already in the buffer
+		// (c is still there, just before buffer_head)
+		double number;
+		size_t len = number_span(j->buffer + j->buffer_head - 1, j->buffer_tail - j->buffer_head + 1, &number);
+		if (len > 0) {
+			char *string = object_alloc(j, j->use_arena, len + 1);
+			memcpy(string, j->buffer + j->buffer_head - 1, len);
+			string[len] = '\0';
+			j->buffer_head += len - 1;
+
+			json_object *n = add_object(j, JSON_NUMBER);
+			if (n != NULL) {
+				n->number = number;
+				n->string = string;
+				n->length = len;
+			} else {
+				object_free(j->use_arena, string);
 			}
+			return n;
 		}
 
-		c = peek(j);
-		if (c == 'e' || c == 'E') {
-			string_append(&val, read_wrap(j));
-
-			c = peek(j);
-			if (c == '+' || c == '-') {
-				string_append(&val, read_wrap(j));
-			}
+		struct string val;
+		string_init(&val);
 
-			c = peek(j);
-			if (c < '0' || c > '9') {
-				j->error = "Exponent without digits";
-				string_free(&val);
-				return NULL;
-			}
-			while (c >= '0' && c <= '9') {
-				string_append(&val, read_wrap(j));
-				c = peek(j);
-			}
+		if (!read_number(j, c, &val)) {
+			string_free(&val);
+			return NULL;
 		}
 
 		json_object *n = add_object(j, JSON_NUMBER);
 		if (n != NULL) {
 			n->number = atof(val.buf);
-			n->string = val.buf;
+			n->string = object_adopt(n, val.buf, val.n + 1, MALLOCED_STRING);
 			n->length = val.n;
 		} else {
 			string_free(&val);
@@ -566,11 +1204,43 @@ again:
 	/////////////////////////// Strings
 
 	if (c == '"') {
+		// The common case: the closing quote is already in the buffer,
+		// with nothing that needs unescaping before it
+		if (j->buffer_head < j->buffer_tail) {
+			size_t plain = string_span(j->buffer + j->buffer_head, j->buffer_tail - j->buffer_head);
+			if (j->buffer_head + (ssize_t) plain < j->buffer_tail && j->buffer[j->buffer_head + plain] == '"') {
+				char *string = object_alloc(j, j->use_arena, plain + 1);
+				memcpy(string, j->buffer + j->buffer_head, plain);
+				string[plain] = '\0';
+				j->buffer_head += plain + 1;
+
+				json_object *s = add_object(j, JSON_STRING);
+				if (s != NULL) {
+					s->string = string;
+					s->length = plain;
+				} else {
+					object_free(j->use_arena, string);
+				}
+				return s;
+			}
+		}
+
 		struct string val;
 		string_init(&val);
 
 		int surrogate = -1;
-		while ((c = read_wrap(j)) != EOF) {
+		while (1) {
+			if (surrogate < 0 && j->buffer_head < j->buffer_tail) {
+				size_t plain = string_span(j->buffer + j->buffer_head, j->buffer_tail - j->buffer_head);
+				string_append_n(&val, j->buffer + j->buffer_head, plain);
+				j->buffer_head += plain;
+			}
+
+			c = read_wrap(j);
+			if (c == EOF) {
+				break;
+			}
+
 			if (c == '"') {
 				if (surrogate >= 0) {
 					string_append(&val, 0xE0 | (surrogate >> 12));
@@ -692,7 +1362,7 @@ again:
 
 		json_object *s = add_object(j, JSON_STRING);
 		if (s != NULL) {
-			s->string = val.buf;
+			s->string = object_adopt(s, val.buf, val.n + 1, MALLOCED_STRING);
 			s->length = val.n;
 		} else {
 			string_free(&val);
@@ -740,7 +1410,7 @@ void json_free(json_object *o) {
 			json_free(a[i]);
 		}
 
-		free(a);
+		object_free(o->arena, a);
 	} else if (o->type == JSON_HASH) {
 		json_object **k = o->keys;
 		json_object **v = o->values;
@@ -755,15 +1425,29 @@ void json_free(json_object *o) {
 			json_free(v[i]);
 		}
 
-		free(k);
-		free(v);
+		object_free(o->arena, k);
+		object_free(o->arena, v);
 	} else if (o->type == JSON_STRING || o->type == JSON_NUMBER) {
-		free(o->string);
+		object_free(o->arena && !(o->malloced & MALLOCED_STRING), o->string);
+	} else if (o->type == JSON_COORDINATES) {
+		object_free(o->arena && !(o->malloced & MALLOCED_STRING), o->string);
+		object_free(o->arena && !(o->malloced & MALLOCED_NUMBERS), o->numbers);
 	}
 
 	json_disconnect(o);
 
-	free(o);
+	object_free(o->arena, o);
+}
+
+void json_set_string(json_object *o, const char *s) {
+	size_t len = strlen(s);
+	char *string = object_alloc(o->parser, o->arena, len + 1);
+	memcpy(string, s, len + 1);
+
+	object_free(o->arena && !(o->malloced & MALLOCED_STRING), o->string);
+	o->malloced &= ~MALLOCED_STRING;
+	o->string = string;
+	o->length = len;
 }
 
 static void json_disconnect_parser(json_object *o) {
@@ -820,8 +1504,8 @@ void json_disconnect(json_object *o) {
 			if (i < o->parent->length) {
 				if (o->parent->keys[i] != NULL && o->parent->keys[i]->type == JSON_NULL) {
 					if (o->parent->values[i] != NULL && o->parent->values[i]->type == JSON_NULL) {
-						free(o->parent->keys[i]);
-						free(o->parent->values[i]);
+						object_free(o->parent->keys[i]->arena, o->parent->keys[i]);
+						object_free(o->parent->values[i]->arena, o->parent->values[i]);
 
 						memmove(o->parent->keys + i, o->parent->keys + i + 1, o->parent->length - i - 1);
 						memmove(o->parent->values + i, o->parent->values + i + 1, o->parent->length - i - 1);
@@ -865,6 +1549,20 @@ static void json_print_one(struct string *val, json_object *o) {
 		string_append(val, '\"');
 	} else if (o->type == JSON_NUMBER) {
 		string_append_string(val, o->string);
+	} else if (o->type == JSON_COORDINATES) {
+		size_t n = 0;
+		char *cp;
+
+		for (cp = o->string; *cp != '\0'; cp++) {
+			if (*cp != ']' && cp != o->string && cp[-1] != '[') {
+				string_append(val, ',');
+			}
+			if (*cp == '#') {
+				string_append_number(val, o->numbers[n++]);
+			} else {
+				string_append(val, *cp);
+			}
+		}
 	} else if (o->type == JSON_NULL) {
 		string_append_string(val, "null");
 	} else if (o->type == JSON_TRUE) {
@@ -15,6 +15,9 @@ typedef enum json_type {
 	JSON_FALSE,
 	JSON_NULL,
 
+	// This can be returned by json_read() only if pack_coordinates is set
+	JSON_COORDINATES,
+
 	// These and JSON_HASH and JSON_ARRAY can be called back by json_read_with_separators()
 	JSON_COMMA,
 	JSON_COLON,
@@ -37,6 +40,13 @@ typedef struct json_object {
 	struct json_object **keys;
 	struct json_object **values;
 	size_t length;
+	int arena;     // allocated from its parser's arena
+	int malloced;  // even so, string or numbers is too big for it and was left in malloc
+
+	// For JSON_COORDINATES, string is the shape of the array, with the
+	// brackets of each array and a # in place of each number, and numbers
+	// is the values of the numbers within it, in order
+	double *numbers;
 
 	int expect;
 } json_object;
@@ -53,6 +63,18 @@ typedef struct json_pull {
 
 	json_object *container;
 	json_object *root;
+
+	// If set, an array of numbers and nested arrays that is the value of
+	// a "coordinates" key (outside of any "properties") is read as a single
+	// JSON_COORDINATES object instead of as an object per array and number
+	int pack_coordinates;
+
+	// If set, objects are allocated from large blocks that are reused or
+	// freed once everything in them has been freed. Objects must then be
+	// freed on the parser's thread, and their strings replaced only through
+	// json_set_string().
+	int use_arena;
+	struct json_arena *arena;
 } json_pull;
 
 json_pull *json_begin_file(FILE *f);
@@ -70,6 +92,7 @@ void json_free(json_object *j);
 void json_disconnect(json_object *j);
 
 json_object *json_hash_get(json_object *o, const char *s);
+void json_set_string(json_object *o, const char *s);
 
 char *json_stringify(json_object *o);
 
@@ -342,6 +342,9 @@ void join_csv(json_object *j) {
 				ko->keys = vo->keys = NULL;
 				ko->values = vo->values = NULL;
 				ko->parser = vo->parser = properties->parser;
+				ko->numbers = vo->numbers = NULL;
+				ko->arena = vo->arena = 0;
+				ko->malloced = vo->malloced = 0;
 
 				ko->string = strdup(k.c_str());
 				vo->string = strdup(v.c_str());
@@ -32,6 +32,7 @@
 #include <string>
 #include <set>
 #include <map>
+#include <deque>
 #include <cmath>
 
 #ifdef __APPLE__
@@ -61,6 +62,7 @@
 #include "dirtiles.hpp"
 #include "evaluator.hpp"
 #include "text.hpp"
+#include "sort.hpp"
 
 static int low_detail = 12;
 static int full_detail = -1;
@@ -74,6 +76,8 @@ int geometry_scale = 0;
 double simplification = 1;
 size_t max_tile_size = 500000;
 size_t max_tile_features = 200000;
+int tile_compression_level = 9;
+long long memory_limit = 0;
 int cluster_distance = 0;
 long justx = -1, justy = -1;
 std::string attribute_for_id = "";
@@ -101,7 +105,11 @@ void checkdisk(std::vector<struct reader> *r) {
 	for (size_t i = 0; i < r->size(); i++) {
 		// Meta, pool, and tree are used once.
 		// Geometry and index will be duplicated during sorting and tiling.
-		used += (*r)[i].metapos + 2 * (*r)[i].geompos + 2 * (*r)[i].indexpos + (*r)[i].poolfile->len + (*r)[i].treefile->len;
+		used += (*r)[i].metapos + 2 * (*r)[i].geompos + 2 * (*r)[i].indexpos;
+	}
+	if (r->size() > 0) {
+		// The string pool is shared by all the readers
+		used += (*r)[0].poolfile->off + (*r)[0].treefile->off;
 	}
 
 	static int warned = 0;
@@ -111,53 +119,11 @@ void checkdisk(std::vector<struct reader> *r) {
 	}
 };
 
-int atoi_require(const char *s, const char *what) {
-	char *err = NULL;
-	if (*s == '\0') {
-		fprintf(stderr, "%s: %s must be a number (got %s)\n", *av, what, s);
-		exit(EXIT_FAILURE);
-	}
-	int ret = strtol(s, &err, 10);
-	if (*err != '\0') {
-		fprintf(stderr, "%s: %s must be a number (got %s)\n", *av, what, s);
-		exit(EXIT_FAILURE);
-	}
-	return ret;
-}
-
-double atof_require(const char *s, const char *what) {
-	char *err = NULL;
-	if (*s == '\0') {
-		fprintf(stderr, "%s: %s must be a number (got %s)\n", *av, what, s);
-		exit(EXIT_FAILURE);
-	}
-	double ret = strtod(s, &err);
-	if (*err != '\0') {
-		fprintf(stderr, "%s: %s must be a number (got %s)\n", *av, what, s);
-		exit(EXIT_FAILURE);
-	}
-	return ret;
-}
-
-long long atoll_require(const char *s, const char *what) {
-	char *err = NULL;
-	if (*s == '\0') {
-		fprintf(stderr, "%s: %s must be a number (got %s)\n", *av, what, s);
-		exit(EXIT_FAILURE);
-	}
-	long long ret = strtoll(s, &err, 10);
-	if (*err != '\0') {
-		fprintf(stderr, "%s: %s must be a number (got %s)\n", *av, what, s);
-		exit(EXIT_FAILURE);
-	}
-	return ret;
-}
-
 void init_cpus() {
 	const char *TIPPECANOE_MAX_THREADS = getenv("TIPPECANOE_MAX_THREADS");
 
 	if (TIPPECANOE_MAX_THREADS != NULL) {
-		CPUS = atoi_require(TIPPECANOE_MAX_THREADS, "TIPPECANOE_MAX_THREADS");
+		CPUS = atoi_require(*av, TIPPECANOE_MAX_THREADS, "TIPPECANOE_MAX_THREADS");
 	} else {
 		CPUS = sysconf(_SC_NPROCESSORS_ONLN);
 	}
@@ -220,39 +186,277 @@ void init_cpus() {
 	}
 }
 
-int indexcmp(const void *v1, const void *v2) {
-	const struct index *i1 = (const struct index *) v1;
-	const struct index *i2 = (const struct index *) v2;
+// The writes for the external sort go through a thread of their own, so
+// that splitting, sorting, and merging can go on while earlier output is
+// still on its way to disk. Each file being written collects its output
+// in a block until there is enough to be worth handing over.
+struct sort_output {
+	FILE *fp = NULL;
+	const char *fname = NULL;
+	std::string buf;
+};
+
+struct sort_block {
+	FILE *fp = NULL;
+	const char *fname = NULL;
+	std::string data;
+};
+
+struct sort_io {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake_writer;
+	pthread_cond_t wake_sorter;
+	std::deque<sort_block> queue;
+	size_t queued = 0;  // bytes handed over but not yet written
+	size_t max_queued = 0;
+	size_t block = 0;
+	long long max_splits = 0;  // the most splits that blocks of this size were budgeted for
+	bool finishing = false;
+};
+
+static void *run_sort_io(void *v) {
+	sort_io *io = (sort_io *) v;
+
+	while (true) {
+		if (pthread_mutex_lock(&io->lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_FAILURE);
+		}
+		while (io->queue.size() == 0 && !io->finishing) {
+			if (pthread_cond_wait(&io->wake_writer, &io->lock) != 0) {
+				perror("pthread_cond_wait");
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (io->queue.size() == 0) {
+			if (pthread_mutex_unlock(&io->lock) != 0) {
+				perror("pthread_mutex_unlock");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+
+		sort_block b = std::move(io->queue.front());
+		io->queue.pop_front();
+
+		if (pthread_mutex_unlock(&io->lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_FAILURE);
+		}
 
-	if (i1->ix < i2->ix) {
-		return -1;
-	} else if (i1->ix > i2->ix) {
-		return 1;
+		fwrite_check(b.data.data(), sizeof(char), b.data.size(), b.fp, b.fname);
+
+		if (pthread_mutex_lock(&io->lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_FAILURE);
+		}
+		io->queued -= b.data.size();
+		if (pthread_cond_broadcast(&io->wake_sorter) != 0) {
+			perror("pthread_cond_broadcast");
+			exit(EXIT_FAILURE);
+		}
+		if (pthread_mutex_unlock(&io->lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	if (i1->seq < i2->seq) {
-		return -1;
-	} else if (i1->seq > i2->seq) {
-		return 1;
+	return NULL;
+}
+
+static void sort_io_start(sort_io *io, size_t block, size_t max_queued) {
+	io->block = block;
+	io->max_queued = max_queued;
+
+	if (pthread_mutex_init(&io->lock, NULL) != 0 ||
+	    pthread_cond_init(&io->wake_writer, NULL) != 0 ||
+	    pthread_cond_init(&io->wake_sorter, NULL) != 0) {
+		perror("pthread_mutex_init");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_create(&io->thread, NULL, run_sort_io, io) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Hand whatever this file has collected over to the I/O thread, waiting
+// first if too much is already waiting to be written.
+static void sort_io_flush(sort_io *io, sort_output *out) {
+	if (out->buf.size() == 0) {
+		return;
+	}
+
+	if (pthread_mutex_lock(&io->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+	while (io->queued > 0 && io->queued + out->buf.size() > io->max_queued) {
+		if (pthread_cond_wait(&io->wake_sorter, &io->lock) != 0) {
+			perror("pthread_cond_wait");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	sort_block b;
+	b.fp = out->fp;
+	b.fname = out->fname;
+	b.data.swap(out->buf);
+	io->queued += b.data.size();
+	io->queue.push_back(std::move(b));
+
+	if (pthread_cond_signal(&io->wake_writer) != 0) {
+		perror("pthread_cond_signal");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_mutex_unlock(&io->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void sort_io_write(sort_io *io, sort_output *out, const void *data, size_t len) {
+	out->buf.append((const char *) data, len);
+	if (out->buf.size() >= io->block) {
+		sort_io_flush(io, out);
+	}
+}
+
+// Wait until everything handed over so far has been written
+static void sort_io_drain(sort_io *io) {
+	if (pthread_mutex_lock(&io->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+	while (io->queued > 0) {
+		if (pthread_cond_wait(&io->wake_sorter, &io->lock) != 0) {
+			perror("pthread_cond_wait");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (pthread_mutex_unlock(&io->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void sort_io_finish(sort_io *io) {
+	if (pthread_mutex_lock(&io->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+	io->finishing = true;
+	if (pthread_cond_signal(&io->wake_writer) != 0) {
+		perror("pthread_cond_signal");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_mutex_unlock(&io->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pthread_join(io->thread, NULL) != 0) {
+		perror("pthread_join sort io");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_mutex_destroy(&io->lock);
+	pthread_cond_destroy(&io->wake_writer);
+	pthread_cond_destroy(&io->wake_sorter);
+}
+
+// Reads a whole temporary file into memory in large sequential reads,
+// on a thread of its own so that it can overlap with sorting the index.
+struct sort_read {
+	int fd = -1;
+	long long size = 0;
+	char *buf = NULL;
+};
+
+#define SORT_READ_CHUNK (16 * 1024 * 1024)
+
+// Output blocks smaller than this would cost more to hand to the
+// I/O thread than they save
+#define SORT_MIN_BLOCK 4096
+
+static void *run_sort_read(void *v) {
+	sort_read *r = (sort_read *) v;
+
+	r->buf = (char *) malloc(r->size);
+	if (r->buf == NULL) {
+		perror("Out of memory");
+		exit(EXIT_FAILURE);
+	}
+
+	long long off = 0;
+	while (off < r->size) {
+		long long want = std::min((long long) SORT_READ_CHUNK, r->size - off);
+		ssize_t n = pread(r->fd, r->buf + off, want, off);
+		if (n < 0) {
+			perror("read geom");
+			exit(EXIT_FAILURE);
+		}
+		if (n == 0) {
+			fprintf(stderr, "Temporary geometry file ended after %lld of %lld bytes\n", off, r->size);
+			exit(EXIT_FAILURE);
+		}
+		off += n;
 	}
 
-	return 0;
+	return NULL;
 }
 
 struct mergelist {
 	long long start;
 	long long end;
 
-	struct mergelist *next;
+	// Key of the record at start. Among equal keys the run that most
+	// recently took its place in the heap comes out first.
+	unsigned long long ix;
+	unsigned long long seq;
+	unsigned long long stamp;
 };
 
-static void insert(struct mergelist *m, struct mergelist **head, unsigned char *map) {
-	while (*head != NULL && indexcmp(map + m->start, map + (*head)->start) > 0) {
-		head = &((*head)->next);
+static void merge_load(struct mergelist *m, unsigned char *map, unsigned long long *stamp) {
+	const struct index *ix = (const struct index *) (map + m->start);
+	m->ix = ix->ix;
+	m->seq = ix->seq;
+	m->stamp = (*stamp)++;
+}
+
+static bool merge_before(const struct mergelist *a, const struct mergelist *b) {
+	if (a->ix != b->ix) {
+		return a->ix < b->ix;
+	}
+	if (a->seq != b->seq) {
+		return a->seq < b->seq;
 	}
+	return a->stamp > b->stamp;
+}
+
+// Move heap[i] down until neither of its children should come before it
+static void merge_sift(std::vector<struct mergelist *> &heap, size_t i) {
+	size_t n = heap.size();
+
+	while (1) {
+		size_t first = i;
+		size_t l = 2 * i + 1;
+		size_t r = 2 * i + 2;
+
+		if (l < n && merge_before(heap[l], heap[first])) {
+			first = l;
+		}
+		if (r < n && merge_before(heap[r], heap[first])) {
+			first = r;
+		}
+		if (first == i) {
+			break;
+		}
 
-	m->next = *head;
-	*head = m;
+		std::swap(heap[i], heap[first]);
+		i = first;
+	}
 }
 
 struct drop_state {
@@ -293,24 +497,31 @@ int calc_feature_minzoom(struct index *ix, struct drop_state *ds, int maxzoom, d
 	return feature_minzoom;
 }
 
-static void merge(struct mergelist *merges, size_t nmerges, unsigned char *map, FILE *indexfile, int bytes, char *geom_map, FILE *geom_out, std::atomic<long long> *geompos, long long *progress, long long *progress_max, long long *progress_reported, int maxzoom, double gamma, struct drop_state *ds) {
-	struct mergelist *head = NULL;
+static void merge(struct mergelist *merges, size_t nmerges, unsigned char *map, sort_io *io, sort_output *indexfile, int bytes, char *geom_map, sort_output *geom_out, std::atomic<long long> *geompos, long long *progress, long long *progress_max, long long *progress_reported, int maxzoom, double gamma, struct drop_state *ds) {
+	std::vector<struct mergelist *> heap;
+	unsigned long long stamp = 0;
 
 	for (size_t i = 0; i < nmerges; i++) {
 		if (merges[i].start < merges[i].end) {
-			insert(&(merges[i]), &head, map);
+			merge_load(&merges[i], map, &stamp);
+			heap.push_back(&merges[i]);
 		}
 	}
+	for (size_t i = heap.size() / 2; i > 0; i--) {
+		merge_sift(heap, i - 1);
+	}
 
 	last_progress = 0;
 
-	while (head != NULL) {
+	while (heap.size() > 0) {
+		struct mergelist *head = heap[0];
 		struct index ix = *((struct index *) (map + head->start));
 		long long pos = *geompos;
-		fwrite_check(geom_map + ix.start, 1, ix.end - ix.start, geom_out, "merge geometry");
+		sort_io_write(io, geom_out, geom_map + ix.start, ix.end - ix.start);
 		*geompos += ix.end - ix.start;
-		int feature_minzoom = calc_feature_minzoom(&ix, ds, maxzoom, gamma);
-		serialize_byte(geom_out, feature_minzoom, geompos, "merge geometry");
+		signed char feature_minzoom = calc_feature_minzoom(&ix, ds, maxzoom, gamma);
+		sort_io_write(io, geom_out, &feature_minzoom, sizeof(signed char));
+		*geompos += sizeof(signed char);
 
 		// Count this as an 75%-accomplishment, since we already 25%-counted it
 		*progress += (ix.end - ix.start) * 3 / 4;
@@ -321,15 +532,17 @@ static void merge(struct mergelist *merges, size_t nmerges, unsigned char *map,
 
 		ix.start = pos;
 		ix.end = *geompos;
-		fwrite_check(&ix, bytes, 1, indexfile, "merge temporary");
+		sort_io_write(io, indexfile, &ix, bytes);
 		head->start += bytes;
 
-		struct mergelist *m = head;
-		head = m->next;
-		m->next = NULL;
-
-		if (m->start < m->end) {
-			insert(m, &head, map);
+		if (head->start < head->end) {
+			merge_load(head, map, &stamp);
+		} else {
+			heap[0] = heap.back();
+			heap.pop_back();
+		}
+		if (heap.size() > 0) {
+			merge_sift(heap, 0);
 		}
 	}
 }
@@ -361,7 +574,6 @@ void *run_sort(void *v) {
 
 		a->merges[start / a->unit].start = start;
 		a->merges[start / a->unit].end = end;
-		a->merges[start / a->unit].next = NULL;
 
 		// MAP_PRIVATE to avoid disk writes if it fits in memory
 		void *map = mmap(NULL, end - start, PROT_READ | PROT_WRITE, MAP_PRIVATE, a->indexfd, start);
@@ -372,7 +584,7 @@ void *run_sort(void *v) {
 		madvise(map, end - start, MADV_RANDOM);
 		madvise(map, end - start, MADV_WILLNEED);
 
-		qsort(map, (end - start) / a->bytes, a->bytes, indexcmp);
+		sort_index((struct index *) map, (end - start) / a->bytes);
 
 		// Sorting and then copying avoids disk access to
 		// write out intermediate stages of the sort.
@@ -682,13 +894,13 @@ void start_parsing(int fd, STREAM *fp, long long offset, long long len, std::ato
 	parser_created = true;
 }
 
-void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int splits, long long mem, const char *tmpdir, long long *availfiles, FILE *geomfile, FILE *indexfile, std::atomic<long long> *geompos_out, long long *progress, long long *progress_max, long long *progress_reported, int maxzoom, int basezoom, double droprate, double gamma, struct drop_state *ds) {
+void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int splits, long long mem, const char *tmpdir, long long *availfiles, sort_io *io, sort_output *geomfile, sort_output *indexfile, std::atomic<long long> *geompos_out, long long *progress, long long *progress_max, long long *progress_reported, int maxzoom, int basezoom, double droprate, double gamma, struct drop_state *ds) {
 	// Arranged as bits to facilitate subdividing again if a subdivided file is still huge
 	int splitbits = log(splits) / log(2);
 	splits = 1 << splitbits;
 
-	FILE *geomfiles[splits];
-	FILE *indexfiles[splits];
+	std::vector<sort_output> geomfiles(splits);
+	std::vector<sort_output> indexfiles(splits);
 	int geomfds[splits];
 	int indexfds[splits];
 	std::atomic<long long> sub_geompos[splits];
@@ -713,16 +925,18 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 			exit(EXIT_FAILURE);
 		}
 
-		geomfiles[i] = fopen_oflag(geomname, "wb", O_WRONLY | O_CLOEXEC);
-		if (geomfiles[i] == NULL) {
+		geomfiles[i].fp = fopen_oflag(geomname, "wb", O_WRONLY | O_CLOEXEC);
+		if (geomfiles[i].fp == NULL) {
 			perror(geomname);
 			exit(EXIT_FAILURE);
 		}
-		indexfiles[i] = fopen_oflag(indexname, "wb", O_WRONLY | O_CLOEXEC);
-		if (indexfiles[i] == NULL) {
+		geomfiles[i].fname = "geom";
+		indexfiles[i].fp = fopen_oflag(indexname, "wb", O_WRONLY | O_CLOEXEC);
+		if (indexfiles[i].fp == NULL) {
 			perror(indexname);
 			exit(EXIT_FAILURE);
 		}
+		indexfiles[i].fname = "index";
 
 		*availfiles -= 4;
 
@@ -763,7 +977,7 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 				unsigned long long which = (ix.ix << prefix) >> (64 - splitbits);
 				long long pos = sub_geompos[which];
 
-				fwrite_check(geommap + ix.start, ix.end - ix.start, 1, geomfiles[which], "geom");
+				sort_io_write(io, &geomfiles[which], geommap + ix.start, ix.end - ix.start);
 				sub_geompos[which] += ix.end - ix.start;
 
 				// Count this as a 25%-accomplishment, since we will copy again
@@ -776,7 +990,7 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 				ix.start = pos;
 				ix.end = sub_geompos[which];
 
-				fwrite_check(&ix, sizeof(struct index), 1, indexfiles[which], "index");
+				sort_io_write(io, &indexfiles[which], &ix, sizeof(struct index));
 			}
 
 			madvise(indexmap, indexst.st_size, MADV_DONTNEED);
@@ -803,12 +1017,19 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 		*availfiles += 2;
 	}
 
+	// Once the full blocks are out, the partial ones are written here
+	// rather than handed over one by one
+	sort_io_drain(io);
+
 	for (i = 0; i < splits; i++) {
-		if (fclose(geomfiles[i]) != 0) {
+		fwrite_check(geomfiles[i].buf.data(), sizeof(char), geomfiles[i].buf.size(), geomfiles[i].fp, geomfiles[i].fname);
+		fwrite_check(indexfiles[i].buf.data(), sizeof(char), indexfiles[i].buf.size(), indexfiles[i].fp, indexfiles[i].fname);
+
+		if (fclose(geomfiles[i].fp) != 0) {
 			perror("fclose geom");
 			exit(EXIT_FAILURE);
 		}
-		if (fclose(indexfiles[i]) != 0) {
+		if (fclose(indexfiles[i].fp) != 0) {
 			perror("fclose index");
 			exit(EXIT_FAILURE);
 		}
@@ -830,7 +1051,8 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 		}
 
 		if (indexst.st_size > 0) {
-			if (indexst.st_size + geomst.st_size < mem) {
+			// The index is sorted with scratch space as big as itself
+			if (2 * indexst.st_size + geomst.st_size < mem) {
 				std::atomic<long long> indexpos(indexst.st_size);
 				int bytes = sizeof(struct index);
 
@@ -854,6 +1076,20 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 					merges[a].start = merges[a].end = 0;
 				}
 
+				// Bring the geometry in while the index is being sorted,
+				// unless it is small enough that the thread isn't worth it
+				sort_read geomread;
+				geomread.fd = geomfds[i];
+				geomread.size = geomst.st_size;
+				pthread_t geomreader;
+				bool background = geomst.st_size >= SORT_READ_CHUNK;
+				if (!background) {
+					run_sort_read(&geomread);
+				} else if (pthread_create(&geomreader, NULL, run_sort_read, &geomread) != 0) {
+					perror("pthread_create");
+					exit(EXIT_FAILURE);
+				}
+
 				pthread_t pthreads[CPUS];
 				std::vector<sort_arg> args;
 
@@ -884,6 +1120,11 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 					}
 				}
 
+				if (background && pthread_join(geomreader, NULL) != 0) {
+					perror("pthread_join geom reader");
+					exit(EXIT_FAILURE);
+				}
+
 				struct indexmap *indexmap = (struct indexmap *) mmap(NULL, indexst.st_size, PROT_READ, MAP_PRIVATE, indexfds[i], 0);
 				if (indexmap == MAP_FAILED) {
 					fprintf(stderr, "fd %lld, len %lld\n", (long long) indexfds[i], (long long) indexst.st_size);
@@ -892,26 +1133,15 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 				}
 				madvise(indexmap, indexst.st_size, MADV_RANDOM);  // sequential, but from several pointers at once
 				madvise(indexmap, indexst.st_size, MADV_WILLNEED);
-				char *geommap = (char *) mmap(NULL, geomst.st_size, PROT_READ, MAP_PRIVATE, geomfds[i], 0);
-				if (geommap == MAP_FAILED) {
-					perror("map geom");
-					exit(EXIT_FAILURE);
-				}
-				madvise(geommap, geomst.st_size, MADV_RANDOM);
-				madvise(geommap, geomst.st_size, MADV_WILLNEED);
 
-				merge(merges, nmerges, (unsigned char *) indexmap, indexfile, bytes, geommap, geomfile, geompos_out, progress, progress_max, progress_reported, maxzoom, gamma, ds);
+				merge(merges, nmerges, (unsigned char *) indexmap, io, indexfile, bytes, geomread.buf, geomfile, geompos_out, progress, progress_max, progress_reported, maxzoom, gamma, ds);
 
 				madvise(indexmap, indexst.st_size, MADV_DONTNEED);
 				if (munmap(indexmap, indexst.st_size) < 0) {
 					perror("unmap index");
 					exit(EXIT_FAILURE);
 				}
-				madvise(geommap, geomst.st_size, MADV_DONTNEED);
-				if (munmap(geommap, geomst.st_size) < 0) {
-					perror("unmap geom");
-					exit(EXIT_FAILURE);
-				}
+				free(geomread.buf);
 			} else if (indexst.st_size == sizeof(struct index) || prefix + splitbits >= 64) {
 				struct index *indexmap = (struct index *) mmap(NULL, indexst.st_size, PROT_READ, MAP_PRIVATE, indexfds[i], 0);
 				if (indexmap == MAP_FAILED) {
@@ -933,10 +1163,11 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 					struct index ix = indexmap[a];
 					long long pos = *geompos_out;
 
-					fwrite_check(geommap + ix.start, ix.end - ix.start, 1, geomfile, "geom");
+					sort_io_write(io, geomfile, geommap + ix.start, ix.end - ix.start);
 					*geompos_out += ix.end - ix.start;
-					int feature_minzoom = calc_feature_minzoom(&ix, ds, maxzoom, gamma);
-					serialize_byte(geomfile, feature_minzoom, geompos_out, "merge geometry");
+					signed char feature_minzoom = calc_feature_minzoom(&ix, ds, maxzoom, gamma);
+					sort_io_write(io, geomfile, &feature_minzoom, sizeof(signed char));
+					*geompos_out += sizeof(signed char);
 
 					// Count this as an 75%-accomplishment, since we already 25%-counted it
 					*progress += (ix.end - ix.start) * 3 / 4;
@@ -947,7 +1178,7 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 
 					ix.start = pos;
 					ix.end = *geompos_out;
-					fwrite_check(&ix, sizeof(struct index), 1, indexfile, "index");
+					sort_io_write(io, indexfile, &ix, sizeof(struct index));
 				}
 
 				madvise(indexmap, indexst.st_size, MADV_DONTNEED);
@@ -968,7 +1199,7 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 				// counter backward but will be an honest estimate of the work remaining.
 				*progress_max += geomst.st_size / 4;
 
-				radix1(&geomfds[i], &indexfds[i], 1, prefix + splitbits, *availfiles / 4, mem, tmpdir, availfiles, geomfile, indexfile, geompos_out, progress, progress_max, progress_reported, maxzoom, basezoom, droprate, gamma, ds);
+				radix1(&geomfds[i], &indexfds[i], 1, prefix + splitbits, std::min(*availfiles / 4, io->max_splits), mem, tmpdir, availfiles, io, geomfile, indexfile, geompos_out, progress, progress_max, progress_reported, maxzoom, basezoom, droprate, gamma, ds);
 				already_closed = 1;
 			}
 		}
@@ -1038,6 +1269,15 @@ void radix(std::vector<struct reader> &readers, int nreaders, FILE *geomfile, FI
 	mem = (long long) pages * pagesize;
 #endif
 
+	// Be somewhat conservative about memory availability because the whole point of this
+	// is to keep from thrashing by working on chunks that will fit in memory.
+	mem /= 2;
+
+	// An explicit limit replaces the guess, whether it is larger or smaller
+	if (memory_limit > 0) {
+		mem = memory_limit;
+	}
+
 	// Just for code coverage testing. Deeply recursive sorting is very slow
 	// compared to sorting in memory.
 	if (additional[A_PREFER_RADIX_SORT]) {
@@ -1052,9 +1292,30 @@ void radix(std::vector<struct reader> &readers, int nreaders, FILE *geomfile, FI
 	// 4 because for each we have output and input FILE and fd for geom and index
 	int splits = availfiles / 4;
 
-	// Be somewhat conservative about memory availability because the whole point of this
-	// is to keep from thrashing by working on chunks that will fit in memory.
-	mem /= 2;
+	// An eighth of the memory goes to output waiting to be written: half
+	// of that to the blocks that each output file is filling, and half to
+	// the blocks waiting for the I/O thread. There are only as many splits
+	// as can each have a geometry and an index block of a useful size,
+	// alongside the blocks for the final output.
+	long long io_mem = mem / 8;
+	long long fill_splits = io_mem / 2 / (2 * SORT_MIN_BLOCK) - 1;
+	if (splits > fill_splits) {
+		splits = std::max(fill_splits, 2LL);
+	}
+	long long block = io_mem / 2 / (2 * (splits + 1));
+	block = std::max(std::min(block, 4LL * 1024 * 1024), (long long) SORT_MIN_BLOCK);
+	long long max_queued = std::max(io_mem / 2, block);
+	mem -= io_mem;
+
+	sort_io io;
+	sort_io_start(&io, block, max_queued);
+	io.max_splits = splits;
+
+	sort_output geom_out, index_out;
+	geom_out.fp = geomfile;
+	geom_out.fname = "merge geometry";
+	index_out.fp = indexfile;
+	index_out.fname = "merge temporary";
 
 	long long geom_total = 0;
 	int geomfds[nreaders];
@@ -1076,7 +1337,11 @@ void radix(std::vector<struct reader> &readers, int nreaders, FILE *geomfile, FI
 
 	long long progress = 0, progress_max = geom_total, progress_reported = -1;
 	long long availfiles_before = availfiles;
-	radix1(geomfds, indexfds, nreaders, 0, splits, mem, tmpdir, &availfiles, geomfile, indexfile, geompos, &progress, &progress_max, &progress_reported, maxzoom, basezoom, droprate, gamma, ds);
+	radix1(geomfds, indexfds, nreaders, 0, splits, mem, tmpdir, &availfiles, &io, &geom_out, &index_out, geompos, &progress, &progress_max, &progress_reported, maxzoom, basezoom, droprate, gamma, ds);
+
+	sort_io_flush(&io, &geom_out);
+	sort_io_flush(&io, &index_out);
+	sort_io_finish(&io);
 
 	if (availfiles - 2 * nreaders != availfiles_before) {
 		fprintf(stderr, "Internal error: miscounted available file descriptors: %lld vs %lld\n", availfiles - 2 * nreaders, availfiles);
@@ -1138,20 +1403,58 @@ void choose_first_zoom(long long *file_bbox, std::vector<struct reader> &readers
 int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzoom, int basezoom, double basezoom_marker_width, sqlite3 *outdb, const char *outdir, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, json_object *filter, double droprate, int buffer, const char *tmpdir, double gamma, int read_parallel, int forcetable, const char *attribution, bool uses_gamma, long long *file_bbox, const char *prefilter, const char *postfilter, const char *description, bool guess_maxzoom, std::map<std::string, int> const *attribute_types, const char *pgm, std::map<std::string, attribute_op> const *attribute_accum, std::map<std::string, std::string> const &attribute_descriptions, std::string const &commandline) {
 	int ret = EXIT_SUCCESS;
 
+	// All the readers share one string pool, so that each distinct
+	// attribute key and value is only stored once, however many
+	// threads come across it.
+	struct memfile *shared_poolfile, *shared_treefile;
+	int shared_poolfd, shared_treefd;
+	{
+		char poolname[strlen(tmpdir) + strlen("/pool.XXXXXXXX") + 1];
+		char treename[strlen(tmpdir) + strlen("/tree.XXXXXXXX") + 1];
+
+		sprintf(poolname, "%s%s", tmpdir, "/pool.XXXXXXXX");
+		sprintf(treename, "%s%s", tmpdir, "/tree.XXXXXXXX");
+
+		shared_poolfd = mkstemp_cloexec(poolname);
+		if (shared_poolfd < 0) {
+			perror(poolname);
+			exit(EXIT_FAILURE);
+		}
+		shared_treefd = mkstemp_cloexec(treename);
+		if (shared_treefd < 0) {
+			perror(treename);
+			exit(EXIT_FAILURE);
+		}
+
+		shared_poolfile = memfile_open(shared_poolfd);
+		if (shared_poolfile == NULL) {
+			perror(poolname);
+			exit(EXIT_FAILURE);
+		}
+		shared_treefile = memfile_open(shared_treefd);
+		if (shared_treefile == NULL) {
+			perror(treename);
+			exit(EXIT_FAILURE);
+		}
+
+		unlink(poolname);
+		unlink(treename);
+
+		// To distinguish a null value
+		struct stringpool p;
+		memfile_write(shared_treefile, &p, sizeof(struct stringpool));
+	}
+
 	std::vector<struct reader> readers;
 	readers.resize(CPUS);
 	for (size_t i = 0; i < CPUS; i++) {
 		struct reader *r = &readers[i];
 
 		char metaname[strlen(tmpdir) + strlen("/meta.XXXXXXXX") + 1];
-		char poolname[strlen(tmpdir) + strlen("/pool.XXXXXXXX") + 1];
-		char treename[strlen(tmpdir) + strlen("/tree.XXXXXXXX") + 1];
 		char geomname[strlen(tmpdir) + strlen("/geom.XXXXXXXX") + 1];
 		char indexname[strlen(tmpdir) + strlen("/index.XXXXXXXX") + 1];
 
 		sprintf(metaname, "%s%s", tmpdir, "/meta.XXXXXXXX");
-		sprintf(poolname, "%s%s", tmpdir, "/pool.XXXXXXXX");
-		sprintf(treename, "%s%s", tmpdir, "/tree.XXXXXXXX");
 		sprintf(geomname, "%s%s", tmpdir, "/geom.XXXXXXXX");
 		sprintf(indexname, "%s%s", tmpdir, "/index.XXXXXXXX");
 
@@ -1160,16 +1463,8 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 			perror(metaname);
 			exit(EXIT_FAILURE);
 		}
-		r->poolfd = mkstemp_cloexec(poolname);
-		if (r->poolfd < 0) {
-			perror(poolname);
-			exit(EXIT_FAILURE);
-		}
-		r->treefd = mkstemp_cloexec(treename);
-		if (r->treefd < 0) {
-			perror(treename);
-			exit(EXIT_FAILURE);
-		}
+		r->poolfd = shared_poolfd;
+		r->treefd = shared_treefd;
 		r->geomfd = mkstemp_cloexec(geomname);
 		if (r->geomfd < 0) {
 			perror(geomname);
@@ -1186,16 +1481,8 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 			perror(metaname);
 			exit(EXIT_FAILURE);
 		}
-		r->poolfile = memfile_open(r->poolfd);
-		if (r->poolfile == NULL) {
-			perror(poolname);
-			exit(EXIT_FAILURE);
-		}
-		r->treefile = memfile_open(r->treefd);
-		if (r->treefile == NULL) {
-			perror(treename);
-			exit(EXIT_FAILURE);
-		}
+		r->poolfile = shared_poolfile;
+		r->treefile = shared_treefile;
 		r->geomfile = fopen_oflag(geomname, "wb", O_WRONLY | O_CLOEXEC);
 		if (r->geomfile == NULL) {
 			perror(geomname);
@@ -1211,16 +1498,9 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		r->indexpos = 0;
 
 		unlink(metaname);
-		unlink(poolname);
-		unlink(treename);
 		unlink(geomname);
 		unlink(indexname);
 
-		// To distinguish a null value
-		{
-			struct stringpool p;
-			memfile_write(r->treefile, &p, sizeof(struct stringpool));
-		}
 		// Keep metadata file from being completely empty if no attributes
 		serialize_int(r->metafile, 0, &r->metapos, "meta");
 
@@ -1711,7 +1991,6 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 			perror("fclose index");
 			exit(EXIT_FAILURE);
 		}
-		memfile_close(readers[i].treefile);
 
 		if (fstat(readers[i].geomfd, &readers[i].geomst) != 0) {
 			perror("stat geom\n");
@@ -1722,6 +2001,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 			exit(EXIT_FAILURE);
 		}
 	}
+	memfile_close(shared_treefile);
 
 	// Create a combined string pool and a combined metadata file
 	// but keep track of the offsets into it since we still need
@@ -1795,18 +2075,17 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		if (close(readers[i].metafd) != 0) {
 			perror("close unmerged meta");
 		}
+	}
 
-		if (readers[i].poolfile->off > 0) {
-			if (fwrite(readers[i].poolfile->map, readers[i].poolfile->off, 1, poolfile) != 1) {
-				perror("Reunify string pool");
-				exit(EXIT_FAILURE);
-			}
+	// The readers shared one string pool, so every segment's pool offset is 0
+	if (shared_poolfile->off > 0) {
+		if (fwrite(shared_poolfile->map, shared_poolfile->off, 1, poolfile) != 1) {
+			perror("Reunify string pool");
+			exit(EXIT_FAILURE);
 		}
-
-		pool_off[i] = poolpos;
-		poolpos += readers[i].poolfile->off;
-		memfile_close(readers[i].poolfile);
 	}
+	poolpos += shared_poolfile->off;
+	memfile_close(shared_poolfile);
 
 	if (fclose(poolfile) != 0) {
 		perror("fclose pool");
@@ -2267,7 +2546,9 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 
 	std::atomic<unsigned> midx(0);
 	std::atomic<unsigned> midy(0);
-	int written = traverse_zooms(fd, size, meta, stringpool, &midx, &midy, maxzoom, minzoom, outdb, outdir, buffer, fname, tmpdir, gamma, full_detail, low_detail, min_detail, meta_off, pool_off, initial_x, initial_y, simplification, layermaps, prefilter, postfilter, attribute_accum, filter);
+	mbtiles_writer *writer = mbtiles_writer_start(outdb, outdir);
+	int written = traverse_zooms(fd, size, meta, stringpool, &midx, &midy, maxzoom, minzoom, writer, buffer, fname, tmpdir, gamma, full_detail, low_detail, min_detail, meta_off, pool_off, initial_x, initial_y, simplification, layermaps, prefilter, postfilter, attribute_accum, filter);
+	mbtiles_writer_finish(writer);
 
 	if (maxzoom != written) {
 		if (written > minzoom) {
@@ -2469,6 +2750,7 @@ int main(int argc, char **argv) {
 	double basezoom_marker_width = 1;
 	int force = 0;
 	int forcetable = 0;
+	int deduplicate_tiles = 0;
 	double droprate = 2.5;
 	double gamma = 0;
 	int buffer = 5;
@@ -2499,6 +2781,7 @@ int main(int argc, char **argv) {
 		{"output-to-directory", required_argument, 0, 'e'},
 		{"force", no_argument, 0, 'f'},
 		{"allow-existing", no_argument, 0, 'F'},
+		{"deduplicate-tiles", no_argument, &deduplicate_tiles, 1},
 
 		{"Tileset description and attribution", 0, 0, 0},
 		{"name", required_argument, 0, 'n'},
@@ -2512,6 +2795,9 @@ int main(int argc, char **argv) {
 		{"Parallel processing of input", 0, 0, 0},
 		{"read-parallel", no_argument, 0, 'P'},
 
+		{"Parallel processing of tiles", 0, 0, 0},
+		{"pipeline-zooms", no_argument, &additional[A_PIPELINE_ZOOMS], 1},
+
 		{"Projection of input", 0, 0, 0},
 		{"projection", required_argument, 0, 's'},
 
@@ -2559,6 +2845,7 @@ int main(int argc, char **argv) {
 		{"coalesce-smallest-as-needed", no_argument, &additional[A_COALESCE_SMALLEST_AS_NEEDED], 1},
 		{"force-feature-limit", no_argument, &prevent[P_DYNAMIC_DROP], 1},
 		{"cluster-densest-as-needed", no_argument, &additional[A_CLUSTER_DENSEST_AS_NEEDED], 1},
+		{"predict-dropping", no_argument, &additional[A_PREDICT_DROPPING], 1},
 
 		{"Dropping tightly overlapping features", 0, 0, 0},
 		{"gamma", required_argument, 0, 'g'},
@@ -2607,6 +2894,8 @@ int main(int argc, char **argv) {
 		{"no-feature-limit", no_argument, &prevent[P_FEATURE_LIMIT], 1},
 		{"no-tile-size-limit", no_argument, &prevent[P_KILOBYTE_LIMIT], 1},
 		{"no-tile-compression", no_argument, &prevent[P_TILE_COMPRESSION], 1},
+		{"tile-compression-level", required_argument, 0, '~'},
+		{"estimate-tile-size", no_argument, &additional[A_ESTIMATE_TILE_SIZE], 1},
 		{"no-tile-stats", no_argument, &prevent[P_TILE_STATS], 1},
 		{"tile-stats-attributes-limit", required_argument, 0, '~'},
 		{"tile-stats-sample-values-limit", required_argument, 0, '~'},
@@ -2614,6 +2903,7 @@ int main(int argc, char **argv) {
 
 		{"Temporary storage", 0, 0, 0},
 		{"temporary-directory", required_argument, 0, 't'},
+		{"memory-limit", required_argument, 0, '~'},
 
 		{"Progress indicator", 0, 0, 0},
 		{"quiet", no_argument, 0, 'q'},
@@ -2687,6 +2977,19 @@ int main(int argc, char **argv) {
 				max_tilestats_sample_values = atoi(optarg);
 			} else if (strcmp(opt, "tile-stats-values-limit") == 0) {
 				max_tilestats_values = atoi(optarg);
+			} else if (strcmp(opt, "tile-compression-level") == 0) {
+				tile_compression_level = atoi_require(argv[0], optarg, "Tile compression level");
+				if (tile_compression_level < -1 || tile_compression_level > 9) {
+					fprintf(stderr, "%s: --tile-compression-level must be between -1 and 9 (got %s)\n", argv[0], optarg);
+					exit(EXIT_FAILURE);
+				}
+			} else if (strcmp(opt, "memory-limit") == 0) {
+				memory_limit = atoll_require(argv[0], optarg, "Memory limit");
+				if (memory_limit <= 0 || memory_limit > LLONG_MAX / (1024 * 1024)) {
+					fprintf(stderr, "%s: --memory-limit must be a positive number of megabytes (got %s)\n", argv[0], optarg);
+					exit(EXIT_FAILURE);
+				}
+				memory_limit *= 1024 * 1024;
 			} else if (strcmp(opt, "clip-bounding-box") == 0) {
 				clipbbox clip;
 				if (sscanf(optarg, "%lf,%lf,%lf,%lf", &clip.lon1, &clip.lat1, &clip.lon2, &clip.lat2) == 4) {
@@ -2742,12 +3045,12 @@ int main(int argc, char **argv) {
 				maxzoom = MAX_ZOOM;
 				guess_maxzoom = true;
 			} else {
-				maxzoom = atoi_require(optarg, "Maxzoom");
+				maxzoom = atoi_require(argv[0], optarg, "Maxzoom");
 			}
 			break;
 
 		case 'Z':
-			minzoom = atoi_require(optarg, "Minzoom");
+			minzoom = atoi_require(argv[0], optarg, "Minzoom");
 			break;
 
 		case 'R': {
@@ -2770,16 +3073,16 @@ int main(int argc, char **argv) {
 			} else if (optarg[0] == 'g' || optarg[0] == 'f') {
 				basezoom = -2;
 				if (optarg[0] == 'g') {
-					basezoom_marker_width = atof_require(optarg + 1, "Marker width");
+					basezoom_marker_width = atof_require(argv[0], optarg + 1, "Marker width");
 				} else {
-					basezoom_marker_width = sqrt(50000 / atof_require(optarg + 1, "Marker width"));
+					basezoom_marker_width = sqrt(50000 / atof_require(argv[0], optarg + 1, "Marker width"));
 				}
-				if (basezoom_marker_width == 0 || atof_require(optarg + 1, "Marker width") == 0) {
+				if (basezoom_marker_width == 0 || atof_require(argv[0], optarg + 1, "Marker width") == 0) {
 					fprintf(stderr, "%s: Must specify value >0 with -B%c\n", argv[0], optarg[0]);
 					exit(EXIT_FAILURE);
 				}
 			} else {
-				basezoom = atoi_require(optarg, "Basezoom");
+				basezoom = atoi_require(argv[0], optarg, "Basezoom");
 				if (basezoom == 0 && strcmp(optarg, "0") != 0) {
 					fprintf(stderr, "%s: Couldn't understand -B%s\n", argv[0], optarg);
 					exit(EXIT_FAILURE);
@@ -2788,7 +3091,7 @@ int main(int argc, char **argv) {
 			break;
 
 		case 'K':
-			cluster_distance = atoi_require(optarg, "Cluster distance");
+			cluster_distance = atoi_require(argv[0], optarg, "Cluster distance");
 			if (cluster_distance > 255) {
 				fprintf(stderr, "%s: --cluster-distance %d is too big; limit is 255\n", argv[0], cluster_distance);
 				exit(EXIT_FAILURE);
@@ -2796,7 +3099,7 @@ int main(int argc, char **argv) {
 			break;
 
 		case 'd':
-			full_detail = atoi_require(optarg, "Full detail");
+			full_detail = atoi_require(argv[0], optarg, "Full detail");
 			if (full_detail > 30) {
 				// So the maximum geometry delta of just under 2 tile extents
 				// is less than 2^31
@@ -2807,7 +3110,7 @@ int main(int argc, char **argv) {
 			break;
 
 		case 'D':
-			low_detail = atoi_require(optarg, "Low detail");
+			low_detail = atoi_require(argv[0], optarg, "Low detail");
 			if (low_detail > 30) {
 				fprintf(stderr, "%s: --low-detail can be at most 30\n", argv[0]);
 				exit(EXIT_FAILURE);
@@ -2815,7 +3118,7 @@ int main(int argc, char **argv) {
 			break;
 
 		case 'm':
-			min_detail = atoi_require(optarg, "Min detail");
+			min_detail = atoi_require(argv[0], optarg, "Min detail");
 			break;
 
 		case 'o':
@@ -2880,21 +3183,21 @@ int main(int argc, char **argv) {
 			} else if (optarg[0] == 'g' || optarg[0] == 'f') {
 				droprate = -2;
 				if (optarg[0] == 'g') {
-					basezoom_marker_width = atof_require(optarg + 1, "Marker width");
+					basezoom_marker_width = atof_require(argv[0], optarg + 1, "Marker width");
 				} else {
-					basezoom_marker_width = sqrt(50000 / atof_require(optarg + 1, "Marker width"));
+					basezoom_marker_width = sqrt(50000 / atof_require(argv[0], optarg + 1, "Marker width"));
 				}
-				if (basezoom_marker_width == 0 || atof_require(optarg + 1, "Marker width") == 0) {
+				if (basezoom_marker_width == 0 || atof_require(argv[0], optarg + 1, "Marker width") == 0) {
 					fprintf(stderr, "%s: Must specify value >0 with -r%c\n", argv[0], optarg[0]);
 					exit(EXIT_FAILURE);
 				}
 			} else {
-				droprate = atof_require(optarg, "Drop rate");
+				droprate = atof_require(argv[0], optarg, "Drop rate");
 			}
 			break;
 
 		case 'b':
-			buffer = atoi_require(optarg, "Buffer");
+			buffer = atoi_require(argv[0], optarg, "Buffer");
 			if (buffer > 127) {
 				// So the maximum geometry delta is under 2 tile extents,
 				// from less than half a tile beyond one side to less than
@@ -2921,7 +3224,7 @@ int main(int argc, char **argv) {
 			break;
 
 		case 'g':
-			gamma = atof_require(optarg, "Gamma");
+			gamma = atof_require(argv[0], optarg, "Gamma");
 			break;
 
 		case 'q':
@@ -2933,7 +3236,7 @@ int main(int argc, char **argv) {
 			break;
 
 		case 'U':
-			progress_interval = atof_require(optarg, "Progress interval");
+			progress_interval = atof_require(argv[0], optarg, "Progress interval");
 			break;
 
 		case 'p': {
@@ -2975,7 +3278,7 @@ int main(int argc, char **argv) {
 			break;
 
 		case 'S':
-			simplification = atof_require(optarg, "Simplification");
+			simplification = atof_require(argv[0], optarg, "Simplification");
 			if (simplification <= 0) {
 				fprintf(stderr, "%s: --simplification must be > 0\n", argv[0]);
 				exit(EXIT_FAILURE);
@@ -2983,11 +3286,11 @@ int main(int argc, char **argv) {
 			break;
 
 		case 'M':
-			max_tile_size = atoll_require(optarg, "Max tile size");
+			max_tile_size = atoll_require(argv[0], optarg, "Max tile size");
 			break;
 
 		case 'O':
-			max_tile_features = atoll_require(optarg, "Max tile features");
+			max_tile_features = atoll_require(argv[0], optarg, "Max tile features");
 			break;
 
 		case 'c':
@@ -3145,12 +3448,17 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
+	if (deduplicate_tiles && out_dir != NULL) {
+		fprintf(stderr, "%s: --deduplicate-tiles only works with -o output, not -e\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
 	if (out_mbtiles != NULL) {
 		if (force) {
 			unlink(out_mbtiles);
 		}
 
-		outdb = mbtiles_open(out_mbtiles, argv, forcetable);
+		outdb = mbtiles_open(out_mbtiles, argv, forcetable, deduplicate_tiles);
 	}
 	if (out_dir != NULL) {
 		check_dir(out_dir, argv, force, forcetable);
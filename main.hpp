@@ -43,9 +43,11 @@ extern std::atomic<double> last_progress;
 
 extern size_t CPUS;
 extern size_t TEMP_FILES;
+extern long long MAX_FILES;
 
 extern size_t max_tile_size;
 extern size_t max_tile_features;
+extern int tile_compression_level;
 extern int cluster_distance;
 extern std::string attribute_for_id;
 
@@ -12,8 +12,11 @@
 #include <set>
 #include <map>
 #include <sys/stat.h>
+#include <pthread.h>
+#include <zlib.h>
 #include "mvt.hpp"
 #include "mbtiles.hpp"
+#include "dirtiles.hpp"
 #include "text.hpp"
 #include "milo/dtoa_milo.h"
 #include "write_json.hpp"
@@ -23,7 +26,7 @@ size_t max_tilestats_attributes = 1000;
 size_t max_tilestats_sample_values = 1000;
 size_t max_tilestats_values = 100;
 
-sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
+sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable, bool deduplicate) {
 	sqlite3 *outdb;
 
 	if (sqlite3_open(dbname, &outdb) != SQLITE_OK) {
@@ -51,10 +54,33 @@ sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
 			exit(EXIT_FAILURE);
 		}
 	}
-	if (sqlite3_exec(outdb, "CREATE TABLE tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);", NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "%s: create tiles table: %s\n", argv[0], err);
-		if (!forcetable) {
-			exit(EXIT_FAILURE);
+	if (deduplicate) {
+		// The same layout as mbutil's compressed tilesets: each distinct tile
+		// is stored once in images, and the tiles view puts it back together
+		if (sqlite3_exec(outdb, "CREATE TABLE map (zoom_level integer, tile_column integer, tile_row integer, tile_id text);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create map table: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (sqlite3_exec(outdb, "CREATE TABLE images (tile_data blob, tile_id text);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create images table: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (sqlite3_exec(outdb, "CREATE VIEW tiles AS SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column, map.tile_row AS tile_row, images.tile_data AS tile_data FROM map JOIN images ON images.tile_id = map.tile_id;", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create tiles view: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+	} else {
+		if (sqlite3_exec(outdb, "CREATE TABLE tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create tiles table: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
 		}
 	}
 	if (sqlite3_exec(outdb, "create unique index name on metadata (name);", NULL, NULL, &err) != SQLITE_OK) {
@@ -63,37 +89,276 @@ sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
 			exit(EXIT_FAILURE);
 		}
 	}
-	if (sqlite3_exec(outdb, "create unique index tile_index on tiles (zoom_level, tile_column, tile_row);", NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "%s: index tiles: %s\n", argv[0], err);
-		if (!forcetable) {
-			exit(EXIT_FAILURE);
+	if (deduplicate) {
+		if (sqlite3_exec(outdb, "create unique index map_index on map (zoom_level, tile_column, tile_row);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: index map: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (sqlite3_exec(outdb, "create unique index images_id on images (tile_id);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: index images: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+	} else {
+		if (sqlite3_exec(outdb, "create unique index tile_index on tiles (zoom_level, tile_column, tile_row);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: index tiles: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
 		}
 	}
 
 	return outdb;
 }
 
-void mbtiles_write_tile(sqlite3 *outdb, int z, int tx, int ty, const char *data, int size) {
+static sqlite3_stmt *prepare(sqlite3 *outdb, const char *query) {
 	sqlite3_stmt *stmt;
-	const char *query = "insert into tiles (zoom_level, tile_column, tile_row, tile_data) values (?, ?, ?, ?)";
 	if (sqlite3_prepare_v2(outdb, query, -1, &stmt, NULL) != SQLITE_OK) {
-		fprintf(stderr, "sqlite3 insert prep failed\n");
+		fprintf(stderr, "sqlite3 insert prep failed: %s\n", sqlite3_errmsg(outdb));
 		exit(EXIT_FAILURE);
 	}
+	return stmt;
+}
 
-	sqlite3_bind_int(stmt, 1, z);
-	sqlite3_bind_int(stmt, 2, tx);
-	sqlite3_bind_int(stmt, 3, (1 << z) - 1 - ty);
-	sqlite3_bind_blob(stmt, 4, data, size, NULL);
-
+static void step(sqlite3 *outdb, sqlite3_stmt *stmt) {
 	if (sqlite3_step(stmt) != SQLITE_DONE) {
 		fprintf(stderr, "sqlite3 insert failed: %s\n", sqlite3_errmsg(outdb));
 	}
+	if (sqlite3_reset(stmt) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 reset failed: %s\n", sqlite3_errmsg(outdb));
+	}
+}
+
+static void finalize(sqlite3 *outdb, sqlite3_stmt *stmt) {
 	if (sqlite3_finalize(stmt) != SQLITE_OK) {
 		fprintf(stderr, "sqlite3 finalize failed: %s\n", sqlite3_errmsg(outdb));
 	}
 }
 
+// Whether the tileset was created with the deduplicating map/images layout,
+// which may also be the case for an existing tileset being added to
+static bool is_deduplicated(sqlite3 *outdb) {
+	sqlite3_stmt *stmt;
+	bool found = false;
+
+	if (sqlite3_prepare_v2(outdb, "SELECT type from sqlite_master where name = 'tiles';", -1, &stmt, NULL) == SQLITE_OK) {
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			found = strcmp((const char *) sqlite3_column_text(stmt, 0), "view") == 0;
+		}
+		sqlite3_finalize(stmt);
+	}
+
+	return found;
+}
+
+// The content hash that identifies a tile in the images table: 64-bit FNV-1a,
+// CRC-32, and the length, which together make accidental collisions
+// vanishingly unlikely even across hundreds of millions of distinct tiles
+static std::string tile_id(std::string const &data) {
+	unsigned long long fnv = 14695981039346656037ULL;
+	for (size_t i = 0; i < data.size(); i++) {
+		fnv ^= (unsigned char) data[i];
+		fnv *= 1099511628211ULL;
+	}
+
+	unsigned long crc = crc32(0, (const Bytef *) data.data(), data.size());
+
+	char buf[3 * 16 + 3];
+	snprintf(buf, sizeof(buf), "%016llx%08lx%zx", fnv, crc, data.size());
+	return buf;
+}
+
+// Tiling threads wait once this much tile data is waiting to be written
+#define MBTILES_WRITER_QUEUE_BYTES (64 * 1024 * 1024)
+
+// Tiles inserted between commits
+#define MBTILES_WRITER_TRANSACTION_TILES 50000
+
+static void writer_exec(sqlite3 *outdb, const char *sql) {
+	char *err = NULL;
+	if (sqlite3_exec(outdb, sql, NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 %s failed: %s\n", sql, err);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void *run_writer(void *v) {
+	mbtiles_writer *w = (mbtiles_writer *) v;
+	sqlite3_stmt *tile_stmt = NULL;
+	sqlite3_stmt *image_stmt = NULL;
+	size_t in_transaction = 0;
+
+	if (w->outdb != NULL) {
+		if (w->deduplicate) {
+			tile_stmt = prepare(w->outdb, "insert into map (zoom_level, tile_column, tile_row, tile_id) values (?, ?, ?, ?)");
+			image_stmt = prepare(w->outdb, "insert or ignore into images (tile_id, tile_data) values (?, ?)");
+		} else {
+			tile_stmt = prepare(w->outdb, "insert into tiles (zoom_level, tile_column, tile_row, tile_data) values (?, ?, ?, ?)");
+		}
+	}
+
+	while (true) {
+		std::deque<mbtiles_pending_tile> batch;
+
+		if (pthread_mutex_lock(&w->lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_FAILURE);
+		}
+		while (w->queue.size() == 0 && !w->finishing) {
+			if (pthread_cond_wait(&w->wake_writer, &w->lock) != 0) {
+				perror("pthread_cond_wait");
+				exit(EXIT_FAILURE);
+			}
+		}
+		batch.swap(w->queue);
+		w->queued_bytes = 0;
+		bool finishing = w->finishing;
+		if (pthread_cond_broadcast(&w->wake_tilers) != 0) {
+			perror("pthread_cond_broadcast");
+			exit(EXIT_FAILURE);
+		}
+		if (pthread_mutex_unlock(&w->lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_FAILURE);
+		}
+
+		if (batch.size() == 0 && finishing) {
+			break;
+		}
+
+		for (auto &t : batch) {
+			if (w->outdb != NULL) {
+				if (in_transaction == 0) {
+					writer_exec(w->outdb, "BEGIN TRANSACTION");
+				}
+
+				sqlite3_bind_int(tile_stmt, 1, t.z);
+				sqlite3_bind_int(tile_stmt, 2, t.x);
+				sqlite3_bind_int(tile_stmt, 3, (1 << t.z) - 1 - t.y);
+
+				if (w->deduplicate) {
+					sqlite3_bind_text(image_stmt, 1, t.id.data(), t.id.size(), NULL);
+					sqlite3_bind_blob(image_stmt, 2, t.data.data(), t.data.size(), NULL);
+					step(w->outdb, image_stmt);
+
+					sqlite3_bind_text(tile_stmt, 4, t.id.data(), t.id.size(), NULL);
+					step(w->outdb, tile_stmt);
+				} else {
+					sqlite3_bind_blob(tile_stmt, 4, t.data.data(), t.data.size(), NULL);
+					step(w->outdb, tile_stmt);
+				}
+
+				in_transaction++;
+				if (in_transaction >= MBTILES_WRITER_TRANSACTION_TILES) {
+					writer_exec(w->outdb, "COMMIT");
+					in_transaction = 0;
+				}
+			} else if (w->outdir != NULL) {
+				dir_write_tile(w->outdir, t.z, t.x, t.y, t.data);
+			}
+		}
+	}
+
+	if (w->outdb != NULL) {
+		if (in_transaction > 0) {
+			writer_exec(w->outdb, "COMMIT");
+		}
+
+		finalize(w->outdb, tile_stmt);
+		if (image_stmt != NULL) {
+			finalize(w->outdb, image_stmt);
+		}
+	}
+
+	return NULL;
+}
+
+mbtiles_writer *mbtiles_writer_start(sqlite3 *outdb, const char *outdir) {
+	mbtiles_writer *w = new mbtiles_writer;
+	w->outdb = outdb;
+	w->outdir = outdir;
+	w->deduplicate = outdb != NULL && is_deduplicated(outdb);
+
+	if (pthread_mutex_init(&w->lock, NULL) != 0) {
+		perror("pthread_mutex_init");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_cond_init(&w->wake_writer, NULL) != 0 || pthread_cond_init(&w->wake_tilers, NULL) != 0) {
+		perror("pthread_cond_init");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_create(&w->thread, NULL, run_writer, w) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+
+	return w;
+}
+
+void mbtiles_writer_write(mbtiles_writer *w, int z, int tx, int ty, std::string &&data) {
+	mbtiles_pending_tile t;
+	t.z = z;
+	t.x = tx;
+	t.y = ty;
+	t.data = std::move(data);
+
+	// Hash here, on the tiling thread, rather than in the one thread that writes every tile
+	if (w->deduplicate) {
+		t.id = tile_id(t.data);
+	}
+
+	if (pthread_mutex_lock(&w->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+	while (w->queued_bytes > MBTILES_WRITER_QUEUE_BYTES) {
+		if (pthread_cond_wait(&w->wake_tilers, &w->lock) != 0) {
+			perror("pthread_cond_wait");
+			exit(EXIT_FAILURE);
+		}
+	}
+	w->queued_bytes += t.data.size();
+	w->queue.push_back(std::move(t));
+	if (pthread_cond_signal(&w->wake_writer) != 0) {
+		perror("pthread_cond_signal");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_mutex_unlock(&w->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void mbtiles_writer_finish(mbtiles_writer *w) {
+	if (pthread_mutex_lock(&w->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+	w->finishing = true;
+	if (pthread_cond_signal(&w->wake_writer) != 0) {
+		perror("pthread_cond_signal");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_mutex_unlock(&w->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+
+	void *retval;
+	if (pthread_join(w->thread, &retval) != 0) {
+		perror("pthread_join");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_cond_destroy(&w->wake_tilers);
+	pthread_cond_destroy(&w->wake_writer);
+	pthread_mutex_destroy(&w->lock);
+	delete w;
+}
+
 bool type_and_string::operator<(const type_and_string &o) const {
 	if (string < o.string) {
 		return true;
@@ -2,7 +2,9 @@
 #define MBTILES_HPP
 
 #include <math.h>
+#include <pthread.h>
 #include <map>
+#include <deque>
 #include "mvt.hpp"
 
 extern size_t max_tilestats_attributes;
@@ -41,9 +43,41 @@ struct layermap_entry {
 	}
 };
 
-sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable);
+sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable, bool deduplicate);
 
-void mbtiles_write_tile(sqlite3 *outdb, int z, int tx, int ty, const char *data, int size);
+struct mbtiles_pending_tile {
+	int z = 0;
+	int x = 0;
+	int y = 0;
+	std::string data = "";
+	std::string id = "";  // content hash, if the tileset is deduplicated
+};
+
+// Tiles are handed off to a single thread that owns the output, so that
+// the threads making tiles never wait for each other to write them, and
+// inserts can share one prepared statement inside long transactions.
+struct mbtiles_writer {
+	sqlite3 *outdb = NULL;
+	const char *outdir = NULL;
+	bool deduplicate = false;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake_writer;
+	pthread_cond_t wake_tilers;
+
+	std::deque<mbtiles_pending_tile> queue{};
+	size_t queued_bytes = 0;
+	bool finishing = false;
+};
+
+mbtiles_writer *mbtiles_writer_start(sqlite3 *outdb, const char *outdir);
+
+// Queue a tile for writing, taking over its data and waiting if too much is already queued
+void mbtiles_writer_write(mbtiles_writer *w, int z, int tx, int ty, std::string &&data);
+
+// Write everything still queued and stop the writer thread
+void mbtiles_writer_finish(mbtiles_writer *w);
 
 void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, const char *fname, int minzoom, int maxzoom, double minlat, double minlon, double maxlat, double maxlon, double midlat, double midlon, int forcetable, const char *attribution, std::map<std::string, layermap_entry> const &layermap, bool vector, const char *description, bool do_tilestats, std::map<std::string, std::string> const &attribute_descriptions, std::string const &program, std::string const &commandline);
 
@@ -7,6 +7,17 @@
 #define INCREMENT 131072
 #define INITIAL 256
 
+// Ask for transparent huge pages for the mapping where the system
+// supports them for this kind of file, to cut TLB misses on big pools.
+static void advise_huge(char *map, long long len) {
+#ifdef MADV_HUGEPAGE
+	madvise(map, len, MADV_HUGEPAGE);
+#else
+	(void) map;
+	(void) len;
+#endif
+}
+
 struct memfile *memfile_open(int fd) {
 	if (ftruncate(fd, INITIAL) != 0) {
 		return NULL;
@@ -23,16 +34,27 @@ struct memfile *memfile_open(int fd) {
 		return NULL;
 	}
 
+	if (pthread_mutex_init(&mf->grow_lock, NULL) != 0) {
+		munmap(map, INITIAL);
+		delete mf;
+		return NULL;
+	}
+
 	mf->fd = fd;
 	mf->map = map;
 	mf->len = INITIAL;
 	mf->off = 0;
-	mf->tree = 0;
 
 	return mf;
 }
 
 int memfile_close(struct memfile *file) {
+	for (size_t i = 0; i < file->old_maps.size(); i++) {
+		if (munmap(file->old_maps[i].first, file->old_maps[i].second) != 0) {
+			return -1;
+		}
+	}
+
 	if (munmap(file->map, file->len) != 0) {
 		return -1;
 	}
@@ -43,29 +65,69 @@ int memfile_close(struct memfile *file) {
 		}
 	}
 
+	if (pthread_mutex_destroy(&file->grow_lock) != 0) {
+		return -1;
+	}
+
 	delete file;
 	return 0;
 }
 
-int memfile_write(struct memfile *file, void *s, long long len) {
-	if (file->off + len > file->len) {
-		if (munmap(file->map, file->len) != 0) {
+// Reserve len bytes at the end of the file, returning their offset, or -1 on error.
+// The map covers them once this returns.
+long long memfile_reserve(struct memfile *file, long long len) {
+	long long off = file->off.fetch_add(len);
+
+	if (off + len > file->len) {
+		if (pthread_mutex_lock(&file->grow_lock) != 0) {
 			return -1;
 		}
 
-		file->len += (len + INCREMENT + 1) / INCREMENT * INCREMENT;
+		// Another thread may have grown it far enough in the meantime
+		if (off + len > file->len) {
+			// Grow geometrically so that a file that ends up N bytes long
+			// only has to be remapped O(log N) times
+			long long cur = file->len;
+			long long grow = cur < INCREMENT ? INCREMENT : cur;
+			if (cur + grow < off + len) {
+				grow = off + len - cur;
+			}
+			long long newlen = cur + (grow + INCREMENT - 1) / INCREMENT * INCREMENT;
 
-		if (ftruncate(file->fd, file->len) != 0) {
-			return -1;
+			if (ftruncate(file->fd, newlen) != 0) {
+				pthread_mutex_unlock(&file->grow_lock);
+				return -1;
+			}
+
+			char *map = (char *) mmap(NULL, newlen, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+			if (map == MAP_FAILED) {
+				pthread_mutex_unlock(&file->grow_lock);
+				return -1;
+			}
+			advise_huge(map, newlen);
+
+			// Other threads may still be reading or writing through the old map.
+			// The new map has to be in place before the new length is, so that
+			// anyone who sees the new length also sees a map that covers it.
+			file->old_maps.push_back(std::pair<char *, long long>(file->map, cur));
+			file->map = map;
+			file->len = newlen;
 		}
 
-		file->map = (char *) mmap(NULL, file->len, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
-		if (file->map == MAP_FAILED) {
+		if (pthread_mutex_unlock(&file->grow_lock) != 0) {
 			return -1;
 		}
 	}
 
-	memcpy(file->map + file->off, s, len);
-	file->off += len;
+	return off;
+}
+
+int memfile_write(struct memfile *file, void *s, long long len) {
+	long long off = memfile_reserve(file, len);
+	if (off < 0) {
+		return -1;
+	}
+
+	memcpy(file->map + off, s, len);
 	return len;
 }
@@ -2,21 +2,29 @@
 #define MEMFILE_HPP
 
 #include <atomic>
+#include <vector>
+#include <pthread.h>
 
+// A file that is appended to through a memory map. Any number of threads
+// can append at once: each reserves its space by bumping the offset, and
+// the map is only ever replaced, never unmapped, while the file is open,
+// so a pointer taken from an earlier map stays good for what it covered.
 struct memfile {
 	int fd = 0;
-	char *map = NULL;
+	std::atomic<char *> map;
 	std::atomic<long long> len;
-	long long off = 0;
-	unsigned long tree = 0;
+	std::atomic<long long> off;
+	std::vector<std::pair<char *, long long>> old_maps;
+	pthread_mutex_t grow_lock;
 
 	memfile()
-	    : len(0) {
+	    : map(NULL), len(0), off(0) {
 	}
 };
 
 struct memfile *memfile_open(int fd);
 int memfile_close(struct memfile *file);
+long long memfile_reserve(struct memfile *file, long long len);
 int memfile_write(struct memfile *file, void *s, long long len);
 
 #endif
@@ -3,6 +3,8 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <iterator>
+#include <functional>
 #include <zlib.h>
 #include <errno.h>
 #include <limits.h>
@@ -81,29 +83,33 @@ int decompress(std::string const &input, std::string &output) {
 }
 
 // https://github.com/mapbox/mapnik-vector-tile/blob/master/src/vector_tile_compression.hpp
-int compress(std::string const &input, std::string &output) {
+int compress(std::string const &input, std::string &output, int level) {
 	z_stream deflate_s;
 	deflate_s.zalloc = Z_NULL;
 	deflate_s.zfree = Z_NULL;
 	deflate_s.opaque = Z_NULL;
 	deflate_s.avail_in = 0;
 	deflate_s.next_in = Z_NULL;
-	deflateInit2(&deflate_s, Z_BEST_COMPRESSION, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY);
+	if (deflateInit2(&deflate_s, level, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return -1;
+	}
+
+	// deflateBound() includes the gzip header and trailer, so the whole
+	// tile can be compressed in a single call without growing the output
+	output.resize(deflateBound(&deflate_s, input.size()));
 	deflate_s.next_in = (Bytef *) input.data();
 	deflate_s.avail_in = input.size();
-	size_t length = 0;
-	do {
-		size_t increase = input.size() / 2 + 1024;
-		output.resize(length + increase);
-		deflate_s.avail_out = increase;
-		deflate_s.next_out = (Bytef *) (output.data() + length);
-		int ret = deflate(&deflate_s, Z_FINISH);
-		if (ret != Z_STREAM_END && ret != Z_OK && ret != Z_BUF_ERROR) {
-			return -1;
-		}
-		length += (increase - deflate_s.avail_out);
-	} while (deflate_s.avail_out == 0);
+	deflate_s.next_out = (Bytef *) output.data();
+	deflate_s.avail_out = output.size();
+
+	int ret = deflate(&deflate_s, Z_FINISH);
+	size_t length = output.size() - deflate_s.avail_out;
 	deflateEnd(&deflate_s);
+
+	if (ret != Z_STREAM_END) {
+		return -1;
+	}
+
 	output.resize(length);
 	return 0;
 }
@@ -277,10 +283,16 @@ bool mvt_tile::decode(std::string &message, bool &was_compressed) {
 			}
 
 			for (size_t i = 0; i < layer.keys.size(); i++) {
-				layer.key_map.insert(std::pair<std::string, size_t>(layer.keys[i], i));
+				size_t h = std::hash<std::string>()(layer.keys[i]);
+				if (layer.tag_tables.keys.find(h, [&](size_t k) { return layer.keys[k] == layer.keys[i]; }) < 0) {
+					layer.tag_tables.keys.insert(h, i);
+				}
 			}
 			for (size_t i = 0; i < layer.values.size(); i++) {
-				layer.value_map.insert(std::pair<mvt_value, size_t>(layer.values[i], i));
+				size_t h = layer.values[i].hash();
+				if (layer.tag_tables.values.find(h, [&](size_t v) { return layer.values[v] == layer.values[i]; }) < 0) {
+					layer.tag_tables.values.insert(h, i);
+				}
 			}
 
 			layers.push_back(layer);
@@ -296,14 +308,178 @@ bool mvt_tile::decode(std::string &message, bool &was_compressed) {
 	return true;
 }
 
+static size_t varint_size(unsigned long long v) {
+	size_t n = 1;
+	while (v >= 0x80) {
+		v >>= 7;
+		n++;
+	}
+	return n;
+}
+
+// The size of a length-delimited field with a one-byte tag
+static size_t message_size(size_t len) {
+	return 1 + varint_size(len) + len;
+}
+
+static void add_varint(std::string &data, unsigned long long v) {
+	protozero::write_varint(std::back_inserter(data), v);
+}
+
+// The size of a Value message's contents
+static size_t value_encoded_size(mvt_value const &pbv) {
+	if (pbv.type == mvt_string) {
+		return message_size(pbv.string_value.size());
+	} else if (pbv.type == mvt_float) {
+		return 1 + sizeof(float);
+	} else if (pbv.type == mvt_double) {
+		return 1 + sizeof(double);
+	} else if (pbv.type == mvt_int) {
+		return 1 + varint_size((uint64_t) pbv.numeric_value.int_value);
+	} else if (pbv.type == mvt_uint) {
+		return 1 + varint_size(pbv.numeric_value.uint_value);
+	} else if (pbv.type == mvt_sint) {
+		return 1 + varint_size(protozero::encode_zigzag64(pbv.numeric_value.sint_value));
+	} else if (pbv.type == mvt_bool) {
+		return 1 + 1;
+	}
+
+	return 0;
+}
+
+static size_t tags_encoded_size(mvt_feature const &feature) {
+	size_t size = 0;
+	for (size_t t = 0; t < feature.tags.size(); t++) {
+		size += varint_size(feature.tags[t]);
+	}
+	return size;
+}
+
+// Mirrors the command and delta encoding in write_geometry()
+static size_t geometry_encoded_size(mvt_feature const &feature) {
+	size_t size = 0;
+	long long px = 0, py = 0;
+	int cmd = -1;
+	int length = 0;
+
+	for (size_t g = 0; g < feature.geometry.size(); g++) {
+		int op = feature.geometry[g].op;
+
+		if (op != cmd) {
+			if (cmd >= 0) {
+				size += varint_size((uint32_t)((length << 3) | (cmd & ((1 << 3) - 1))));
+			}
+
+			cmd = op;
+			length = 0;
+		}
+
+		if (op == mvt_moveto || op == mvt_lineto) {
+			size += varint_size(protozero::encode_zigzag32(feature.geometry[g].x - px));
+			size += varint_size(protozero::encode_zigzag32(feature.geometry[g].y - py));
+
+			px = feature.geometry[g].x;
+			py = feature.geometry[g].y;
+		}
+
+		length++;
+	}
+
+	if (cmd >= 0) {
+		size += varint_size((uint32_t)((length << 3) | (cmd & ((1 << 3) - 1))));
+	}
+
+	return size;
+}
+
+// The size of a Feature message's contents, given the sizes of its packed fields
+static size_t feature_encoded_size(mvt_feature const &feature, size_t tags_size, size_t geometry_size) {
+	size_t size = 1 + varint_size((uint64_t)(int32_t) feature.type);
+
+	if (tags_size > 0) {
+		size += message_size(tags_size);
+	}
+
+	if (feature.has_id) {
+		size += 1 + varint_size(feature.id);
+	}
+
+	if (geometry_size > 0) {
+		size += message_size(geometry_size);
+	}
+
+	return size;
+}
+
+// Append the packed command and delta integers for a geometry
+static void write_geometry(std::string &data, std::vector<mvt_geometry> const &geom) {
+	long long px = 0, py = 0;
+
+	for (size_t g = 0; g < geom.size();) {
+		int op = geom[g].op;
+
+		size_t end = g + 1;
+		while (end < geom.size() && geom[end].op == op) {
+			end++;
+		}
+
+		if (op != mvt_moveto && op != mvt_lineto && op != mvt_closepath) {
+			fprintf(stderr, "\nInternal error: corrupted geometry\n");
+			exit(EXIT_FAILURE);
+		}
+
+		int length = end - g;
+		add_varint(data, (uint32_t)((length << 3) | (op & ((1 << 3) - 1))));
+
+		if (op == mvt_moveto || op == mvt_lineto) {
+			for (; g < end; g++) {
+				long long wwx = geom[g].x;
+				long long wwy = geom[g].y;
+
+				long long dx = wwx - px;
+				long long dy = wwy - py;
+
+				if (dx < INT_MIN || dx > INT_MAX || dy < INT_MIN || dy > INT_MAX) {
+					fprintf(stderr, "Internal error: Geometry delta is too big: %lld,%lld\n", dx, dy);
+					exit(EXIT_FAILURE);
+				}
+
+				add_varint(data, protozero::encode_zigzag32(dx));
+				add_varint(data, protozero::encode_zigzag32(dy));
+
+				px = wwx;
+				py = wwy;
+			}
+		}
+
+		g = end;
+	}
+}
+
 std::string mvt_tile::encode() {
 	std::string data;
+	encode(data);
+	return data;
+}
+
+// Every message's size is computed before it is written, so each one can
+// be written in place, after its exact length, without building it separately
+void mvt_tile::encode(std::string &data) {
+	std::vector<size_t> layer_sizes;
+	size_t size = 0;
+
+	for (size_t i = 0; i < layers.size(); i++) {
+		layer_sizes.push_back(layers[i].encoded_size());
+		size += message_size(layer_sizes[i]);
+	}
+
+	data.clear();
+	data.reserve(size);
 
 	protozero::pbf_writer writer(data);
 
 	for (size_t i = 0; i < layers.size(); i++) {
-		std::string layer_string;
-		protozero::pbf_writer layer_writer(layer_string);
+		protozero::pbf_writer layer_writer(writer, 3, layer_sizes[i]);
 
 		layer_writer.add_uint32(15, layers[i].version); /* version */
 		layer_writer.add_string(1, layers[i].name);     /* name */
@@ -314,10 +490,18 @@ std::string mvt_tile::encode() {
 		}
 
 		for (size_t v = 0; v < layers[i].values.size(); v++) {
-			std::string value_string;
-			protozero::pbf_writer value_writer(value_string);
 			mvt_value &pbv = layers[i].values[v];
 
+			if (pbv.type == mvt_null) {
+				fprintf(stderr, "Internal error: trying to write null attribute to tile\n");
+				exit(EXIT_FAILURE);
+			} else if (pbv.type < mvt_string || pbv.type > mvt_bool) {
+				fprintf(stderr, "Internal error: trying to write undefined attribute type to tile\n");
+				exit(EXIT_FAILURE);
+			}
+
+			protozero::pbf_writer value_writer(layer_writer, 4, value_encoded_size(pbv));
+
 			if (pbv.type == mvt_string) {
 				value_writer.add_string(1, pbv.string_value);
 			} else if (pbv.type == mvt_float) {
@@ -332,89 +516,133 @@ std::string mvt_tile::encode() {
 				value_writer.add_sint64(6, pbv.numeric_value.sint_value);
 			} else if (pbv.type == mvt_bool) {
 				value_writer.add_bool(7, pbv.numeric_value.bool_value);
-			} else if (pbv.type == mvt_null) {
-				fprintf(stderr, "Internal error: trying to write null attribute to tile\n");
-				exit(EXIT_FAILURE);
-			} else {
-				fprintf(stderr, "Internal error: trying to write undefined attribute type to tile\n");
-				exit(EXIT_FAILURE);
 			}
-
-			layer_writer.add_message(4, value_string);
 		}
 
 		for (size_t f = 0; f < layers[i].features.size(); f++) {
-			std::string feature_string;
-			protozero::pbf_writer feature_writer(feature_string);
+			mvt_feature &feature = layers[i].features[f];
+			size_t tags_size = tags_encoded_size(feature);
+			size_t geometry_size = geometry_encoded_size(feature);
+
+			protozero::pbf_writer feature_writer(layer_writer, 2, feature_encoded_size(feature, tags_size, geometry_size));
 
-			feature_writer.add_enum(3, layers[i].features[f].type);
-			feature_writer.add_packed_uint32(2, std::begin(layers[i].features[f].tags), std::end(layers[i].features[f].tags));
+			feature_writer.add_enum(3, feature.type);
 
-			if (layers[i].features[f].has_id) {
-				feature_writer.add_uint64(1, layers[i].features[f].id);
+			// The packed fields' contents are appended straight to the buffer
+			// once the nested writer has written their length
+			if (tags_size > 0) {
+				protozero::pbf_writer tags_writer(feature_writer, 2, tags_size);
+				for (size_t t = 0; t < feature.tags.size(); t++) {
+					add_varint(data, feature.tags[t]);
+				}
 			}
 
-			std::vector<uint32_t> geometry;
+			if (feature.has_id) {
+				feature_writer.add_uint64(1, feature.id);
+			}
 
-			long long px = 0, py = 0;
-			int cmd_idx = -1;
-			int cmd = -1;
-			int length = 0;
+			if (geometry_size > 0) {
+				protozero::pbf_writer geometry_writer(feature_writer, 4, geometry_size);
+				write_geometry(data, feature.geometry);
+			}
+		}
+	}
+}
 
-			std::vector<mvt_geometry> &geom = layers[i].features[f].geometry;
+size_t mvt_layer::encoded_size() const {
+	size_t size = 0;
 
-			for (size_t g = 0; g < geom.size(); g++) {
-				int op = geom[g].op;
+	size += 1 + varint_size((uint32_t) version);
+	size += message_size(name.size());
+	size += 1 + varint_size((uint32_t) extent);
 
-				if (op != cmd) {
-					if (cmd_idx >= 0) {
-						geometry[cmd_idx] = (length << 3) | (cmd & ((1 << 3) - 1));
-					}
+	for (size_t j = 0; j < keys.size(); j++) {
+		size += message_size(keys[j].size());
+	}
 
-					cmd = op;
-					length = 0;
-					cmd_idx = geometry.size();
-					geometry.push_back(0);
-				}
+	for (size_t v = 0; v < values.size(); v++) {
+		size_t value_size = value_encoded_size(values[v]);
+		size += message_size(value_size);
+	}
 
-				if (op == mvt_moveto || op == mvt_lineto) {
-					long long wwx = geom[g].x;
-					long long wwy = geom[g].y;
+	for (size_t f = 0; f < features.size(); f++) {
+		size_t feature_size = feature_encoded_size(features[f], tags_encoded_size(features[f]), geometry_encoded_size(features[f]));
+		size += message_size(feature_size);
+	}
 
-					long long dx = wwx - px;
-					long long dy = wwy - py;
+	return size;
+}
 
-					if (dx < INT_MIN || dx > INT_MAX || dy < INT_MIN || dy > INT_MAX) {
-						fprintf(stderr, "Internal error: Geometry delta is too big: %lld,%lld\n", dx, dy);
-						exit(EXIT_FAILURE);
-					}
+size_t mvt_tile::encoded_size() const {
+	size_t size = 0;
 
-					geometry.push_back(protozero::encode_zigzag32(dx));
-					geometry.push_back(protozero::encode_zigzag32(dy));
+	for (size_t i = 0; i < layers.size(); i++) {
+		size_t layer_size = layers[i].encoded_size();
+		size += message_size(layer_size);
+	}
 
-					px = wwx;
-					py = wwy;
-					length++;
-				} else if (op == mvt_closepath) {
-					length++;
-				} else {
-					fprintf(stderr, "\nInternal error: corrupted geometry\n");
-					exit(EXIT_FAILURE);
-				}
-			}
+	return size;
+}
 
-			if (cmd_idx >= 0) {
-				geometry[cmd_idx] = (length << 3) | (cmd & ((1 << 3) - 1));
-			}
+bool mvt_value::operator==(const mvt_value &o) const {
+	if (type != o.type) {
+		return false;
+	}
 
-			feature_writer.add_packed_uint32(4, std::begin(geometry), std::end(geometry));
-			layer_writer.add_message(2, feature_string);
-		}
+	switch (type) {
+	case mvt_string:
+		return string_value == o.string_value;
+	case mvt_float:
+		return numeric_value.float_value == o.numeric_value.float_value;
+	case mvt_double:
+		return numeric_value.double_value == o.numeric_value.double_value;
+	case mvt_int:
+		return numeric_value.int_value == o.numeric_value.int_value;
+	case mvt_uint:
+		return numeric_value.uint_value == o.numeric_value.uint_value;
+	case mvt_sint:
+		return numeric_value.sint_value == o.numeric_value.sint_value;
+	case mvt_bool:
+		return numeric_value.bool_value == o.numeric_value.bool_value;
+	case mvt_null:
+		return numeric_value.null_value == o.numeric_value.null_value;
+	}
+
+	return false;
+}
 
-		writer.add_message(3, layer_string);
+// Consistent with operator==: values that are equal hash the same
+size_t mvt_value::hash() const {
+	size_t h = 0;
+
+	switch (type) {
+	case mvt_string:
+		h = std::hash<std::string>()(string_value);
+		break;
+	case mvt_float:
+		h = std::hash<float>()(numeric_value.float_value);
+		break;
+	case mvt_double:
+		h = std::hash<double>()(numeric_value.double_value);
+		break;
+	case mvt_int:
+		h = std::hash<long long>()(numeric_value.int_value);
+		break;
+	case mvt_uint:
+		h = std::hash<unsigned long long>()(numeric_value.uint_value);
+		break;
+	case mvt_sint:
+		h = std::hash<long long>()(numeric_value.sint_value);
+		break;
+	case mvt_bool:
+		h = numeric_value.bool_value;
+		break;
+	case mvt_null:
+		h = numeric_value.null_value;
+		break;
 	}
 
-	return data;
+	return h * 31 + type;
 }
 
 bool mvt_value::operator<(const mvt_value &o) const {
@@ -490,32 +718,105 @@ std::string mvt_value::toString() {
 	}
 }
 
-void mvt_layer::tag(mvt_feature &feature, std::string key, mvt_value value) {
-	size_t ko, vo;
+void mvt_intern_index::insert(size_t hash, size_t index) {
+	if ((count + 1) * 2 > slots.size()) {
+		std::vector<slot> old;
+		old.swap(slots);
+		slots.resize(old.size() < 16 ? 32 : old.size() * 2);
+
+		size_t mask = slots.size() - 1;
+		for (size_t i = 0; i < old.size(); i++) {
+			if (old[i].epoch == epoch) {
+				size_t j = start(old[i].hash, mask);
+				while (slots[j].epoch == epoch) {
+					j = (j + 1) & mask;
+				}
+				slots[j] = old[i];
+			}
+		}
+	}
+
+	size_t mask = slots.size() - 1;
+	size_t j = start(hash, mask);
+	while (slots[j].epoch == epoch) {
+		j = (j + 1) & mask;
+	}
+
+	slots[j].hash = hash;
+	slots[j].index = index;
+	slots[j].epoch = epoch;
+	count++;
+}
 
-	std::map<std::string, size_t>::iterator ki = key_map.find(key);
-	std::map<mvt_value, size_t>::iterator vi = value_map.find(value);
+void mvt_intern_index::clear() {
+	count = 0;
+	epoch++;
 
-	if (ki == key_map.end()) {
+	// Slots from 4 billion clears ago would look current again
+	if (epoch == 0) {
+		for (size_t i = 0; i < slots.size(); i++) {
+			slots[i].epoch = 0;
+		}
+		epoch = 1;
+	}
+}
+
+void mvt_tag_tables::clear() {
+	keys.clear();
+	values.clear();
+	pooled_keys.clear();
+	pooled_values.clear();
+}
+
+void mvt_layer::tag(mvt_feature &feature, std::string const &key, mvt_value const &value) {
+	size_t kh = std::hash<std::string>()(key);
+	long long ko = tag_tables.keys.find(kh, [&](size_t k) { return keys[k] == key; });
+	if (ko < 0) {
 		ko = keys.size();
 		keys.push_back(key);
-		key_map.insert(std::pair<std::string, size_t>(key, ko));
-	} else {
-		ko = ki->second;
+		tag_tables.keys.insert(kh, ko);
 	}
 
-	if (vi == value_map.end()) {
+	size_t vh = value.hash();
+	long long vo = tag_tables.values.find(vh, [&](size_t v) { return values[v] == value; });
+	if (vo < 0) {
 		vo = values.size();
 		values.push_back(value);
-		value_map.insert(std::pair<mvt_value, size_t>(value, vo));
-	} else {
-		vo = vi->second;
+		tag_tables.values.insert(vh, vo);
 	}
 
 	feature.tags.push_back(ko);
 	feature.tags.push_back(vo);
 }
 
+void mvt_layer::tag_pooled(mvt_feature &feature, const char *key, const char *value) {
+	// The address is the whole identity, so any match is the right one
+	auto any = [](size_t) { return true; };
+
+	size_t kh = (size_t) key;
+	long long ko = tag_tables.pooled_keys.find(kh, any);
+	size_t vh = (size_t) value;
+	long long vo = tag_tables.pooled_values.find(vh, any);
+
+	if (ko >= 0 && vo >= 0) {
+		feature.tags.push_back(ko);
+		feature.tags.push_back(vo);
+		return;
+	}
+
+	// Otherwise decode them and look them up by content,
+	// then remember where they ended up
+	size_t n = feature.tags.size();
+	tag(feature, stringified_to_mvt_value(key[0], key + 1).string_value, stringified_to_mvt_value(value[0], value + 1));
+
+	if (ko < 0) {
+		tag_tables.pooled_keys.insert(kh, feature.tags[n]);
+	}
+	if (vo < 0) {
+		tag_tables.pooled_values.insert(vh, feature.tags[n + 1]);
+	}
+}
+
 bool is_integer(const char *s, long long *v) {
 	errno = 0;
 	char *endptr;
@@ -81,6 +81,8 @@ struct mvt_value {
 	} numeric_value;
 
 	bool operator<(const mvt_value &o) const;
+	bool operator==(const mvt_value &o) const;
+	size_t hash() const;
 	std::string toString();
 
 	mvt_value() {
@@ -90,6 +92,62 @@ struct mvt_value {
 	}
 };
 
+// An index from hashes to positions in a layer's keys or values,
+// by open addressing. It only stores the positions, so the caller
+// supplies the comparison against what is at each one. Clearing it
+// doesn't touch the slots, so the same index can be reused from
+// layer to layer and tile to tile at no cost.
+struct mvt_intern_index {
+	struct slot {
+		size_t hash = 0;
+		size_t index = 0;
+		unsigned epoch = 0;
+	};
+
+	std::vector<slot> slots{};
+	unsigned epoch = 1;
+	size_t count = 0;
+
+	// The position stored with this hash that same() accepts, or -1
+	template <typename F>
+	long long find(size_t hash, F const &same) const {
+		if (count == 0) {
+			return -1;
+		}
+
+		size_t mask = slots.size() - 1;
+		for (size_t i = start(hash, mask);; i = (i + 1) & mask) {
+			slot const &sl = slots[i];
+			if (sl.epoch != epoch) {
+				return -1;
+			}
+			if (sl.hash == hash && same(sl.index)) {
+				return sl.index;
+			}
+		}
+	}
+
+	void insert(size_t hash, size_t index);
+	void clear();
+
+	// Spread out hashes, like integers and addresses, that differ only in a few bits
+	static size_t start(size_t hash, size_t mask) {
+		return (size_t)(((unsigned long long) hash * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+	}
+};
+
+// The indexes for tagging features in a layer
+struct mvt_tag_tables {
+	mvt_intern_index keys{};
+	mvt_intern_index values{};
+
+	// Keyed by the address of string pool entries
+	mvt_intern_index pooled_keys{};
+	mvt_intern_index pooled_values{};
+
+	void clear();
+};
+
 struct mvt_layer {
 	int version = 0;
 	std::string name = "";
@@ -99,23 +157,40 @@ struct mvt_layer {
 	long long extent = 0;
 
 	// Add a key-value pair to a feature, using this layer's constant pool
-	void tag(mvt_feature &feature, std::string key, mvt_value value);
+	void tag(mvt_feature &feature, std::string const &key, mvt_value const &value);
+
+	// The same, for a key and a value that are string pool entries (a type
+	// byte followed by the stringified value) that stay in place for as long
+	// as this layer is being tagged. Entries that have been seen before are
+	// found by their address without being decoded again.
+	void tag_pooled(mvt_feature &feature, const char *key, const char *value);
+
+	// The number of bytes encode() would produce for this layer's message,
+	// computed without building it
+	size_t encoded_size() const;
 
 	// For tracking the key-value constants already used in this layer
-	std::map<std::string, size_t> key_map{};
-	std::map<mvt_value, size_t> value_map{};
+	mvt_tag_tables tag_tables{};
 };
 
 struct mvt_tile {
 	std::vector<mvt_layer> layers{};
 
 	std::string encode();
+	size_t encoded_size() const;
+
+	// Encode into data, replacing what was there, so that one buffer
+	// can be reused from tile to tile
+	void encode(std::string &data);
 	bool decode(std::string &message, bool &was_compressed);
 };
 
 bool is_compressed(std::string const &data);
 int decompress(std::string const &input, std::string &output);
-int compress(std::string const &input, std::string &output);
+
+// Gzip the input at the given zlib compression level, 0 (none) to 9 (best)
+int compress(std::string const &input, std::string &output, int level = 9);
+
 int dezig(unsigned n);
 
 mvt_value stringified_to_mvt_value(int type, const char *s);
@@ -25,6 +25,9 @@
 #define A_GENERATE_IDS ((int) 'i')
 #define A_CONVERT_NUMERIC_IDS ((int) 'I')
 #define A_HILBERT ((int) 'h')
+#define A_PIPELINE_ZOOMS ((int) 'z')
+#define A_PREDICT_DROPPING ((int) 'f')
+#define A_ESTIMATE_TILE_SIZE ((int) 'E')
 
 #define P_SIMPLIFY ((int) 's')
 #define P_SIMPLIFY_LOW ((int) 'S')
@@ -93,6 +93,7 @@ std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::
 		exit(EXIT_FAILURE);
 	}
 	json_pull *jp = json_begin_file(f);
+	jp->pack_coordinates = 1;
 
 	while (1) {
 		json_object *j = json_read(jp);
@@ -147,7 +148,7 @@ std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::
 		}
 
 		json_object *coordinates = json_hash_get(geometry, "coordinates");
-		if (coordinates == NULL || coordinates->type != JSON_ARRAY) {
+		if (coordinates == NULL || (coordinates->type != JSON_ARRAY && coordinates->type != JSON_COORDINATES)) {
 			fprintf(stderr, "Filter output:%d: feature without coordinates array\n", jp->line);
 			json_context(j);
 			exit(EXIT_FAILURE);
@@ -352,7 +353,7 @@ serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::
 		}
 
 		json_object *coordinates = json_hash_get(geometry, "coordinates");
-		if (coordinates == NULL || coordinates->type != JSON_ARRAY) {
+		if (coordinates == NULL || (coordinates->type != JSON_ARRAY && coordinates->type != JSON_COORDINATES)) {
 			fprintf(stderr, "Filter output:%d: feature without coordinates array\n", jp->line);
 			json_context(j);
 			exit(EXIT_FAILURE);
@@ -2,120 +2,172 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
-#include <math.h>
+#include <pthread.h>
 #include "memfile.hpp"
 #include "pool.hpp"
 
-int swizzlecmp(const char *a, const char *b) {
-	ssize_t alen = strlen(a);
-	ssize_t blen = strlen(b);
-
-	if (strcmp(a, b) == 0) {
-		return 0;
+#define POOL_SHARD_BITS 6
+#define POOL_SHARDS (1 << POOL_SHARD_BITS)
+#define INITIAL_CAPACITY 256  // slots in each shard's index to begin with
+
+// The pool is shared by all the threads reading input. Its index is split
+// into shards by the top bits of each string's hash, and each shard has
+// its own lock, so threads only wait for each other when they look up
+// strings that land in the same shard. New strings and new indexes are
+// appended to the pool and tree files with an atomic bump of their offsets,
+// which never moves anything that another thread might be reading.
+//
+// There is only ever one pool, so the shards are not tied to its files.
+struct pool_shard {
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	unsigned long long index = 0;  // offset of this shard's index in the tree file, or 0
+};
+
+static pool_shard pool_shards[POOL_SHARDS];
+
+// 64-bit FNV-1a of the type and the string, also finding the string's length
+static unsigned long long poolhash(const char *s, char type, size_t *len) {
+	unsigned long long h = 14695981039346656037ULL;
+
+	h ^= (unsigned char) type;
+	h *= 1099511628211ULL;
+
+	const char *cp;
+	for (cp = s; *cp != '\0'; cp++) {
+		h ^= (unsigned char) *cp;
+		h *= 1099511628211ULL;
 	}
 
-	long long hash1 = 0, hash2 = 0;
-	for (ssize_t i = alen - 1; i >= 0; i--) {
-		hash1 = (hash1 * 37 + a[i]) & INT_MAX;
-	}
-	for (ssize_t i = blen - 1; i >= 0; i--) {
-		hash2 = (hash2 * 37 + b[i]) & INT_MAX;
-	}
-
-	int h1 = hash1, h2 = hash2;
-	if (h1 == h2) {
-		return strcmp(a, b);
-	}
+	*len = cp - s;
+	return h;
+}
 
-	return h1 - h2;
+static struct stringpool_index *index_header(struct memfile *treefile, pool_shard *shard) {
+	return (struct stringpool_index *) (treefile->map + shard->index);
 }
 
-long long addpool(struct memfile *poolfile, struct memfile *treefile, const char *s, char type) {
-	unsigned long *sp = &treefile->tree;
-	size_t depth = 0;
+static struct stringpool *index_slots(struct memfile *treefile, pool_shard *shard) {
+	return (struct stringpool *) (treefile->map + shard->index + sizeof(struct stringpool_index));
+}
 
-	// In typical data, traversal depth generally stays under 2.5x
-	size_t max = 3 * log(treefile->off / sizeof(struct stringpool)) / log(2);
-	if (max < 30) {
-		max = 30;
+// Append a new, empty index with the given number of slots to the tree file,
+// and move the entries of the shard's old one (if any) into it. The old index
+// is left behind as garbage, so the file is at most twice the size of the index.
+// Called with the shard locked.
+static void grow_index(struct memfile *treefile, pool_shard *shard, unsigned long long capacity) {
+	long long where = memfile_reserve(treefile, sizeof(struct stringpool_index) + capacity * sizeof(struct stringpool));
+	if (where < 0) {
+		perror("memfile write");
+		exit(EXIT_FAILURE);
 	}
 
-	while (*sp != 0) {
-		int cmp = swizzlecmp(s, poolfile->map + ((struct stringpool *) (treefile->map + *sp))->off + 1);
+	unsigned long long old = shard->index;
+	shard->index = where;
 
-		if (cmp == 0) {
-			cmp = type - (poolfile->map + ((struct stringpool *) (treefile->map + *sp))->off)[0];
-		}
-
-		if (cmp < 0) {
-			sp = &(((struct stringpool *) (treefile->map + *sp))->left);
-		} else if (cmp > 0) {
-			sp = &(((struct stringpool *) (treefile->map + *sp))->right);
-		} else {
-			return ((struct stringpool *) (treefile->map + *sp))->off;
-		}
-
-		depth++;
-		if (depth > max) {
-			// Search is very deep, so string is probably unique.
-			// Add it to the pool without adding it to the search tree.
+	struct stringpool_index *header = index_header(treefile, shard);
+	struct stringpool *slots = index_slots(treefile, shard);
+	header->capacity = capacity;
+	header->count = 0;
+	for (unsigned long long i = 0; i < capacity; i++) {
+		slots[i] = stringpool();
+	}
 
-			long long off = poolfile->off;
-			if (memfile_write(poolfile, &type, 1) < 0) {
-				perror("memfile write");
-				exit(EXIT_FAILURE);
+	if (old != 0) {
+		struct stringpool_index *oldheader = (struct stringpool_index *) (treefile->map + old);
+		struct stringpool *oldslots = (struct stringpool *) (treefile->map + old + sizeof(struct stringpool_index));
+
+		for (unsigned long long i = 0; i < oldheader->capacity; i++) {
+			if (oldslots[i].off != 0) {
+				unsigned long long h = oldslots[i].hash & (capacity - 1);
+				while (slots[h].off != 0) {
+					h = (h + 1) & (capacity - 1);
+				}
+				slots[h] = oldslots[i];
 			}
-			if (memfile_write(poolfile, (void *) s, strlen(s) + 1) < 0) {
-				perror("memfile write");
-				exit(EXIT_FAILURE);
-			}
-			return off;
 		}
+
+		header->count = oldheader->count;
 	}
+}
 
-	// *sp is probably in the memory-mapped file, and will move if the file grows.
-	long long ssp;
-	if (sp == &treefile->tree) {
-		ssp = -1;
-	} else {
-		ssp = ((char *) sp) - treefile->map;
+// Called with the shard locked.
+static long long addpool_locked(struct memfile *poolfile, struct memfile *treefile, pool_shard *shard, const char *s, char type, size_t len, unsigned hash) {
+	if (shard->index == 0) {
+		grow_index(treefile, shard, INITIAL_CAPACITY);
 	}
 
-	long long off = poolfile->off;
-	if (memfile_write(poolfile, &type, 1) < 0) {
-		perror("memfile write");
-		exit(EXIT_FAILURE);
+	// Strings too long for the index are pooled but never shared
+	bool indexed = len < UINT_MAX;
+
+	if (indexed) {
+		struct stringpool_index *header = index_header(treefile, shard);
+		struct stringpool *slots = index_slots(treefile, shard);
+		unsigned long long mask = header->capacity - 1;
+
+		for (unsigned long long h = hash & mask; slots[h].off != 0; h = (h + 1) & mask) {
+			if (slots[h].hash == hash && slots[h].len == len) {
+				const char *pooled = poolfile->map + slots[h].off - 1;
+
+				if (pooled[0] == type && memcmp(pooled + 1, s, len) == 0) {
+					return slots[h].off - 1;
+				}
+			}
+		}
 	}
-	if (memfile_write(poolfile, (void *) s, strlen(s) + 1) < 0) {
+
+	long long off = memfile_reserve(poolfile, len + 2);
+	if (off < 0) {
 		perror("memfile write");
 		exit(EXIT_FAILURE);
 	}
+	char *pooled = poolfile->map + off;
+	pooled[0] = type;
+	memcpy(pooled + 1, s, len + 1);
+
+	if (indexed) {
+		// Keep the index at most half full so that probe sequences stay short
+		if ((index_header(treefile, shard)->count + 1) * 2 > index_header(treefile, shard)->capacity) {
+			grow_index(treefile, shard, index_header(treefile, shard)->capacity * 2);
+		}
 
-	if (off >= LONG_MAX || treefile->off >= LONG_MAX) {
-		// Tree or pool is bigger than 2GB
-		static bool warned = false;
-		if (!warned) {
-			fprintf(stderr, "Warning: string pool is very large.\n");
-			warned = true;
+		struct stringpool_index *header = index_header(treefile, shard);
+		struct stringpool *slots = index_slots(treefile, shard);
+		unsigned long long mask = header->capacity - 1;
+
+		unsigned long long h = hash & mask;
+		while (slots[h].off != 0) {
+			h = (h + 1) & mask;
 		}
-		return off;
+
+		slots[h].off = off + 1;
+		slots[h].hash = hash;
+		slots[h].len = len;
+		header->count++;
 	}
 
-	struct stringpool tsp;
-	tsp.left = 0;
-	tsp.right = 0;
-	tsp.off = off;
+	return off;
+}
 
-	long long p = treefile->off;
-	if (memfile_write(treefile, &tsp, sizeof(struct stringpool)) < 0) {
-		perror("memfile write");
+long long addpool(struct memfile *poolfile, struct memfile *treefile, const char *s, char type) {
+	size_t len;
+	unsigned long long fullhash = poolhash(s, type, &len);
+	unsigned hash = fullhash ^ (fullhash >> 32);
+
+	// The top bits choose the shard, so that the slots within it
+	// are still chosen by bits that vary from string to string
+	pool_shard *shard = &pool_shards[fullhash >> (64 - POOL_SHARD_BITS)];
+
+	if (pthread_mutex_lock(&shard->lock) != 0) {
+		perror("pthread_mutex_lock");
 		exit(EXIT_FAILURE);
 	}
 
-	if (ssp == -1) {
-		treefile->tree = p;
-	} else {
-		*((long long *) (treefile->map + ssp)) = p;
+	long long off = addpool_locked(poolfile, treefile, shard, s, type, len, hash);
+
+	if (pthread_mutex_unlock(&shard->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
 	}
+
 	return off;
 }
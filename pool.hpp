@@ -1,10 +1,19 @@
 #ifndef POOL_HPP
 #define POOL_HPP
 
+// One slot of the open-addressing hash index over the string pool.
+// The hash and length are kept in the slot so that most probes
+// never have to look at the pooled string itself.
 struct stringpool {
-	unsigned long left = 0;
-	unsigned long right = 0;
-	unsigned long off = 0;
+	unsigned long long off = 0;  // offset in the pool plus 1, or 0 if the slot is empty
+	unsigned hash = 0;
+	unsigned len = 0;
+};
+
+// Precedes the slots of the index in the tree file
+struct stringpool_index {
+	unsigned long long capacity = 0;  // always a power of 2
+	unsigned long long count = 0;
 };
 
 long long addpool(struct memfile *poolfile, struct memfile *treefile, const char *s, char type);
@@ -41,7 +41,105 @@ void json_context(json_object *j) {
 	free(s);  // stringify
 }
 
+// Skip over one array or number within the shape of a JSON_COORDINATES object,
+// and over the values of any numbers within it
+static void skip_packed(const char *&cp, const double *&number) {
+	size_t depth = 0;
+
+	do {
+		if (*cp == '[') {
+			depth++;
+		} else if (*cp == ']') {
+			depth--;
+		} else {
+			number++;
+		}
+		cp++;
+	} while (depth > 0);
+}
+
+// The same as parse_geometry() below, but walking the shape and numbers of
+// a JSON_COORDINATES object instead of a tree of arrays and numbers
+static void parse_packed_geometry(int t, json_object *j, const char *&cp, const double *&number, drawvec &out, int op, const char *fname, int line, json_object *feature) {
+	if (*cp != '[') {
+		fprintf(stderr, "%s:%d: expected array for type %d\n", fname, line, t);
+		json_context(feature);
+		skip_packed(cp, number);
+		return;
+	}
+	cp++;
+
+	int within = geometry_within[t];
+	if (within >= 0) {
+		for (size_t i = 0; *cp != ']'; i++) {
+			if (within == GEOM_POINT) {
+				if (i == 0 || mb_geometry[t] == VT_POINT) {
+					op = VT_MOVETO;
+				} else {
+					op = VT_LINETO;
+				}
+			}
+
+			parse_packed_geometry(within, j, cp, number, out, op, fname, line, feature);
+		}
+		cp++;
+	} else {
+		size_t dimensions = 0;
+		bool numeric = true;
+		double lonlat[2];
+
+		while (*cp != ']') {
+			if (dimensions < 2) {
+				if (*cp == '[') {
+					numeric = false;
+				} else {
+					lonlat[dimensions] = *number;
+				}
+			}
+
+			skip_packed(cp, number);
+			dimensions++;
+		}
+		cp++;
+
+		if (dimensions >= 2 && numeric) {
+			long long x, y;
+			projection->project(lonlat[0], lonlat[1], 32, &x, &y);
+
+			if (dimensions > 2) {
+				static int warned = 0;
+
+				if (!warned) {
+					fprintf(stderr, "%s:%d: ignoring dimensions beyond two\n", fname, line);
+					json_context(j);
+					json_context(feature);
+					warned = 1;
+				}
+			}
+
+			out.push_back(draw(op, x, y));
+		} else {
+			fprintf(stderr, "%s:%d: malformed point\n", fname, line);
+			json_context(j);
+			json_context(feature);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (t == GEOM_POLYGON) {
+		// See the note in parse_geometry() below
+		out.push_back(draw(VT_CLOSEPATH, 0, 0));
+	}
+}
+
 void parse_geometry(int t, json_object *j, drawvec &out, int op, const char *fname, int line, json_object *feature) {
+	if (j != NULL && j->type == JSON_COORDINATES) {
+		const char *cp = j->string;
+		const double *number = j->numbers;
+		parse_packed_geometry(t, j, cp, number, out, op, fname, line, feature);
+		return;
+	}
+
 	if (j == NULL || j->type != JSON_ARRAY) {
 		fprintf(stderr, "%s:%d: expected array for type %d\n", fname, line, t);
 		json_context(feature);
@@ -116,8 +214,7 @@ void canonicalize(json_object *o) {
 		} else {
 			s = milo::dtoa_milo(o->number);
 		}
-		free(o->string);
-		o->string = strdup(s.c_str());
+		json_set_string(o, s.c_str());
 	} else if (o->type == JSON_HASH) {
 		for (size_t i = 0; i < o->length; i++) {
 			canonicalize(o->values[i]);
@@ -77,6 +77,52 @@ void serialize_uint(FILE *out, unsigned n, std::atomic<long long> *fpos, const c
 	*fpos += sizeof(unsigned);
 }
 
+void serialize_int(std::string &out, int n) {
+	serialize_long_long(out, n);
+}
+
+void serialize_long_long(std::string &out, long long n) {
+	serialize_ulong_long(out, protozero::encode_zigzag64(n));
+}
+
+void serialize_ulong_long(std::string &out, unsigned long long zigzag) {
+	char buf[10];
+	size_t n = 0;
+
+	while (zigzag >= 0x80) {
+		buf[n++] = (zigzag & 0x7F) | 0x80;
+		zigzag >>= 7;
+	}
+	buf[n++] = zigzag;
+
+	out.append(buf, n);
+}
+
+void serialize_byte(std::string &out, signed char n) {
+	out.push_back(n);
+}
+
+void serialize_uint(std::string &out, unsigned n) {
+	out.append((char *) &n, sizeof(unsigned));
+}
+
+void shard_flush(shard_writer *w, const char *fname) {
+	if (w->buf.size() > 0) {
+		fwrite_check(w->buf.data(), sizeof(char), w->buf.size(), w->fp, fname);
+		w->pos += w->buf.size();
+		w->buf.clear();
+	}
+}
+
+void shard_close(shard_writer *w, const char *fname) {
+	shard_flush(w, fname);
+	if (fclose(w->fp) != 0) {
+		perror("close subfile");
+		exit(EXIT_FAILURE);
+	}
+	w->fp = NULL;
+}
+
 void deserialize_int(char **f, int *n) {
 	long long ll;
 	deserialize_long_long(f, &ll);
@@ -90,21 +136,19 @@ void deserialize_long_long(char **f, long long *n) {
 }
 
 void deserialize_ulong_long(char **f, unsigned long long *zigzag) {
-	*zigzag = 0;
+	const unsigned char *p = (const unsigned char *) *f;
+	unsigned long long n = 0;
 	int shift = 0;
 
-	while (1) {
-		if ((**f & 0x80) == 0) {
-			*zigzag |= ((unsigned long long) **f) << shift;
-			*f += 1;
-			shift += 7;
-			break;
-		} else {
-			*zigzag |= ((unsigned long long) (**f & 0x7F)) << shift;
-			*f += 1;
-			shift += 7;
-		}
+	while (*p & 0x80) {
+		n |= ((unsigned long long) (*p & 0x7F)) << shift;
+		shift += 7;
+		p++;
 	}
+	n |= ((unsigned long long) *p) << shift;
+
+	*zigzag = n;
+	*f = (char *) (p + 1);
 }
 
 void deserialize_uint(char **f, unsigned *n) {
@@ -117,79 +161,23 @@ void deserialize_byte(char **f, signed char *n) {
 	*f += sizeof(signed char);
 }
 
-int deserialize_long_long_io(FILE *f, long long *n, std::atomic<long long> *geompos) {
-	unsigned long long zigzag = 0;
-	int ret = deserialize_ulong_long_io(f, &zigzag, geompos);
-	*n = protozero::decode_zigzag64(zigzag);
-	return ret;
-}
-
-int deserialize_ulong_long_io(FILE *f, unsigned long long *zigzag, std::atomic<long long> *geompos) {
-	*zigzag = 0;
-	int shift = 0;
-
-	while (1) {
-		int c = getc(f);
-		if (c == EOF) {
-			return 0;
-		}
-		(*geompos)++;
-
-		if ((c & 0x80) == 0) {
-			*zigzag |= ((unsigned long long) c) << shift;
-			shift += 7;
-			break;
-		} else {
-			*zigzag |= ((unsigned long long) (c & 0x7F)) << shift;
-			shift += 7;
-		}
-	}
-
-	return 1;
-}
-
-int deserialize_int_io(FILE *f, int *n, std::atomic<long long> *geompos) {
-	long long ll = 0;
-	int ret = deserialize_long_long_io(f, &ll, geompos);
-	*n = ll;
-	return ret;
-}
-
-int deserialize_uint_io(FILE *f, unsigned *n, std::atomic<long long> *geompos) {
-	if (fread(n, sizeof(unsigned), 1, f) != 1) {
-		return 0;
-	}
-	*geompos += sizeof(unsigned);
-	return 1;
-}
-
-int deserialize_byte_io(FILE *f, signed char *n, std::atomic<long long> *geompos) {
-	int c = getc(f);
-	if (c == EOF) {
-		return 0;
-	}
-	*n = c;
-	(*geompos)++;
-	return 1;
-}
-
-static void write_geometry(drawvec const &dv, std::atomic<long long> *fpos, FILE *out, const char *fname, long long wx, long long wy) {
+static void write_geometry(drawvec const &dv, std::string &out, long long wx, long long wy) {
 	for (size_t i = 0; i < dv.size(); i++) {
 		if (dv[i].op == VT_MOVETO || dv[i].op == VT_LINETO) {
-			serialize_byte(out, dv[i].op, fpos, fname);
-			serialize_long_long(out, dv[i].x - wx, fpos, fname);
-			serialize_long_long(out, dv[i].y - wy, fpos, fname);
+			serialize_byte(out, dv[i].op);
+			serialize_long_long(out, dv[i].x - wx);
+			serialize_long_long(out, dv[i].y - wy);
 			wx = dv[i].x;
 			wy = dv[i].y;
 		} else {
-			serialize_byte(out, dv[i].op, fpos, fname);
+			serialize_byte(out, dv[i].op);
 		}
 	}
 }
 
 // called from generating the next zoom level
-void serialize_feature(FILE *geomfile, serial_feature *sf, std::atomic<long long> *geompos, const char *fname, long long wx, long long wy, bool include_minzoom) {
-	serialize_byte(geomfile, sf->t, geompos, fname);
+void serialize_feature(std::string &out, serial_feature *sf, long long wx, long long wy, bool include_minzoom) {
+	serialize_byte(out, sf->t);
 
 	long long layer = 0;
 	layer |= sf->layer << 6;
@@ -200,60 +188,73 @@ void serialize_feature(FILE *geomfile, serial_feature *sf, std::atomic<long long
 	layer |= sf->has_tippecanoe_minzoom << 1;
 	layer |= sf->has_tippecanoe_maxzoom << 0;
 
-	serialize_long_long(geomfile, layer, geompos, fname);
+	serialize_long_long(out, layer);
 	if (sf->seq != 0) {
-		serialize_long_long(geomfile, sf->seq, geompos, fname);
+		serialize_long_long(out, sf->seq);
 	}
 	if (sf->has_tippecanoe_minzoom) {
-		serialize_int(geomfile, sf->tippecanoe_minzoom, geompos, fname);
+		serialize_int(out, sf->tippecanoe_minzoom);
 	}
 	if (sf->has_tippecanoe_maxzoom) {
-		serialize_int(geomfile, sf->tippecanoe_maxzoom, geompos, fname);
+		serialize_int(out, sf->tippecanoe_maxzoom);
 	}
 	if (sf->has_id) {
-		serialize_ulong_long(geomfile, sf->id, geompos, fname);
+		serialize_ulong_long(out, sf->id);
 	}
 
-	serialize_int(geomfile, sf->segment, geompos, fname);
+	serialize_int(out, sf->segment);
 
-	write_geometry(sf->geometry, geompos, geomfile, fname, wx, wy);
-	serialize_byte(geomfile, VT_END, geompos, fname);
+	write_geometry(sf->geometry, out, wx, wy);
+	serialize_byte(out, VT_END);
 	if (sf->index != 0) {
-		serialize_ulong_long(geomfile, sf->index, geompos, fname);
+		serialize_ulong_long(out, sf->index);
 	}
 	if (sf->extent != 0) {
-		serialize_long_long(geomfile, sf->extent, geompos, fname);
+		serialize_long_long(out, sf->extent);
 	}
 
-	serialize_long_long(geomfile, sf->metapos, geompos, fname);
+	serialize_long_long(out, sf->metapos);
 
 	if (sf->metapos < 0) {
-		serialize_long_long(geomfile, sf->keys.size(), geompos, fname);
+		serialize_long_long(out, sf->keys.size());
 
 		for (size_t i = 0; i < sf->keys.size(); i++) {
-			serialize_long_long(geomfile, sf->keys[i], geompos, fname);
-			serialize_long_long(geomfile, sf->values[i], geompos, fname);
+			serialize_long_long(out, sf->keys[i]);
+			serialize_long_long(out, sf->values[i]);
 		}
 	}
 
 	if (include_minzoom) {
-		serialize_byte(geomfile, sf->feature_minzoom, geompos, fname);
+		serialize_byte(out, sf->feature_minzoom);
 	}
 }
 
-serial_feature deserialize_feature(FILE *geoms, std::atomic<long long> *geompos_in, char *metabase, long long *meta_off, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y) {
+// called from reading the input
+void serialize_feature(FILE *geomfile, serial_feature *sf, std::atomic<long long> *geompos, const char *fname, long long wx, long long wy, bool include_minzoom) {
+	std::string out;
+	serialize_feature(out, sf, wx, wy, include_minzoom);
+
+	fwrite_check(out.data(), sizeof(char), out.size(), geomfile, fname);
+	*geompos += out.size();
+}
+
+// Decode one feature from the mapped shard at geombase + *geompos_in,
+// advancing *geompos_in past it.
+serial_feature deserialize_feature(char *geombase, long long *geompos_in, char *metabase, long long *meta_off, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y) {
 	serial_feature sf;
+	char *geoms = geombase + *geompos_in;
 
-	deserialize_byte_io(geoms, &sf.t, geompos_in);
+	deserialize_byte(&geoms, &sf.t);
 	if (sf.t < 0) {
+		*geompos_in = geoms - geombase;
 		return sf;
 	}
 
-	deserialize_long_long_io(geoms, &sf.layer, geompos_in);
+	deserialize_long_long(&geoms, &sf.layer);
 
 	sf.seq = 0;
 	if (sf.layer & (1 << 5)) {
-		deserialize_long_long_io(geoms, &sf.seq, geompos_in);
+		deserialize_long_long(&geoms, &sf.seq);
 	}
 
 	sf.tippecanoe_minzoom = -1;
@@ -261,33 +262,33 @@ serial_feature deserialize_feature(FILE *geoms, std::atomic<long long> *geompos_
 	sf.id = 0;
 	sf.has_id = false;
 	if (sf.layer & (1 << 1)) {
-		deserialize_int_io(geoms, &sf.tippecanoe_minzoom, geompos_in);
+		deserialize_int(&geoms, &sf.tippecanoe_minzoom);
 	}
 	if (sf.layer & (1 << 0)) {
-		deserialize_int_io(geoms, &sf.tippecanoe_maxzoom, geompos_in);
+		deserialize_int(&geoms, &sf.tippecanoe_maxzoom);
 	}
 	if (sf.layer & (1 << 2)) {
 		sf.has_id = true;
-		deserialize_ulong_long_io(geoms, &sf.id, geompos_in);
+		deserialize_ulong_long(&geoms, &sf.id);
 	}
 
-	deserialize_int_io(geoms, &sf.segment, geompos_in);
+	deserialize_int(&geoms, &sf.segment);
 
 	sf.index = 0;
 	sf.extent = 0;
 
-	sf.geometry = decode_geometry(geoms, geompos_in, z, tx, ty, sf.bbox, initial_x[sf.segment], initial_y[sf.segment]);
+	sf.geometry = decode_geometry(&geoms, z, tx, ty, sf.bbox, initial_x[sf.segment], initial_y[sf.segment]);
 	if (sf.layer & (1 << 4)) {
-		deserialize_ulong_long_io(geoms, &sf.index, geompos_in);
+		deserialize_ulong_long(&geoms, &sf.index);
 	}
 	if (sf.layer & (1 << 3)) {
-		deserialize_long_long_io(geoms, &sf.extent, geompos_in);
+		deserialize_long_long(&geoms, &sf.extent);
 	}
 
 	sf.layer >>= 6;
 
 	sf.metapos = 0;
-	deserialize_long_long_io(geoms, &sf.metapos, geompos_in);
+	deserialize_long_long(&geoms, &sf.metapos);
 
 	if (sf.metapos >= 0) {
 		char *meta = metabase + sf.metapos + meta_off[sf.segment];
@@ -303,19 +304,20 @@ serial_feature deserialize_feature(FILE *geoms, std::atomic<long long> *geompos_
 		}
 	} else {
 		long long count;
-		deserialize_long_long_io(geoms, &count, geompos_in);
+		deserialize_long_long(&geoms, &count);
 
 		for (long long i = 0; i < count; i++) {
 			long long k, v;
-			deserialize_long_long_io(geoms, &k, geompos_in);
-			deserialize_long_long_io(geoms, &v, geompos_in);
+			deserialize_long_long(&geoms, &k);
+			deserialize_long_long(&geoms, &v);
 			sf.keys.push_back(k);
 			sf.values.push_back(v);
 		}
 	}
 
-	deserialize_byte_io(geoms, &sf.feature_minzoom, geompos_in);
+	deserialize_byte(&geoms, &sf.feature_minzoom);
 
+	*geompos_in = geoms - geombase;
 	return sf;
 }
 
@@ -419,8 +421,8 @@ int serialize_feature(struct serialization_state *sst, serial_feature &sf) {
 		if (sf.t == VT_POLYGON) {
 			sf.geometry = simple_clip_poly(sf.geometry, SHIFT_RIGHT(c.minx), SHIFT_RIGHT(c.miny), SHIFT_RIGHT(c.maxx), SHIFT_RIGHT(c.maxy));
 		} else if (sf.t == VT_LINE) {
-			sf.geometry = clip_lines(sf.geometry, SHIFT_RIGHT(c.minx), SHIFT_RIGHT(c.miny), SHIFT_RIGHT(c.maxx), SHIFT_RIGHT(c.maxy));
-			sf.geometry = remove_noop(sf.geometry, sf.t, 0);
+			clip_lines_in_place(sf.geometry, SHIFT_RIGHT(c.minx), SHIFT_RIGHT(c.miny), SHIFT_RIGHT(c.maxx), SHIFT_RIGHT(c.maxy));
+			remove_noop_in_place(sf.geometry, sf.t, 0);
 		} else if (sf.t == VT_POINT) {
 			sf.geometry = clip_point(sf.geometry, SHIFT_RIGHT(c.minx), SHIFT_RIGHT(c.miny), SHIFT_RIGHT(c.maxx), SHIFT_RIGHT(c.maxy));
 		}
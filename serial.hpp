@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <string>
 #include <vector>
 #include <atomic>
 #include <sys/stat.h>
@@ -20,18 +21,18 @@ void serialize_byte(FILE *out, signed char n, std::atomic<long long> *fpos, cons
 void serialize_uint(FILE *out, unsigned n, std::atomic<long long> *fpos, const char *fname);
 void serialize_string(FILE *out, const char *s, std::atomic<long long> *fpos, const char *fname);
 
+void serialize_int(std::string &out, int n);
+void serialize_long_long(std::string &out, long long n);
+void serialize_ulong_long(std::string &out, unsigned long long n);
+void serialize_byte(std::string &out, signed char n);
+void serialize_uint(std::string &out, unsigned n);
+
 void deserialize_int(char **f, int *n);
 void deserialize_long_long(char **f, long long *n);
 void deserialize_ulong_long(char **f, unsigned long long *n);
 void deserialize_uint(char **f, unsigned *n);
 void deserialize_byte(char **f, signed char *n);
 
-int deserialize_int_io(FILE *f, int *n, std::atomic<long long> *geompos);
-int deserialize_long_long_io(FILE *f, long long *n, std::atomic<long long> *geompos);
-int deserialize_ulong_long_io(FILE *f, unsigned long long *n, std::atomic<long long> *geompos);
-int deserialize_uint_io(FILE *f, unsigned *n, std::atomic<long long> *geompos);
-int deserialize_byte_io(FILE *f, signed char *n, std::atomic<long long> *geompos);
-
 struct serial_val {
 	int type = 0;
 	std::string s = "";
@@ -71,8 +72,27 @@ struct serial_feature {
 	bool dropped = false;
 };
 
+// One child shard being written during tiling. Features are encoded
+// into buf and only reach the file in large blocks; pos counts the bytes
+// that have already been flushed.
+struct shard_writer {
+	FILE *fp = NULL;
+	std::string buf;
+	long long pos = 0;
+
+	long long offset() const {
+		return pos + buf.size();
+	}
+};
+
+#define SHARD_BUFFER (256 * 1024)
+
+void shard_flush(shard_writer *w, const char *fname);
+void shard_close(shard_writer *w, const char *fname);
+
+void serialize_feature(std::string &out, serial_feature *sf, long long wx, long long wy, bool include_minzoom);
 void serialize_feature(FILE *geomfile, serial_feature *sf, std::atomic<long long> *geompos, const char *fname, long long wx, long long wy, bool include_minzoom);
-serial_feature deserialize_feature(FILE *geoms, std::atomic<long long> *geompos_in, char *metabase, long long *meta_off, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y);
+serial_feature deserialize_feature(char *geombase, long long *geompos_in, char *metabase, long long *meta_off, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y);
 
 struct reader {
 	int metafd = -1;
@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "sort.hpp"
+
+int indexcmp(const void *v1, const void *v2) {
+	const struct index *i1 = (const struct index *) v1;
+	const struct index *i2 = (const struct index *) v2;
+
+	if (i1->ix < i2->ix) {
+		return -1;
+	} else if (i1->ix > i2->ix) {
+		return 1;
+	}
+
+	if (i1->seq < i2->seq) {
+		return -1;
+	} else if (i1->seq > i2->seq) {
+		return 1;
+	}
+
+	return 0;
+}
+
+#define SEQ_BYTES 6  // seq is a 46-bit field
+#define IX_BYTES 8
+#define KEY_BYTES (SEQ_BYTES + IX_BYTES)
+
+// Byte b of the sort key, counting from the least significant byte of seq
+static inline size_t key_byte(struct index const &ix, int b) {
+	if (b < SEQ_BYTES) {
+		return ((unsigned long long) ix.seq >> (8 * b)) & 0xFF;
+	} else {
+		return (ix.ix >> (8 * (b - SEQ_BYTES))) & 0xFF;
+	}
+}
+
+// Sort index records by ix and then seq, the same order as indexcmp.
+// This is an LSD radix sort, one byte per pass, so it is stable.
+// Passes where every record has the same byte are skipped, and so are
+// the passes over seq if the records are already in seq order, which
+// they usually are because each reader numbers its features in order.
+// It needs scratch space the size of the array, as glibc's qsort()
+// would also allocate; if that isn't available it falls back to qsort().
+void sort_index(struct index *ix, size_t n) {
+	if (n < 2) {
+		return;
+	}
+
+	struct index *scratch = (struct index *) malloc(n * sizeof(struct index));
+	if (scratch == NULL) {
+		qsort(ix, n, sizeof(struct index), indexcmp);
+		return;
+	}
+
+	// Count every byte position in one pass over the records
+	std::vector<size_t> counts(KEY_BYTES * 256, 0);
+	bool seq_ordered = true;
+	for (size_t i = 0; i < n; i++) {
+		unsigned long long seq = ix[i].seq;
+		unsigned long long key = ix[i].ix;
+
+		for (int b = 0; b < SEQ_BYTES; b++) {
+			counts[b * 256 + ((seq >> (8 * b)) & 0xFF)]++;
+		}
+		for (int b = 0; b < IX_BYTES; b++) {
+			counts[(SEQ_BYTES + b) * 256 + ((key >> (8 * b)) & 0xFF)]++;
+		}
+
+		if (i > 0 && seq < ix[i - 1].seq) {
+			seq_ordered = false;
+		}
+	}
+
+	struct index *from = ix;
+	struct index *to = scratch;
+
+	for (int b = seq_ordered ? SEQ_BYTES : 0; b < KEY_BYTES; b++) {
+		size_t *count = &counts[b * 256];
+		if (count[key_byte(from[0], b)] == n) {
+			continue;
+		}
+
+		size_t offset[256];
+		size_t sum = 0;
+		for (size_t i = 0; i < 256; i++) {
+			offset[i] = sum;
+			sum += count[i];
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			to[offset[key_byte(from[i], b)]++] = from[i];
+		}
+
+		std::swap(from, to);
+	}
+
+	if (from != ix) {
+		memcpy(ix, from, n * sizeof(struct index));
+	}
+
+	free(scratch);
+}
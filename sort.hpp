@@ -0,0 +1,11 @@
+#ifndef SORT_HPP
+#define SORT_HPP
+
+#include <stddef.h>
+#include <vector>
+#include "main.hpp"
+
+int indexcmp(const void *v1, const void *v2);
+void sort_index(struct index *ix, size_t n);
+
+#endif
@@ -169,3 +169,47 @@ std::string format_commandline(int argc, char **argv) {
 
 	return out;
 }
+
+// Parse a number from a command-line option or environment variable,
+// exiting with a message naming the program if it isn't entirely a number
+int atoi_require(const char *program, const char *s, const char *what) {
+	char *err = NULL;
+	if (*s == '\0') {
+		fprintf(stderr, "%s: %s must be a number (got %s)\n", program, what, s);
+		exit(EXIT_FAILURE);
+	}
+	int ret = strtol(s, &err, 10);
+	if (*err != '\0') {
+		fprintf(stderr, "%s: %s must be a number (got %s)\n", program, what, s);
+		exit(EXIT_FAILURE);
+	}
+	return ret;
+}
+
+double atof_require(const char *program, const char *s, const char *what) {
+	char *err = NULL;
+	if (*s == '\0') {
+		fprintf(stderr, "%s: %s must be a number (got %s)\n", program, what, s);
+		exit(EXIT_FAILURE);
+	}
+	double ret = strtod(s, &err);
+	if (*err != '\0') {
+		fprintf(stderr, "%s: %s must be a number (got %s)\n", program, what, s);
+		exit(EXIT_FAILURE);
+	}
+	return ret;
+}
+
+long long atoll_require(const char *program, const char *s, const char *what) {
+	char *err = NULL;
+	if (*s == '\0') {
+		fprintf(stderr, "%s: %s must be a number (got %s)\n", program, what, s);
+		exit(EXIT_FAILURE);
+	}
+	long long ret = strtoll(s, &err, 10);
+	if (*err != '\0') {
+		fprintf(stderr, "%s: %s must be a number (got %s)\n", program, what, s);
+		exit(EXIT_FAILURE);
+	}
+	return ret;
+}
@@ -8,5 +8,8 @@ const char *utf8_next(const char *s, long *c);
 std::string truncate16(std::string const &s, size_t runes);
 int integer_zoom(std::string where, std::string text);
 std::string format_commandline(int argc, char **argv);
+int atoi_require(const char *program, const char *s, const char *what);
+double atof_require(const char *program, const char *s, const char *what);
+long long atoll_require(const char *program, const char *s, const char *what);
 
 #endif
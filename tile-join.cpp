@@ -41,6 +41,8 @@ int pk = false;
 int pC = false;
 int pg = false;
 int pe = false;
+int deduplicate_tiles = false;
+int tile_compression_level = 9;
 size_t CPUS;
 int quiet = false;
 int maxzoom = 32;
@@ -509,7 +511,7 @@ void *join_worker(void *v) {
 			std::string compressed;
 
 			if (!pC) {
-				compress(pbf, compressed);
+				compress(pbf, compressed, tile_compression_level);
 			} else {
 				compressed = pbf;
 			}
@@ -525,7 +527,7 @@ void *join_worker(void *v) {
 	return NULL;
 }
 
-void handle_tasks(std::map<zxy, std::vector<std::string>> &tasks, std::vector<std::map<std::string, layermap_entry>> &layermaps, sqlite3 *outdb, const char *outdir, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, int ifmatched, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, json_object *filter) {
+void handle_tasks(std::map<zxy, std::vector<std::string>> &tasks, std::vector<std::map<std::string, layermap_entry>> &layermaps, mbtiles_writer *writer, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, int ifmatched, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, json_object *filter) {
 	pthread_t pthreads[CPUS];
 	std::vector<arg> args;
 
@@ -572,11 +574,7 @@ void handle_tasks(std::map<zxy, std::vector<std::string>> &tasks, std::vector<st
 		}
 
 		for (auto ai = args[i].outputs.begin(); ai != args[i].outputs.end(); ++ai) {
-			if (outdb != NULL) {
-				mbtiles_write_tile(outdb, ai->first.z, ai->first.x, ai->first.y, ai->second.data(), ai->second.size());
-			} else if (outdir != NULL) {
-				dir_write_tile(outdir, ai->first.z, ai->first.x, ai->first.y, ai->second);
-			}
+			mbtiles_writer_write(writer, ai->first.z, ai->first.x, ai->first.y, std::move(ai->second));
 		}
 	}
 }
@@ -620,7 +618,7 @@ void handle_vector_layers(json_object *vector_layers, std::map<std::string, laye
 	}
 }
 
-void decode(struct reader *readers, std::map<std::string, layermap_entry> &layermap, sqlite3 *outdb, const char *outdir, struct stats *st, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, int ifmatched, std::string &attribution, std::string &description, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, std::string &name, json_object *filter, std::map<std::string, std::string> &attribute_descriptions, std::string &generator_options) {
+void decode(struct reader *readers, std::map<std::string, layermap_entry> &layermap, mbtiles_writer *writer, struct stats *st, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, int ifmatched, std::string &attribution, std::string &description, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, std::string &name, json_object *filter, std::map<std::string, std::string> &attribute_descriptions, std::string &generator_options) {
 	std::vector<std::map<std::string, layermap_entry>> layermaps;
 	for (size_t i = 0; i < CPUS; i++) {
 		layermaps.push_back(std::map<std::string, layermap_entry>());
@@ -665,7 +663,7 @@ void decode(struct reader *readers, std::map<std::string, layermap_entry> &layer
 
 		if (readers == NULL || readers->zoom != r->zoom || readers->x != r->x || readers->y != r->y) {
 			if (tasks.size() > 100 * CPUS) {
-				handle_tasks(tasks, layermaps, outdb, outdir, header, mapping, exclude, ifmatched, keep_layers, remove_layers, filter);
+				handle_tasks(tasks, layermaps, writer, header, mapping, exclude, ifmatched, keep_layers, remove_layers, filter);
 				tasks.clear();
 			}
 		}
@@ -714,7 +712,7 @@ void decode(struct reader *readers, std::map<std::string, layermap_entry> &layer
 	st->minlat = min(minlat, st->minlat);
 	st->maxlat = max(maxlat, st->maxlat);
 
-	handle_tasks(tasks, layermaps, outdb, outdir, header, mapping, exclude, ifmatched, keep_layers, remove_layers, filter);
+	handle_tasks(tasks, layermaps, writer, header, mapping, exclude, ifmatched, keep_layers, remove_layers, filter);
 	layermap = merge_layermaps(layermaps);
 
 	struct reader *next;
@@ -887,6 +885,7 @@ int main(int argc, char **argv) {
 		{"output", required_argument, 0, 'o'},
 		{"output-to-directory", required_argument, 0, 'e'},
 		{"force", no_argument, 0, 'f'},
+		{"deduplicate-tiles", no_argument, &deduplicate_tiles, 1},
 		{"if-matched", no_argument, 0, 'i'},
 		{"attribution", required_argument, 0, 'A'},
 		{"name", required_argument, 0, 'n'},
@@ -906,6 +905,7 @@ int main(int argc, char **argv) {
 
 		{"no-tile-size-limit", no_argument, &pk, 1},
 		{"no-tile-compression", no_argument, &pC, 1},
+		{"tile-compression-level", required_argument, 0, '~'},
 		{"empty-csv-columns-are-null", no_argument, &pe, 1},
 		{"no-tile-stats", no_argument, &pg, 1},
 
@@ -929,11 +929,27 @@ int main(int argc, char **argv) {
 
 	std::string commandline = format_commandline(argc, argv);
 
-	while ((i = getopt_long(argc, argv, getopt_str.c_str(), long_options, NULL)) != -1) {
+	int option_index = 0;
+	while ((i = getopt_long(argc, argv, getopt_str.c_str(), long_options, &option_index)) != -1) {
 		switch (i) {
 		case 0:
 			break;
 
+		case '~': {
+			const char *opt = long_options[option_index].name;
+			if (strcmp(opt, "tile-compression-level") == 0) {
+				tile_compression_level = atoi_require(argv[0], optarg, "Tile compression level");
+				if (tile_compression_level < -1 || tile_compression_level > 9) {
+					fprintf(stderr, "%s: --tile-compression-level must be between -1 and 9 (got %s)\n", argv[0], optarg);
+					exit(EXIT_FAILURE);
+				}
+			} else {
+				fprintf(stderr, "%s: Unrecognized option --%s\n", argv[0], opt);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+
 		case 'o':
 			out_mbtiles = optarg;
 			break;
@@ -1054,6 +1070,11 @@ int main(int argc, char **argv) {
 		usage(argv);
 	}
 
+	if (deduplicate_tiles && out_dir != NULL) {
+		fprintf(stderr, "%s: --deduplicate-tiles only works with -o output, not -e\n", argv[0]);
+		usage(argv);
+	}
+
 	if (minzoom > maxzoom) {
 		fprintf(stderr, "%s: Minimum zoom -Z%d cannot be greater than maxzoom -z%d\n", argv[0], minzoom, maxzoom);
 		exit(EXIT_FAILURE);
@@ -1063,7 +1084,7 @@ int main(int argc, char **argv) {
 		if (force) {
 			unlink(out_mbtiles);
 		}
-		outdb = mbtiles_open(out_mbtiles, argv, 0);
+		outdb = mbtiles_open(out_mbtiles, argv, 0, deduplicate_tiles);
 	}
 	if (out_dir != NULL) {
 		check_dir(out_dir, argv, force, false);
@@ -1098,7 +1119,9 @@ int main(int argc, char **argv) {
 	std::map<std::string, std::string> attribute_descriptions;
 	std::string generator_options;
 
-	decode(readers, layermap, outdb, out_dir, &st, header, mapping, exclude, ifmatched, attribution, description, keep_layers, remove_layers, name, filter, attribute_descriptions, generator_options);
+	mbtiles_writer *writer = mbtiles_writer_start(outdb, out_dir);
+	decode(readers, layermap, writer, &st, header, mapping, exclude, ifmatched, attribution, description, keep_layers, remove_layers, name, filter, attribute_descriptions, generator_options);
+	mbtiles_writer_finish(writer);
 
 	if (set_attribution.size() != 0) {
 		attribution = set_attribution;
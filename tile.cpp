@@ -6,6 +6,7 @@
 #include <fstream>
 #include <string>
 #include <stack>
+#include <deque>
 #include <vector>
 #include <map>
 #include <set>
@@ -19,6 +20,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <cmath>
 #include <sqlite3.h>
 #include <pthread.h>
@@ -55,7 +57,6 @@ extern "C" {
 #define XSTRINGIFY(s) STRINGIFY(s)
 #define STRINGIFY(s) #s
 
-pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t var_lock = PTHREAD_MUTEX_INITIALIZER;
 
 std::vector<mvt_geometry> to_feature(drawvec &geom) {
@@ -202,11 +203,7 @@ mvt_value retrieve_string(long long off, char *stringpool, int *otype) {
 void decode_meta(std::vector<long long> const &metakeys, std::vector<long long> const &metavals, char *stringpool, mvt_layer &layer, mvt_feature &feature) {
 	size_t i;
 	for (i = 0; i < metakeys.size(); i++) {
-		int otype;
-		mvt_value key = retrieve_string(metakeys[i], stringpool, NULL);
-		mvt_value value = retrieve_string(metavals[i], stringpool, &otype);
-
-		layer.tag(feature, key.string_value, value);
+		layer.tag_pooled(feature, stringpool + metakeys[i], stringpool + metavals[i]);
 	}
 }
 
@@ -248,7 +245,7 @@ static int metacmp(const std::vector<long long> &keys1, const std::vector<long l
 	}
 }
 
-void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, unsigned tx, unsigned ty, int buffer, int *within, std::atomic<long long> *geompos, FILE **geomfile, const char *fname, signed char t, int layer, long long metastart, signed char feature_minzoom, int child_shards, int max_zoom_increment, long long seq, int tippecanoe_minzoom, int tippecanoe_maxzoom, int segment, unsigned *initial_x, unsigned *initial_y, std::vector<long long> &metakeys, std::vector<long long> &metavals, bool has_id, unsigned long long id, unsigned long long index, long long extent) {
+void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, unsigned tx, unsigned ty, int buffer, int *within, shard_writer *geomfile, const char *fname, signed char t, int layer, long long metastart, signed char feature_minzoom, int child_shards, int max_zoom_increment, long long seq, int tippecanoe_minzoom, int tippecanoe_maxzoom, int segment, unsigned *initial_x, unsigned *initial_y, std::vector<long long> &metakeys, std::vector<long long> &metavals, bool has_id, unsigned long long id, unsigned long long index, long long extent) {
 	if (geom.size() > 0 && (nextzoom <= maxzoom || additional[A_EXTEND_ZOOMS])) {
 		int xo, yo;
 		int span = 1 << (nextzoom - z);
@@ -318,9 +315,9 @@ void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, u
 
 				{
 					if (!within[j]) {
-						serialize_int(geomfile[j], nextzoom, &geompos[j], fname);
-						serialize_uint(geomfile[j], tx * span + xo, &geompos[j], fname);
-						serialize_uint(geomfile[j], ty * span + yo, &geompos[j], fname);
+						serialize_int(geomfile[j].buf, nextzoom);
+						serialize_uint(geomfile[j].buf, tx * span + xo);
+						serialize_uint(geomfile[j].buf, ty * span + yo);
 						within[j] = 1;
 					}
 
@@ -348,7 +345,10 @@ void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, u
 						}
 					}
 
-					serialize_feature(geomfile[j], &sf, &geompos[j], fname, SHIFT_RIGHT(initial_x[segment]), SHIFT_RIGHT(initial_y[segment]), true);
+					serialize_feature(geomfile[j].buf, &sf, SHIFT_RIGHT(initial_x[segment]), SHIFT_RIGHT(initial_y[segment]), true);
+					if (geomfile[j].buf.size() >= SHARD_BUFFER) {
+						shard_flush(&geomfile[j], fname);
+					}
 				}
 			}
 		}
@@ -383,14 +383,15 @@ struct partial {
 	ssize_t renamed = 0;
 	long long extent = 0;
 	long long clustered = 0;
+	ssize_t candidate = -1;
 	std::set<std::string> need_tilestats;
 	std::map<std::string, accum_state> attribute_accum_state;
 };
 
 struct partial_arg {
 	std::vector<struct partial> *partials = NULL;
-	int task = 0;
-	int tasks = 0;
+	size_t start = 0;
+	size_t end = 0;
 	drawvec *shared_nodes;
 };
 
@@ -439,12 +440,14 @@ void *partial_feature_worker(void *v) {
 	struct partial_arg *a = (struct partial_arg *) v;
 	std::vector<struct partial> *partials = a->partials;
 
-	for (size_t i = a->task; i < (*partials).size(); i += a->tasks) {
+	for (size_t i = a->start; i < a->end; i++) {
 		drawvec geom;
 
-		for (size_t j = 0; j < (*partials)[i].geoms.size(); j++) {
-			for (size_t k = 0; k < (*partials)[i].geoms[j].size(); k++) {
-				geom.push_back((*partials)[i].geoms[j][k]);
+		if ((*partials)[i].geoms.size() == 1) {
+			geom = std::move((*partials)[i].geoms[0]);
+		} else {
+			for (size_t j = 0; j < (*partials)[i].geoms.size(); j++) {
+				geom.insert(geom.end(), (*partials)[i].geoms[j].begin(), (*partials)[i].geoms[j].end());
 			}
 		}
 
@@ -466,7 +469,7 @@ void *partial_feature_worker(void *v) {
 		if ((t == VT_LINE || t == VT_POLYGON) && !(prevent[P_SIMPLIFY] || (z == maxzoom && prevent[P_SIMPLIFY_LOW]) || (z < maxzoom && additional[A_GRID_LOW_ZOOMS]))) {
 			if (1 /* !reduced */) {  // XXX why did this not simplify if reduced?
 				if (t == VT_LINE) {
-					geom = remove_noop(geom, t, 32 - z - line_detail);
+					remove_noop_in_place(geom, t, 32 - z - line_detail);
 				}
 
 				bool already_marked = false;
@@ -475,11 +478,7 @@ void *partial_feature_worker(void *v) {
 				}
 
 				if (!already_marked) {
-					drawvec ngeom = simplify_lines(geom, z, line_detail, !(prevent[P_CLIPPING] || prevent[P_DUPLICATION]), (*partials)[i].simplification, t == VT_POLYGON ? 4 : 0, *(a->shared_nodes));
-
-					if (t != VT_POLYGON || ngeom.size() >= 3) {
-						geom = ngeom;
-					}
+					simplify_lines_in_place(geom, z, line_detail, !(prevent[P_CLIPPING] || prevent[P_DUPLICATION]), (*partials)[i].simplification, t == VT_POLYGON ? 4 : 0, *(a->shared_nodes), t == VT_POLYGON ? 3 : 0);
 				}
 			}
 		}
@@ -497,7 +496,7 @@ void *partial_feature_worker(void *v) {
 		to_tile_scale(geom, z, line_detail);
 
 		std::vector<drawvec> geoms;
-		geoms.push_back(geom);
+		geoms.push_back(std::move(geom));
 
 		if (t == VT_POLYGON) {
 			// Scaling may have made the polygon degenerate.
@@ -520,12 +519,235 @@ void *partial_feature_worker(void *v) {
 		}
 
 		(*partials)[i].index = i;
-		(*partials)[i].geoms = geoms;
+		(*partials)[i].geoms = std::move(geoms);
+	}
+
+	return NULL;
+}
+
+// The features of a tile are simplified and clipped in chunks, which the
+// tiling thread works through itself while any idle threads from a
+// long-lived pool help out, rather than starting new threads for every tile.
+// Each chunk is sized when it is claimed, from how many tiling threads are
+// still running then, so that the last heavy tiles of a zoom spread out
+// over the cores that the finished threads leave free.
+
+struct partial_batch {
+	std::vector<struct partial> *partials = NULL;
+	drawvec *shared_nodes = NULL;
+	std::atomic<int> *running = NULL;  // tiling threads still at work
+	std::vector<size_t> points;	   // points in features before each feature
+	size_t next = 0;		   // next feature to claim
+	size_t done = 0;		   // features finished
+};
+
+static pthread_mutex_t partial_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t partial_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t partial_done = PTHREAD_COND_INITIALIZER;
+static std::deque<partial_batch *> partial_batches;
+static size_t partial_helping = 0;  // pool threads currently working on a chunk
+static pthread_once_t partial_pool_once = PTHREAD_ONCE_INIT;
+
+// Chunks smaller than this cost more to hand out than to process
+#define PARTIAL_MIN_CHUNK 2000
+
+// Called with partial_lock held
+static bool claim_chunk(partial_batch *b, partial_arg *out) {
+	size_t count = b->partials->size();
+	if (b->next >= count) {
+		return false;
+	}
+
+	// Take a share of what is left for each thread that could be working on it
+	int running = *b->running;
+	size_t tasks = ceil((double) CPUS / (running > 0 ? running : 1));
+	size_t target = (b->points[count] - b->points[b->next]) / (2 * tasks);
+	if (target < PARTIAL_MIN_CHUNK) {
+		target = PARTIAL_MIN_CHUNK;
+	}
+
+	size_t end = b->next + 1;
+	while (end < count && b->points[end] - b->points[b->next] < target) {
+		end++;
+	}
+
+	out->partials = b->partials;
+	out->shared_nodes = b->shared_nodes;
+	out->start = b->next;
+	out->end = end;
+	b->next = end;
+	return true;
+}
+
+// Called with partial_lock held
+static void finish_chunk(partial_batch *b, partial_arg const &a) {
+	b->done += a.end - a.start;
+
+	if (b->done == b->partials->size()) {
+		if (pthread_cond_broadcast(&partial_done) != 0) {
+			perror("pthread_cond_broadcast");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+// Called whenever a tiling thread stops working, since that may free
+// a core for the pool threads to help with the tiles still in progress
+static void partial_pool_wake() {
+	if (pthread_mutex_lock(&partial_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_cond_broadcast(&partial_work) != 0) {
+		perror("pthread_cond_broadcast");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_mutex_unlock(&partial_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void *partial_pool_thread(void *) {
+	if (pthread_mutex_lock(&partial_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+
+	while (true) {
+		// Only help out while there are cores that tiling threads are not using
+		if (partial_batches.size() == 0 || partial_helping + (size_t) *partial_batches.front()->running >= CPUS) {
+			if (pthread_cond_wait(&partial_work, &partial_lock) != 0) {
+				perror("pthread_cond_wait");
+				exit(EXIT_FAILURE);
+			}
+			continue;
+		}
+
+		partial_batch *b = partial_batches.front();
+		partial_arg a;
+		if (!claim_chunk(b, &a)) {
+			partial_batches.pop_front();
+			continue;
+		}
+
+		partial_helping++;
+		if (pthread_mutex_unlock(&partial_lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_FAILURE);
+		}
+
+		partial_feature_worker(&a);
+
+		if (pthread_mutex_lock(&partial_lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_FAILURE);
+		}
+		partial_helping--;
+		finish_chunk(b, a);
+
+		// Finishing a chunk frees a core for another pool thread
+		if (pthread_cond_signal(&partial_work) != 0) {
+			perror("pthread_cond_signal");
+			exit(EXIT_FAILURE);
+		}
 	}
 
 	return NULL;
 }
 
+static void start_partial_pool() {
+	for (size_t i = 1; i < CPUS; i++) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, partial_pool_thread, NULL) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+		if (pthread_detach(thread) != 0) {
+			perror("pthread_detach");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void process_partials(std::vector<struct partial> &partials, drawvec &shared_nodes, std::atomic<int> *running) {
+	partial_batch b;
+	b.partials = &partials;
+	b.shared_nodes = &shared_nodes;
+	b.running = running;
+
+	b.points.push_back(0);
+	for (size_t i = 0; i < partials.size(); i++) {
+		size_t points = 0;
+		for (size_t j = 0; j < partials[i].geoms.size(); j++) {
+			points += partials[i].geoms[j].size();
+		}
+		b.points.push_back(b.points.back() + points);
+	}
+
+	// Too small to be worth sharing, or no other cores to share it with
+	if (b.points.back() < 2 * PARTIAL_MIN_CHUNK || partials.size() < 2 || CPUS < 2) {
+		partial_arg a;
+		a.partials = &partials;
+		a.shared_nodes = &shared_nodes;
+		a.start = 0;
+		a.end = partials.size();
+		partial_feature_worker(&a);
+		return;
+	}
+
+	if (pthread_once(&partial_pool_once, start_partial_pool) != 0) {
+		perror("pthread_once");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pthread_mutex_lock(&partial_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+
+	partial_batches.push_back(&b);
+	if (pthread_cond_broadcast(&partial_work) != 0) {
+		perror("pthread_cond_broadcast");
+		exit(EXIT_FAILURE);
+	}
+
+	partial_arg a;
+	while (claim_chunk(&b, &a)) {
+		if (pthread_mutex_unlock(&partial_lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_FAILURE);
+		}
+
+		partial_feature_worker(&a);
+
+		if (pthread_mutex_lock(&partial_lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_FAILURE);
+		}
+		finish_chunk(&b, a);
+	}
+
+	// Nothing is left to claim, so no pool thread can pick up the batch again
+	auto found = std::find(partial_batches.begin(), partial_batches.end(), &b);
+	if (found != partial_batches.end()) {
+		partial_batches.erase(found);
+	}
+
+	while (b.done < partials.size()) {
+		if (pthread_cond_wait(&partial_done, &partial_lock) != 0) {
+			perror("pthread_cond_wait");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (pthread_mutex_unlock(&partial_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
 int manage_gap(unsigned long long index, unsigned long long *previndex, double scale, double gamma, double *gap) {
 	if (gamma > 0) {
 		if (*gap > 0) {
@@ -1173,23 +1395,147 @@ long long choose_minextent(std::vector<long long> &extents, double f) {
 	return extents[(extents.size() - 1) * (1 - f)];
 }
 
+// With --predict-dropping, the first attempt at a tile records each feature
+// that could be dropped to make the tile fit, along with how much it added
+// to the tile, so that the threshold that brings the tile under its limit
+// can be solved for directly instead of approached by repeated guesses.
+struct drop_candidate {
+	unsigned long long index = 0;
+	long long extent = 0;
+	bool point = false;
+	long long weight = 0;  // 0 if the feature was not kept; -1 if the threshold itself dropped it
+};
+
+// How much the candidates that would be kept by a threshold add to the tile,
+// either as a number of features or as a weight proportional to their size.
+// Features whose size is unknown because they were dropped in the first
+// attempt are assumed to be of average size.
+static double candidate_weight(drop_candidate const &c, bool by_count, double average) {
+	if (c.weight < 0) {
+		return by_count ? 1 : average;
+	}
+	if (c.weight == 0) {
+		return 0;
+	}
+	return by_count ? 1 : c.weight;
+}
+
+static double average_weight(std::vector<drop_candidate> const &candidates) {
+	double sum = 0;
+	size_t count = 0;
+
+	for (size_t i = 0; i < candidates.size(); i++) {
+		if (candidates[i].weight > 0) {
+			sum += candidates[i].weight;
+			count++;
+		}
+	}
+
+	if (count == 0) {
+		return 1;
+	}
+	return sum / count;
+}
+
+static double kept_by_mingap(std::vector<drop_candidate> const &candidates, unsigned long long mingap, bool by_count, double average) {
+	double kept = 0;
+	unsigned long long prev = 0;
+
+	for (size_t i = 0; i < candidates.size(); i++) {
+		if (i > 0 && mingap > 0 && (candidates[i].index < prev || candidates[i].index - prev < mingap)) {
+			continue;
+		}
+
+		double w = candidate_weight(candidates[i], by_count, average);
+		if (w > 0) {
+			kept += w;
+			prev = candidates[i].index;
+		}
+	}
+
+	return kept;
+}
+
+// The smallest gap, larger than the current one, that keeps no more than target
+unsigned long long solve_mingap(std::vector<drop_candidate> const &candidates, unsigned long long mingap, double target, bool by_count) {
+	double average = average_weight(candidates);
+
+	unsigned long long bot = mingap;
+	unsigned long long top = 0;
+	for (size_t i = 1; i < candidates.size(); i++) {
+		if (candidates[i].index >= candidates[i - 1].index && candidates[i].index - candidates[i - 1].index > top) {
+			top = candidates[i].index - candidates[i - 1].index;
+		}
+	}
+	if (top < ULONG_MAX) {
+		top++;
+	}
+	if (top <= bot) {
+		return ULONG_MAX;
+	}
+
+	while (top - bot > 1) {
+		unsigned long long guess = bot + (top - bot) / 2;
+
+		if (kept_by_mingap(candidates, guess, by_count, average) > target) {
+			bot = guess;
+		} else {
+			top = guess;
+		}
+	}
+
+	return top;
+}
+
+// The smallest extent at or below which features must be dropped to keep no more than target
+long long solve_minextent(std::vector<drop_candidate> const &candidates, long long minextent, double target, bool by_count) {
+	double average = average_weight(candidates);
+	std::vector<std::pair<long long, double>> sizes;
+	double kept = 0;
+
+	for (size_t i = 0; i < candidates.size(); i++) {
+		double w = candidate_weight(candidates[i], by_count, average);
+
+		if (candidates[i].point) {
+			kept += w;
+		} else if (candidates[i].extent > minextent) {
+			kept += w;
+			sizes.push_back(std::pair<long long, double>(candidates[i].extent, w));
+		}
+	}
+
+	std::sort(sizes.begin(), sizes.end());
+
+	long long m = minextent;
+	for (size_t i = 0; i < sizes.size() && kept > target; i++) {
+		kept -= sizes[i].second;
+		m = sizes[i].first;
+	}
+
+	return m;
+}
+
+struct task_queue;
+struct pipeline;
+
 struct write_tile_args {
-	struct task *tasks = NULL;
+	std::vector<task_queue> *queues = NULL;
+	struct pipeline *pipeline = NULL;
+	size_t queue = 0;
+	char **geommap = NULL;
+	std::vector<long long> *tile_starts = NULL;
 	char *metabase = NULL;
 	char *stringpool = NULL;
 	int min_detail = 0;
-	sqlite3 *outdb = NULL;
-	const char *outdir = NULL;
+	mbtiles_writer *writer = NULL;
 	int buffer = 0;
 	const char *fname = NULL;
-	FILE **geomfile = NULL;
+	shard_writer *geomfile = NULL;
 	double todo = 0;
 	std::atomic<long long> *along = NULL;
 	double gamma = 0;
 	double gamma_out = 0;
 	int child_shards = 0;
-	int *geomfd = NULL;
-	off_t *geom_size = NULL;
 	std::atomic<unsigned> *midx = NULL;
 	std::atomic<unsigned> *midy = NULL;
 	int maxzoom = 0;
@@ -1221,6 +1567,8 @@ struct write_tile_args {
 	int wrote_zoom = 0;
 	size_t tiling_seg = 0;
 	struct json_object *filter = NULL;
+	std::string pbf{};  // reused by this thread for each tile it encodes
+	mvt_tag_tables tag_tables{};  // and for each layer it tags
 };
 
 bool clip_to_tile(serial_feature &sf, int z, long long buffer) {
@@ -1275,7 +1623,7 @@ bool clip_to_tile(serial_feature &sf, int z, long long buffer) {
 			clipped = clip_point(sf.geometry, z, buffer);
 		}
 
-		clipped = remove_noop(clipped, sf.t, 0);
+		remove_noop_in_place(clipped, sf.t, 0);
 
 		// Must clip at z0 even if we don't want clipping, to handle features
 		// that are duplicated across the date line
@@ -1318,7 +1666,7 @@ void remove_attributes(serial_feature &sf, std::set<std::string> const &exclude_
 	}
 }
 
-serial_feature next_feature(FILE *geoms, std::atomic<long long> *geompos_in, char *metabase, long long *meta_off, int z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y, long long *original_features, long long *unclipped_features, int nextzoom, int maxzoom, int minzoom, int max_zoom_increment, size_t pass, size_t passes, std::atomic<long long> *along, long long alongminus, int buffer, int *within, bool *first_time, FILE **geomfile, std::atomic<long long> *geompos, std::atomic<double> *oprogress, double todo, const char *fname, int child_shards, struct json_object *filter, const char *stringpool, long long *pool_off, std::vector<std::vector<std::string>> *layer_unmaps) {
+serial_feature next_feature(char *geoms, long long *geompos_in, char *metabase, long long *meta_off, int z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y, long long *original_features, long long *unclipped_features, int nextzoom, int maxzoom, int minzoom, int max_zoom_increment, size_t pass, size_t passes, std::atomic<long long> *along, long long alongminus, int buffer, int *within, bool *first_time, shard_writer *geomfile, std::atomic<double> *oprogress, double todo, const char *fname, int child_shards, struct json_object *filter, const char *stringpool, long long *pool_off, std::vector<std::vector<std::string>> *layer_unmaps) {
 	while (1) {
 		serial_feature sf = deserialize_feature(geoms, geompos_in, metabase, meta_off, z, tx, ty, initial_x, initial_y);
 		if (sf.t < 0) {
@@ -1345,7 +1693,7 @@ serial_feature next_feature(FILE *geoms, std::atomic<long long> *geompos_in, cha
 
 		if (*first_time && pass == 1) { /* only write out the next zoom once, even if we retry */
 			if (sf.tippecanoe_maxzoom == -1 || sf.tippecanoe_maxzoom >= nextzoom) {
-				rewrite(sf.geometry, z, nextzoom, maxzoom, sf.bbox, tx, ty, buffer, within, geompos, geomfile, fname, sf.t, sf.layer, sf.metapos, sf.feature_minzoom, child_shards, max_zoom_increment, sf.seq, sf.tippecanoe_minzoom, sf.tippecanoe_maxzoom, sf.segment, initial_x, initial_y, sf.keys, sf.values, sf.has_id, sf.id, sf.index, sf.extent);
+				rewrite(sf.geometry, z, nextzoom, maxzoom, sf.bbox, tx, ty, buffer, within, geomfile, fname, sf.t, sf.layer, sf.metapos, sf.feature_minzoom, child_shards, max_zoom_increment, sf.seq, sf.tippecanoe_minzoom, sf.tippecanoe_maxzoom, sf.segment, initial_x, initial_y, sf.keys, sf.values, sf.has_id, sf.id, sf.index, sf.extent);
 			}
 		}
 
@@ -1446,8 +1794,8 @@ serial_feature next_feature(FILE *geoms, std::atomic<long long> *geompos_in, cha
 }
 
 struct run_prefilter_args {
-	FILE *geoms = NULL;
-	std::atomic<long long> *geompos_in = NULL;
+	char *geoms = NULL;
+	long long *geompos_in = NULL;
 	char *metabase = NULL;
 	long long *meta_off = NULL;
 	int z = 0;
@@ -1468,8 +1816,7 @@ struct run_prefilter_args {
 	int buffer = 0;
 	int *within = NULL;
 	bool *first_time = NULL;
-	FILE **geomfile = NULL;
-	std::atomic<long long> *geompos = NULL;
+	shard_writer *geomfile = NULL;
 	std::atomic<double> *oprogress = NULL;
 	double todo = 0;
 	const char *fname = 0;
@@ -1486,7 +1833,7 @@ void *run_prefilter(void *v) {
 	json_writer state(rpa->prefilter_fp);
 
 	while (1) {
-		serial_feature sf = next_feature(rpa->geoms, rpa->geompos_in, rpa->metabase, rpa->meta_off, rpa->z, rpa->tx, rpa->ty, rpa->initial_x, rpa->initial_y, rpa->original_features, rpa->unclipped_features, rpa->nextzoom, rpa->maxzoom, rpa->minzoom, rpa->max_zoom_increment, rpa->pass, rpa->passes, rpa->along, rpa->alongminus, rpa->buffer, rpa->within, rpa->first_time, rpa->geomfile, rpa->geompos, rpa->oprogress, rpa->todo, rpa->fname, rpa->child_shards, rpa->filter, rpa->stringpool, rpa->pool_off, rpa->layer_unmaps);
+		serial_feature sf = next_feature(rpa->geoms, rpa->geompos_in, rpa->metabase, rpa->meta_off, rpa->z, rpa->tx, rpa->ty, rpa->initial_x, rpa->initial_y, rpa->original_features, rpa->unclipped_features, rpa->nextzoom, rpa->maxzoom, rpa->minzoom, rpa->max_zoom_increment, rpa->pass, rpa->passes, rpa->along, rpa->alongminus, rpa->buffer, rpa->within, rpa->first_time, rpa->geomfile, rpa->oprogress, rpa->todo, rpa->fname, rpa->child_shards, rpa->filter, rpa->stringpool, rpa->pool_off, rpa->layer_unmaps);
 		if (sf.t < 0) {
 			break;
 		}
@@ -1496,7 +1843,7 @@ void *run_prefilter(void *v) {
 		tmp_layer.name = (*(rpa->layer_unmaps))[sf.segment][sf.layer];
 
 		if (sf.t == VT_POLYGON) {
-			sf.geometry = close_poly(sf.geometry);
+			close_poly_in_place(sf.geometry);
 		}
 
 		mvt_feature tmp_feature;
@@ -1715,7 +2062,110 @@ static bool line_is_too_small(drawvec const &geometry, int z, int detail) {
 	return true;
 }
 
-long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *metabase, char *stringpool, int z, unsigned tx, unsigned ty, int detail, int min_detail, sqlite3 *outdb, const char *outdir, int buffer, const char *fname, FILE **geomfile, int minzoom, int maxzoom, double todo, std::atomic<long long> *along, long long alongminus, double gamma, int child_shards, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, std::atomic<int> *running, double simplification, std::vector<std::map<std::string, layermap_entry>> *layermaps, std::vector<std::vector<std::string>> *layer_unmaps, size_t tiling_seg, size_t pass, size_t passes, unsigned long long mingap, long long minextent, double fraction, const char *prefilter, const char *postfilter, struct json_object *filter, write_tile_args *arg) {
+// How well tiles have been compressing at each zoom level, so that a tile whose
+// protobuf is already far too large can be rejected without encoding and
+// compressing it. Ratios are compressed bytes per 65536 protobuf bytes,
+// counted in buckets so that the prediction can use a low percentile
+// rather than the single most compressible tile ever seen.
+#define COMPRESSION_RATIO_BUCKETS 64
+
+struct compression_model {
+	std::atomic<long long> tiles;
+	std::atomic<long long> pbf_bytes;
+	std::atomic<long long> compressed_bytes;
+	std::atomic<long long> ratios[COMPRESSION_RATIO_BUCKETS];
+};
+
+static compression_model compression_models[MAX_ZOOM + 1];
+
+// Don't trust the model until it has seen this many tiles at the zoom level
+#define COMPRESSION_MODEL_MIN_TILES 20
+
+static void observe_compression(int z, size_t pbf_size, size_t compressed_size) {
+	if (pbf_size == 0) {
+		return;
+	}
+
+	compression_model &m = compression_models[z];
+	size_t bucket = compressed_size * (double) COMPRESSION_RATIO_BUCKETS / pbf_size;
+	if (bucket >= COMPRESSION_RATIO_BUCKETS) {
+		bucket = COMPRESSION_RATIO_BUCKETS - 1;
+	}
+
+	m.pbf_bytes += pbf_size;
+	m.compressed_bytes += compressed_size;
+	m.ratios[bucket]++;
+	m.tiles++;
+}
+
+// Returns the expected compressed size of a tile whose protobuf will be
+// pbf_size bytes, always more than the limit, if even compression as good
+// as the best 10% of tiles seen at this zoom would leave it more than 25%
+// over the limit, or 0 if it has to be compressed to know.
+static size_t predict_oversize(int z, size_t pbf_size, size_t limit) {
+	// Borrow from the zoom levels above if this one has not seen enough tiles yet
+	while (z > 0 && compression_models[z].tiles < COMPRESSION_MODEL_MIN_TILES) {
+		z--;
+	}
+
+	compression_model &m = compression_models[z];
+	long long tiles = m.tiles;
+	if (tiles < COMPRESSION_MODEL_MIN_TILES) {
+		return 0;
+	}
+
+	// The low edge of the bucket that holds the 10th percentile
+	long long seen = 0;
+	size_t bucket;
+	for (bucket = 0; bucket + 1 < COMPRESSION_RATIO_BUCKETS; bucket++) {
+		seen += m.ratios[bucket];
+		if (seen * 10 >= tiles) {
+			break;
+		}
+	}
+	double ratio = (double) bucket / COMPRESSION_RATIO_BUCKETS;
+
+	if (pbf_size * ratio > limit * 1.25) {
+		// The average ratio can be lower than the percentile,
+		// but the tile has still been judged too big
+		size_t estimate = pbf_size * ((double) m.compressed_bytes / m.pbf_bytes);
+		return std::max(estimate, limit + 1);
+	}
+
+	return 0;
+}
+
+// The features of a tile, grouped by layer. Features are filed by the
+// segment and layer number they were serialized with, so each layer
+// is looked up by name only once per tile.
+struct tile_layers {
+	std::vector<std::vector<coalesce>> features;  // for each layer, in order of first appearance
+	std::map<std::string, size_t> names;	      // the layer with each name, in name order
+	std::vector<std::vector<ssize_t>> ids;	      // the layer for each segment's layer number, or -1
+
+	std::vector<coalesce> &layer(int segment, long long id, std::vector<std::vector<std::string>> const &layer_unmaps) {
+		if (ids.size() <= (size_t) segment) {
+			ids.resize(segment + 1);
+		}
+		std::vector<ssize_t> &seg = ids[segment];
+		if (seg.size() <= (size_t) id) {
+			seg.resize(id + 1, -1);
+		}
+
+		if (seg[id] < 0) {
+			auto found = names.find(layer_unmaps[segment][id]);
+			if (found == names.end()) {
+				found = names.insert(std::pair<std::string, size_t>(layer_unmaps[segment][id], features.size())).first;
+				features.emplace_back();
+			}
+			seg[id] = found->second;
+		}
+
+		return features[seg[id]];
+	}
+};
+
+long long write_tile(char *geoms, long long *geompos_in, char *metabase, char *stringpool, int z, unsigned tx, unsigned ty, int detail, int min_detail, mbtiles_writer *writer, int buffer, const char *fname, shard_writer *geomfile, int minzoom, int maxzoom, double todo, std::atomic<long long> *along, long long alongminus, double gamma, int child_shards, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, std::atomic<int> *running, double simplification, std::vector<std::map<std::string, layermap_entry>> *layermaps, std::vector<std::vector<std::string>> *layer_unmaps, size_t tiling_seg, size_t pass, size_t passes, unsigned long long mingap, long long minextent, double fraction, const char *prefilter, const char *postfilter, struct json_object *filter, write_tile_args *arg) {
 	int line_detail;
 	double merge_fraction = 1;
 	double mingap_fraction = 1;
@@ -1747,6 +2197,9 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 	bool has_polygons = false;
 
 	bool first_time = true;
+	std::vector<drop_candidate> candidates;
+	bool predicted = false;
+	bool must_compress = false;  // the last try's size was only an estimate
 	// This only loops if the tile data didn't fit, in which case the detail
 	// goes down and the progress indicator goes backward for the next try.
 	for (line_detail = detail; line_detail >= min_detail || line_detail == detail; line_detail--, oprogress = 0) {
@@ -1764,26 +2217,24 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 		long long unclipped_features = 0;
 
 		std::vector<struct partial> partials;
-		std::map<std::string, std::vector<coalesce>> layers;
+		tile_layers layers;
 		std::vector<unsigned long long> indices;
 		std::vector<long long> extents;
 		double coalesced_area = 0;
 		drawvec shared_nodes;
 
+		bool predicting = additional[A_PREDICT_DROPPING] && !predicted;
+		candidates.clear();
+
+		// Where this tile's children will begin in each child shard
 		int within[child_shards];
-		std::atomic<long long> geompos[child_shards];
+		long long childstart[child_shards];
 		for (size_t i = 0; i < (size_t) child_shards; i++) {
-			geompos[i] = 0;
+			childstart[i] = geomfile[i].offset();
 			within[i] = 0;
 		}
 
-		if (*geompos_in != og) {
-			if (fseek(geoms, og, SEEK_SET) != 0) {
-				perror("fseek geom");
-				exit(EXIT_FAILURE);
-			}
-			*geompos_in = og;
-		}
+		*geompos_in = og;
 
 		int prefilter_write = -1, prefilter_read = -1;
 		pid_t prefilter_pid = 0;
@@ -1829,7 +2280,6 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 			rpa.within = within;
 			rpa.first_time = &first_time;
 			rpa.geomfile = geomfile;
-			rpa.geompos = geompos;
 			rpa.oprogress = &oprogress;
 			rpa.todo = todo;
 			rpa.fname = fname;
@@ -1851,6 +2301,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 				exit(EXIT_FAILURE);
 			}
 			prefilter_jp = json_begin_file(prefilter_read_fp);
+			prefilter_jp->pack_coordinates = 1;
 		}
 
 		while (1) {
@@ -1858,7 +2309,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 			ssize_t which_partial = -1;
 
 			if (prefilter == NULL) {
-				sf = next_feature(geoms, geompos_in, metabase, meta_off, z, tx, ty, initial_x, initial_y, &original_features, &unclipped_features, nextzoom, maxzoom, minzoom, max_zoom_increment, pass, passes, along, alongminus, buffer, within, &first_time, geomfile, geompos, &oprogress, todo, fname, child_shards, filter, stringpool, pool_off, layer_unmaps);
+				sf = next_feature(geoms, geompos_in, metabase, meta_off, z, tx, ty, initial_x, initial_y, &original_features, &unclipped_features, nextzoom, maxzoom, minzoom, max_zoom_increment, pass, passes, along, alongminus, buffer, within, &first_time, geomfile, &oprogress, todo, fname, child_shards, filter, stringpool, pool_off, layer_unmaps);
 			} else {
 				sf = parse_feature(prefilter_jp, z, tx, ty, layermaps, tiling_seg, layer_unmaps, postfilter != NULL);
 			}
@@ -1881,9 +2332,22 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 				}
 			}
 
+			ssize_t which_candidate = -1;
+			if (predicting && (additional[A_CLUSTER_DENSEST_AS_NEEDED] || cluster_distance != 0 || additional[A_DROP_DENSEST_AS_NEEDED] || additional[A_COALESCE_DENSEST_AS_NEEDED] || additional[A_DROP_SMALLEST_AS_NEEDED] || additional[A_COALESCE_SMALLEST_AS_NEEDED])) {
+				drop_candidate dc;
+				dc.index = sf.index;
+				dc.extent = sf.extent;
+				dc.point = sf.t == VT_POINT;
+				candidates.push_back(dc);
+				which_candidate = candidates.size() - 1;
+			}
+
 			if (additional[A_CLUSTER_DENSEST_AS_NEEDED] || cluster_distance != 0) {
 				indices.push_back(sf.index);
 				if ((sf.index < merge_previndex || sf.index - merge_previndex < mingap) && find_partial(partials, sf, which_partial, layer_unmaps)) {
+					if (which_candidate >= 0) {
+						candidates[which_candidate].weight = -1;
+					}
 					partials[which_partial].clustered++;
 
 					if (partials[which_partial].t == VT_POINT &&
@@ -1904,13 +2368,19 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 			} else if (additional[A_DROP_DENSEST_AS_NEEDED]) {
 				indices.push_back(sf.index);
 				if (sf.index - merge_previndex < mingap && find_partial(partials, sf, which_partial, layer_unmaps)) {
+					if (which_candidate >= 0) {
+						candidates[which_candidate].weight = -1;
+					}
 					preserve_attributes(arg->attribute_accum, sf, stringpool, pool_off, partials[which_partial]);
 					continue;
 				}
 			} else if (additional[A_COALESCE_DENSEST_AS_NEEDED]) {
 				indices.push_back(sf.index);
 				if (sf.index - merge_previndex < mingap && find_partial(partials, sf, which_partial, layer_unmaps)) {
-					partials[which_partial].geoms.push_back(sf.geometry);
+					if (which_candidate >= 0) {
+						candidates[which_candidate].weight = -1;
+					}
+					partials[which_partial].geoms.push_back(std::move(sf.geometry));
 					coalesced_area += sf.extent;
 					preserve_attributes(arg->attribute_accum, sf, stringpool, pool_off, partials[which_partial]);
 					continue;
@@ -1918,13 +2388,19 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 			} else if (additional[A_DROP_SMALLEST_AS_NEEDED]) {
 				extents.push_back(sf.extent);
 				if (sf.extent + coalesced_area <= minextent && sf.t != VT_POINT && find_partial(partials, sf, which_partial, layer_unmaps)) {
+					if (which_candidate >= 0) {
+						candidates[which_candidate].weight = -1;
+					}
 					preserve_attributes(arg->attribute_accum, sf, stringpool, pool_off, partials[which_partial]);
 					continue;
 				}
 			} else if (additional[A_COALESCE_SMALLEST_AS_NEEDED]) {
 				extents.push_back(sf.extent);
 				if (sf.extent + coalesced_area <= minextent && find_partial(partials, sf, which_partial, layer_unmaps)) {
-					partials[which_partial].geoms.push_back(sf.geometry);
+					if (which_candidate >= 0) {
+						candidates[which_candidate].weight = -1;
+					}
+					partials[which_partial].geoms.push_back(std::move(sf.geometry));
 					coalesced_area += sf.extent;
 					preserve_attributes(arg->attribute_accum, sf, stringpool, pool_off, partials[which_partial]);
 					continue;
@@ -1946,7 +2422,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 			fraction_accum += fraction;
 			if (fraction_accum < 1 && find_partial(partials, sf, which_partial, layer_unmaps)) {
 				if (additional[A_COALESCE_FRACTION_AS_NEEDED]) {
-					partials[which_partial].geoms.push_back(sf.geometry);
+					partials[which_partial].geoms.push_back(std::move(sf.geometry));
 					coalesced_area += sf.extent;
 				}
 				preserve_attributes(arg->attribute_accum, sf, stringpool, pool_off, partials[which_partial]);
@@ -1974,8 +2450,9 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 					}
 				}
 
-				partial p;
-				p.geoms.push_back(sf.geometry);
+				partials.emplace_back();
+				partial &p = partials.back();
+				p.geoms.push_back(std::move(sf.geometry));
 				p.layer = sf.layer;
 				p.t = sf.t;
 				p.segment = sf.segment;
@@ -1984,10 +2461,10 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 				p.z = z;
 				p.line_detail = line_detail;
 				p.maxzoom = maxzoom;
-				p.keys = sf.keys;
-				p.values = sf.values;
-				p.full_keys = sf.full_keys;
-				p.full_values = sf.full_values;
+				p.keys = std::move(sf.keys);
+				p.values = std::move(sf.values);
+				p.full_keys = std::move(sf.full_keys);
+				p.full_values = std::move(sf.full_values);
 				p.spacing = spacing;
 				p.simplification = simplification;
 				p.id = sf.id;
@@ -1996,7 +2473,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 				p.renamed = -1;
 				p.extent = sf.extent;
 				p.clustered = 0;
-				partials.push_back(p);
+				p.candidate = which_candidate;
 			}
 
 			merge_previndex = sf.index;
@@ -2092,37 +2569,16 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 			merge_successful = find_common_edges(partials, z, line_detail, simplification, maxzoom, merge_fraction);
 		}
 
-		int tasks = ceil((double) CPUS / *running);
-		if (tasks < 1) {
-			tasks = 1;
-		}
-
-		pthread_t pthreads[tasks];
-		std::vector<partial_arg> args;
-		args.resize(tasks);
-		for (int i = 0; i < tasks; i++) {
-			args[i].task = i;
-			args[i].tasks = tasks;
-			args[i].partials = &partials;
-			args[i].shared_nodes = &shared_nodes;
-
-			if (tasks > 1) {
-				if (pthread_create(&pthreads[i], NULL, partial_feature_worker, &args[i]) != 0) {
-					perror("pthread_create");
-					exit(EXIT_FAILURE);
-				}
-			} else {
-				partial_feature_worker(&args[i]);
-			}
-		}
-
-		if (tasks > 1) {
-			for (int i = 0; i < tasks; i++) {
-				void *retval;
+		process_partials(partials, shared_nodes, running);
 
-				if (pthread_join(pthreads[i], &retval) != 0) {
-					perror("pthread_join");
+		// Each feature's share of the tile is estimated from its size after simplification
+		for (size_t i = 0; i < partials.size(); i++) {
+			if (partials[i].candidate >= 0) {
+				long long weight = 1 + partials[i].keys.size() + partials[i].full_keys.size();
+				for (size_t j = 0; j < partials[i].geoms.size(); j++) {
+					weight += partials[i].geoms[j].size();
 				}
+				candidates[partials[i].candidate].weight = weight;
 			}
 		}
 
@@ -2133,40 +2589,33 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 
 			// A complex polygon may have been split up into multiple geometries.
 			// Break them out into multiple features if necessary.
+			// Only the last of them can take over the attributes.
 			for (size_t j = 0; j < pgeoms.size(); j++) {
 				if (t == VT_POINT || draws_something(pgeoms[j])) {
-					struct coalesce c;
+					std::vector<coalesce> &layer_features = layers.layer(partials[i].segment, partials[i].layer, *layer_unmaps);
+					layer_features.emplace_back();
+					struct coalesce &c = layer_features.back();
 
 					c.type = t;
 					c.index = partials[i].index;
-					c.geom = pgeoms[j];
-					pgeoms[j].clear();
+					c.geom = std::move(pgeoms[j]);
 					c.coalesced = false;
 					c.original_seq = original_seq;
 					c.stringpool = stringpool + pool_off[partials[i].segment];
-					c.keys = partials[i].keys;
-					c.values = partials[i].values;
-					c.full_keys = partials[i].full_keys;
-					c.full_values = partials[i].full_values;
+					if (j + 1 == pgeoms.size()) {
+						c.keys = std::move(partials[i].keys);
+						c.values = std::move(partials[i].values);
+						c.full_keys = std::move(partials[i].full_keys);
+						c.full_values = std::move(partials[i].full_values);
+					} else {
+						c.keys = partials[i].keys;
+						c.values = partials[i].values;
+						c.full_keys = partials[i].full_keys;
+						c.full_values = partials[i].full_values;
+					}
 					c.spacing = partials[i].spacing;
 					c.id = partials[i].id;
 					c.has_id = partials[i].has_id;
-
-					// printf("segment %d layer %lld is %s\n", partials[i].segment, partials[i].layer, (*layer_unmaps)[partials[i].segment][partials[i].layer].c_str());
-
-					std::string layername = (*layer_unmaps)[partials[i].segment][partials[i].layer];
-					if (layers.count(layername) == 0) {
-						layers.insert(std::pair<std::string, std::vector<coalesce>>(layername, std::vector<coalesce>()));
-					}
-
-					auto l = layers.find(layername);
-					if (l == layers.end()) {
-						fprintf(stderr, "Internal error: couldn't find layer %s\n", layername.c_str());
-						fprintf(stderr, "segment %d\n", partials[i].segment);
-						fprintf(stderr, "layer %lld\n", partials[i].layer);
-						exit(EXIT_FAILURE);
-					}
-					l->second.push_back(c);
 				}
 			}
 		}
@@ -2176,47 +2625,48 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 		int j;
 		for (j = 0; j < child_shards; j++) {
 			if (within[j]) {
-				serialize_byte(geomfile[j], -2, &geompos[j], fname);
+				// Remember where the child tile began so that the next zoom
+				// can schedule it independently of the rest of the shard
+				arg->tile_starts[j].push_back(childstart[j]);
+
+				serialize_byte(geomfile[j].buf, -2);
 				within[j] = 0;
 			}
 		}
 
-		for (auto layer_iterator = layers.begin(); layer_iterator != layers.end(); ++layer_iterator) {
-			std::vector<coalesce> &layer_features = layer_iterator->second;
+		for (size_t l = 0; l < layers.features.size(); l++) {
+			std::vector<coalesce> &layer_features = layers.features[l];
 
 			if (additional[A_REORDER]) {
 				std::sort(layer_features.begin(), layer_features.end());
 			}
 
-			std::vector<coalesce> out;
-			if (layer_features.size() > 0) {
-				out.push_back(layer_features[0]);
-			}
-			for (size_t x = 1; x < layer_features.size(); x++) {
-				size_t y = out.size() - 1;
-
+			// Coalesce and drop features by compacting the layer in place
+			size_t out = 0;
+			for (size_t x = 0; x < layer_features.size(); x++) {
 #if 0
-				if (out.size() > 0 && coalcmp(&layer_features[x], &out[y]) < 0) {
+				if (out > 0 && coalcmp(&layer_features[x], &layer_features[out - 1]) < 0) {
 					fprintf(stderr, "\nfeature out of order\n");
 				}
 #endif
 
-				if (additional[A_COALESCE] && out.size() > 0 && coalcmp(&layer_features[x], &out[y]) == 0) {
-					for (size_t g = 0; g < layer_features[x].geom.size(); g++) {
-						out[y].geom.push_back(layer_features[x].geom[g]);
-					}
-					out[y].coalesced = true;
+				if (additional[A_COALESCE] && out > 0 && coalcmp(&layer_features[x], &layer_features[out - 1]) == 0) {
+					drawvec &geom = layer_features[out - 1].geom;
+					geom.insert(geom.end(), layer_features[x].geom.begin(), layer_features[x].geom.end());
+					layer_features[out - 1].coalesced = true;
 				} else {
-					out.push_back(layer_features[x]);
+					if (out != x) {
+						layer_features[out] = std::move(layer_features[x]);
+					}
+					out++;
 				}
 			}
+			layer_features.resize(out);
 
-			layer_features = out;
-
-			out.clear();
+			out = 0;
 			for (size_t x = 0; x < layer_features.size(); x++) {
 				if (layer_features[x].coalesced && layer_features[x].type == VT_LINE) {
-					layer_features[x].geom = remove_noop(layer_features[x].geom, layer_features[x].type, 0);
+					remove_noop_in_place(layer_features[x].geom, layer_features[x].type, 0);
 					layer_features[x].geom = simplify_lines(layer_features[x].geom, 32, 0,
 										!(prevent[P_CLIPPING] || prevent[P_DUPLICATION]), simplification, layer_features[x].type == VT_POLYGON ? 4 : 0, shared_nodes);
 				}
@@ -2226,14 +2676,17 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 						layer_features[x].geom = clean_or_clip_poly(layer_features[x].geom, 0, 0, false);
 					}
 
-					layer_features[x].geom = close_poly(layer_features[x].geom);
+					close_poly_in_place(layer_features[x].geom);
 				}
 
 				if (layer_features[x].geom.size() > 0) {
-					out.push_back(layer_features[x]);
+					if (out != x) {
+						layer_features[out] = std::move(layer_features[x]);
+					}
+					out++;
 				}
 			}
-			layer_features = out;
+			layer_features.resize(out);
 
 			if (prevent[P_INPUT_ORDER]) {
 				std::sort(layer_features.begin(), layer_features.end(), preservecmp);
@@ -2242,19 +2695,22 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 
 		mvt_tile tile;
 
-		for (auto layer_iterator = layers.begin(); layer_iterator != layers.end(); ++layer_iterator) {
-			std::vector<coalesce> &layer_features = layer_iterator->second;
+		for (auto layer_iterator = layers.names.begin(); layer_iterator != layers.names.end(); ++layer_iterator) {
+			std::vector<coalesce> &layer_features = layers.features[layer_iterator->second];
 
 			mvt_layer layer;
 			layer.name = layer_iterator->first;
 			layer.version = 2;
 			layer.extent = 1 << line_detail;
 
+			std::swap(layer.tag_tables, arg->tag_tables);
+			layer.tag_tables.clear();
+
 			for (size_t x = 0; x < layer_features.size(); x++) {
 				mvt_feature feature;
 
 				if (layer_features[x].type == VT_LINE || layer_features[x].type == VT_POLYGON) {
-					layer_features[x].geom = remove_noop(layer_features[x].geom, layer_features[x].type, 0);
+					remove_noop_in_place(layer_features[x].geom, layer_features[x].type, 0);
 				}
 
 				if (layer_features[x].geom.size() == 0) {
@@ -2271,7 +2727,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 
 				decode_meta(layer_features[x].keys, layer_features[x].values, layer_features[x].stringpool, layer, feature);
 				for (size_t a = 0; a < layer_features[x].full_keys.size(); a++) {
-					serial_val sv = layer_features[x].full_values[a];
+					serial_val const &sv = layer_features[x].full_values[a];
 					mvt_value v = stringified_to_mvt_value(sv.type, sv.s.c_str());
 					layer.tag(feature, layer_features[x].full_keys[a], v);
 				}
@@ -2297,11 +2753,14 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 					add_tilestats(layer.name, z, layermaps, tiling_seg, layer_unmaps, "tippecanoe_feature_density", sv);
 				}
 
-				layer.features.push_back(feature);
+				layer.features.push_back(std::move(feature));
 			}
 
+			// Nothing more will be tagged in this layer
+			std::swap(layer.tag_tables, arg->tag_tables);
+
 			if (layer.features.size() > 0) {
-				tile.layers.push_back(layer);
+				tile.layers.push_back(std::move(layer));
 			}
 		}
 
@@ -2315,9 +2774,8 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 		}
 
 		size_t totalsize = 0;
-		for (auto layer_iterator = layers.begin(); layer_iterator != layers.end(); ++layer_iterator) {
-			std::vector<coalesce> &layer_features = layer_iterator->second;
-			totalsize += layer_features.size();
+		for (size_t l = 0; l < layers.features.size(); l++) {
+			totalsize += layers.features[l].size();
 		}
 
 		double progress = floor(((((*geompos_in + *along - alongminus) / (double) todo) + (pass - (2 - passes))) / passes + z) / (maxzoom + 1) * 1000) / 10;
@@ -2358,6 +2816,20 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 					}
 					line_detail++;  // to keep it the same when the loop decrements it
 					continue;
+				} else if (predicting && mingap < ULONG_MAX && (additional[A_DROP_DENSEST_AS_NEEDED] || additional[A_COALESCE_DENSEST_AS_NEEDED] || additional[A_CLUSTER_DENSEST_AS_NEEDED])) {
+					double kept = kept_by_mingap(candidates, mingap, true, 1);
+					double target = kept * max_tile_features / totalsize * 0.95;
+					mingap = solve_mingap(candidates, mingap, target, true);
+					predicted = true;
+					if (mingap > arg->mingap_out) {
+						arg->mingap_out = mingap;
+						arg->still_dropping = true;
+					}
+					if (!quiet) {
+						fprintf(stderr, "Going to try keeping the sparsest %0.2f%% of the features to make it fit\n", target * 100.0 / candidates.size());
+					}
+					line_detail++;
+					continue;
 				} else if (mingap < ULONG_MAX && (additional[A_DROP_DENSEST_AS_NEEDED] || additional[A_COALESCE_DENSEST_AS_NEEDED] || additional[A_CLUSTER_DENSEST_AS_NEEDED])) {
 					mingap_fraction = mingap_fraction * max_tile_features / totalsize * 0.90;
 					unsigned long long mg = choose_mingap(indices, mingap_fraction);
@@ -2378,6 +2850,31 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 					}
 					line_detail++;
 					continue;
+				} else if (predicting && (additional[A_DROP_SMALLEST_AS_NEEDED] || additional[A_COALESCE_SMALLEST_AS_NEEDED])) {
+					double kept = kept_by_mingap(candidates, 0, true, 1);
+					double target = kept * max_tile_features / totalsize * 0.95;
+					long long m = solve_minextent(candidates, minextent, target, true);
+					double percent = target * 100.0 / candidates.size();
+					predicted = true;
+					if (m <= minextent) {
+						// The prediction can't get past the current extent, so
+						// shrink the fraction the way the unpredicted retry does
+						minextent_fraction = minextent_fraction * max_tile_features / totalsize * 0.90;
+						m = choose_minextent(extents, minextent_fraction);
+						percent = minextent_fraction * 100.0;
+					}
+					if (m != minextent) {
+						minextent = m;
+						if (minextent > arg->minextent_out) {
+							arg->minextent_out = minextent;
+							arg->still_dropping = true;
+						}
+						if (!quiet) {
+							fprintf(stderr, "Going to try keeping the biggest %0.2f%% of the features to make it fit\n", percent);
+						}
+						line_detail++;
+						continue;
+					}
 				} else if (additional[A_DROP_SMALLEST_AS_NEEDED] || additional[A_COALESCE_SMALLEST_AS_NEEDED]) {
 					minextent_fraction = minextent_fraction * max_tile_features / totalsize * 0.90;
 					long long m = choose_minextent(extents, minextent_fraction);
@@ -2393,7 +2890,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 						line_detail++;
 						continue;
 					}
-				} else if (totalsize > layers.size() && (prevent[P_DYNAMIC_DROP] || additional[A_DROP_FRACTION_AS_NEEDED] || additional[A_COALESCE_FRACTION_AS_NEEDED])) {
+				} else if (totalsize > layers.names.size() && (prevent[P_DYNAMIC_DROP] || additional[A_DROP_FRACTION_AS_NEEDED] || additional[A_COALESCE_FRACTION_AS_NEEDED])) {
 					// The 95% is a guess to avoid too many retries
 					// and probably actually varies based on how much duplicated metadata there is
 
@@ -2416,21 +2913,48 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 			}
 
 			std::string compressed;
-			std::string pbf = tile.encode();
-
-			if (!prevent[P_TILE_COMPRESSION]) {
-				compress(pbf, compressed);
-			} else {
-				compressed = pbf;
+			size_t compressed_size = 0;
+			bool estimated = false;
+			int tried_detail = line_detail;
+
+			// Tiles that are sure to be too big skip straight to the retry
+			// without being encoded and compressed. Without compression the
+			// size computed from the tile is exact.
+			if (!prevent[P_KILOBYTE_LIMIT] && (prevent[P_TILE_COMPRESSION] || additional[A_ESTIMATE_TILE_SIZE])) {
+				size_t pbf_size = tile.encoded_size();
+
+				if (prevent[P_TILE_COMPRESSION]) {
+					if (pbf_size > max_tile_size) {
+						compressed_size = pbf_size;
+					}
+				} else if (additional[A_ESTIMATE_TILE_SIZE] && !must_compress) {
+					compressed_size = predict_oversize(z, pbf_size, max_tile_size);
+					estimated = compressed_size != 0;
+				}
 			}
+			must_compress = false;
 
-			if (compressed.size() > max_tile_size && !prevent[P_KILOBYTE_LIMIT]) {
+			if (compressed_size == 0) {
+				std::string &pbf = arg->pbf;
+				tile.encode(pbf);
+
+				if (!prevent[P_TILE_COMPRESSION]) {
+					compress(pbf, compressed, tile_compression_level);
+					observe_compression(z, pbf.size(), compressed.size());
+				} else {
+					compressed = pbf;
+				}
+
+				compressed_size = compressed.size();
+			}
+
+			if (compressed_size > max_tile_size && !prevent[P_KILOBYTE_LIMIT]) {
 				if (!quiet) {
-					fprintf(stderr, "tile %d/%u/%u size is %lld with detail %d, >%zu    \n", z, tx, ty, (long long) compressed.size(), line_detail, max_tile_size);
+					fprintf(stderr, "tile %d/%u/%u size is %lld with detail %d, >%zu    \n", z, tx, ty, (long long) compressed_size, line_detail, max_tile_size);
 				}
 
 				if (has_polygons && additional[A_MERGE_POLYGONS_AS_NEEDED] && merge_fraction > .05 && merge_successful) {
-					merge_fraction = merge_fraction * max_tile_size / compressed.size() * 0.95;
+					merge_fraction = merge_fraction * max_tile_size / compressed_size * 0.95;
 					if (!quiet) {
 						fprintf(stderr, "Going to try merging %0.2f%% of the polygons to make it fit\n", 100 - merge_fraction * 100);
 					}
@@ -2451,8 +2975,22 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 						fprintf(stderr, "Going to try gamma of %0.3f to make it fit\n", gamma);
 					}
 					line_detail++;  // to keep it the same when the loop decrements it
+				} else if (predicting && mingap < ULONG_MAX && (additional[A_DROP_DENSEST_AS_NEEDED] || additional[A_COALESCE_DENSEST_AS_NEEDED] || additional[A_CLUSTER_DENSEST_AS_NEEDED])) {
+					double average = average_weight(candidates);
+					double kept = kept_by_mingap(candidates, mingap, false, average);
+					double target = kept * max_tile_size / compressed_size * 0.95;
+					mingap = solve_mingap(candidates, mingap, target, false);
+					predicted = true;
+					if (mingap > arg->mingap_out) {
+						arg->mingap_out = mingap;
+						arg->still_dropping = true;
+					}
+					if (!quiet) {
+						fprintf(stderr, "Going to try keeping the sparsest %0.2f%% of the feature data to make it fit\n", target * 100.0 / kept_by_mingap(candidates, 0, false, average));
+					}
+					line_detail++;
 				} else if (mingap < ULONG_MAX && (additional[A_DROP_DENSEST_AS_NEEDED] || additional[A_COALESCE_DENSEST_AS_NEEDED] || additional[A_CLUSTER_DENSEST_AS_NEEDED])) {
-					mingap_fraction = mingap_fraction * max_tile_size / compressed.size() * 0.90;
+					mingap_fraction = mingap_fraction * max_tile_size / compressed_size * 0.90;
 					unsigned long long mg = choose_mingap(indices, mingap_fraction);
 					if (mg <= mingap) {
 						double nmg = (mingap + 1) * 1.5;
@@ -2476,8 +3014,34 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 						fprintf(stderr, "Going to try keeping the sparsest %0.2f%% of the features to make it fit\n", mingap_fraction * 100.0);
 					}
 					line_detail++;
+				} else if (predicting && (additional[A_DROP_SMALLEST_AS_NEEDED] || additional[A_COALESCE_SMALLEST_AS_NEEDED])) {
+					double average = average_weight(candidates);
+					double kept = kept_by_mingap(candidates, 0, false, average);
+					double target = kept * max_tile_size / compressed_size * 0.95;
+					long long m = solve_minextent(candidates, minextent, target, false);
+					double percent = target * 100.0 / kept;
+					predicted = true;
+					if (m <= minextent) {
+						// The prediction can't get past the current extent, so
+						// shrink the fraction the way the unpredicted retry does
+						minextent_fraction = minextent_fraction * max_tile_size / compressed_size * 0.90;
+						m = choose_minextent(extents, minextent_fraction);
+						percent = minextent_fraction * 100.0;
+					}
+					if (m != minextent) {
+						minextent = m;
+						if (minextent > arg->minextent_out) {
+							arg->minextent_out = minextent;
+							arg->still_dropping = true;
+						}
+						if (!quiet) {
+							fprintf(stderr, "Going to try keeping the biggest %0.2f%% of the feature data to make it fit\n", percent);
+						}
+						line_detail++;
+						continue;
+					}
 				} else if (additional[A_DROP_SMALLEST_AS_NEEDED] || additional[A_COALESCE_SMALLEST_AS_NEEDED]) {
-					minextent_fraction = minextent_fraction * max_tile_size / compressed.size() * 0.90;
+					minextent_fraction = minextent_fraction * max_tile_size / compressed_size * 0.90;
 					long long m = choose_minextent(extents, minextent_fraction);
 					if (m != minextent) {
 						minextent = m;
@@ -2491,11 +3055,11 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 						line_detail++;
 						continue;
 					}
-				} else if (totalsize > layers.size() && (prevent[P_DYNAMIC_DROP] || additional[A_DROP_FRACTION_AS_NEEDED] || additional[A_COALESCE_FRACTION_AS_NEEDED])) {
+				} else if (totalsize > layers.names.size() && (prevent[P_DYNAMIC_DROP] || additional[A_DROP_FRACTION_AS_NEEDED] || additional[A_COALESCE_FRACTION_AS_NEEDED])) {
 					// The 95% is a guess to avoid too many retries
 					// and probably actually varies based on how much duplicated metadata there is
 
-					fraction = fraction * max_tile_size / compressed.size() * 0.95;
+					fraction = fraction * max_tile_size / compressed_size * 0.95;
 					if (!quiet) {
 						fprintf(stderr, "Going to try keeping %0.2f%% of the features to make it fit\n", fraction * 100);
 					}
@@ -2507,23 +3071,16 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 					}
 					line_detail++;  // to keep it the same when the loop decrements it
 				}
+
+				if (estimated && line_detail == tried_detail) {
+					// Don't lower the detail, or give up, only on the strength of
+					// an estimate. Try again at the same detail, compressing for real.
+					must_compress = true;
+					line_detail++;
+				}
 			} else {
 				if (pass == 1) {
-					if (pthread_mutex_lock(&db_lock) != 0) {
-						perror("pthread_mutex_lock");
-						exit(EXIT_FAILURE);
-					}
-
-					if (outdb != NULL) {
-						mbtiles_write_tile(outdb, z, tx, ty, compressed.data(), compressed.size());
-					} else if (outdir != NULL) {
-						dir_write_tile(outdir, z, tx, ty, compressed);
-					}
-
-					if (pthread_mutex_unlock(&db_lock) != 0) {
-						perror("pthread_mutex_unlock");
-						exit(EXIT_FAILURE);
-					}
+					mbtiles_writer_write(writer, z, tx, ty, std::move(compressed));
 				}
 
 				return count;
@@ -2537,117 +3094,725 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 	return -1;
 }
 
+// A contiguous run of whole tiles within one geometry shard.
+// This is the unit of work that tiling threads take from their own
+// queue, or steal from another thread's queue once theirs is empty.
 struct task {
 	int fileno = 0;
-	struct task *next = NULL;
+	long long start = 0;
+	long long end = 0;
 };
 
-void *run_thread(void *vargs) {
-	write_tile_args *arg = (write_tile_args *) vargs;
-	struct task *task;
+struct task_queue {
+	pthread_mutex_t lock;
+	std::deque<task> tasks;
+};
+
+// Create an unlinked temporary file to receive one shard of the next zoom's geometry
+static FILE *open_shard(const char *tmpdir, size_t j, int *fd) {
+	char geomname[strlen(tmpdir) + strlen("/geom.XXXXXXXX" XSTRINGIFY(INT_MAX)) + 1];
+	sprintf(geomname, "%s/geom%zu.XXXXXXXX", tmpdir, j);
+	*fd = mkstemp_cloexec(geomname);
+	// printf("%s\n", geomname);
+	if (*fd < 0) {
+		perror(geomname);
+		exit(EXIT_FAILURE);
+	}
+	FILE *f = fopen_oflag(geomname, "wb", O_WRONLY | O_CLOEXEC);
+	if (f == NULL) {
+		perror(geomname);
+		exit(EXIT_FAILURE);
+	}
+	unlink(geomname);
+	return f;
+}
+
+// Map a finished shard into memory so that any thread can read
+// any range of tiles from it independently.
+static char *map_shard(int fd, off_t size) {
+	if (size == 0) {
+		return NULL;
+	}
+
+	char *map = (char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap geom");
+		exit(EXIT_FAILURE);
+	}
+	madvise(map, size, MADV_SEQUENTIAL);
+	return map;
+}
 
-	for (task = arg->tasks; task != NULL; task = task->next) {
-		int j = task->fileno;
+// Cut a shard into tasks of whole tiles, each at least task_size bytes
+// unless it is the last one in the shard.
+static void split_shard(size_t j, std::vector<long long> const &starts, long long size, long long task_size, std::vector<struct task> &tasks) {
+	if (size == 0) {
+		return;
+	}
 
-		if (arg->geomfd[j] < 0) {
-			// only one source file for zoom level 0
+	if (starts.size() == 0 || starts[0] != 0) {
+		fprintf(stderr, "Internal error: shard %zu has no tile at its start\n", j);
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t k = 0; k < starts.size();) {
+		struct task t;
+		t.fileno = j;
+		t.start = starts[k];
+
+		for (k++; k < starts.size() && starts[k] - t.start < task_size; k++) {
 			continue;
 		}
-		if (arg->geom_size[j] == 0) {
-			continue;
+
+		if (k < starts.size()) {
+			t.end = starts[k];
+		} else {
+			t.end = size;
 		}
 
-		// printf("%lld of geom_size\n", (long long) geom_size[j]);
+		tasks.push_back(t);
+	}
+}
+
+// Take the next task from the front of this thread's own queue, or if that
+// is empty, steal one from the back of some other thread's queue.
+// Each child tile is written in full by whichever thread tiles its parent,
+// into that thread's own child shards, so tiles can move freely between threads.
+static bool next_task(write_tile_args *arg, task *out) {
+	std::vector<task_queue> &queues = *arg->queues;
+
+	for (size_t i = 0; i < queues.size(); i++) {
+		size_t which = (arg->queue + i) % queues.size();
+		task_queue &q = queues[which];
+		bool found = false;
 
-		FILE *geom = fdopen(arg->geomfd[j], "rb");
-		if (geom == NULL) {
-			perror("mmap geom");
+		if (pthread_mutex_lock(&q.lock) != 0) {
+			perror("pthread_mutex_lock");
 			exit(EXIT_FAILURE);
 		}
 
-		std::atomic<long long> geompos(0);
-		long long prevgeom = 0;
+		if (q.tasks.size() > 0) {
+			if (i == 0) {
+				*out = q.tasks.front();
+				q.tasks.pop_front();
+			} else {
+				*out = q.tasks.back();
+				q.tasks.pop_back();
+			}
+			found = true;
+		}
 
-		while (1) {
-			int z;
-			unsigned x, y;
+		if (pthread_mutex_unlock(&q.lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_FAILURE);
+		}
 
-			if (!deserialize_int_io(geom, &z, &geompos)) {
-				break;
-			}
-			deserialize_uint_io(geom, &x, &geompos);
-			deserialize_uint_io(geom, &y, &geompos);
+		if (found) {
+			return true;
+		}
+	}
 
-			arg->wrote_zoom = z;
+	return false;
+}
 
-			// fprintf(stderr, "%d/%u/%u\n", z, x, y);
+// Tile each of the tiles in one task, writing their children into this
+// thread's child shards. Returns false if some tile could not be made to fit.
+static bool run_task(write_tile_args *arg, struct task const &task, char *geommap) {
+	// Features are decoded straight out of the mapped shard. The offset is
+	// private to this thread and only added to the shared progress count
+	// between tiles.
+	char *geom = geommap + task.start;
+	long long geomlen = task.end - task.start;
+	long long geompos = 0;
+	long long prevgeom = 0;
 
-			long long len = write_tile(geom, &geompos, arg->metabase, arg->stringpool, z, x, y, z == arg->maxzoom ? arg->full_detail : arg->low_detail, arg->min_detail, arg->outdb, arg->outdir, arg->buffer, arg->fname, arg->geomfile, arg->minzoom, arg->maxzoom, arg->todo, arg->along, geompos, arg->gamma, arg->child_shards, arg->meta_off, arg->pool_off, arg->initial_x, arg->initial_y, arg->running, arg->simplification, arg->layermaps, arg->layer_unmaps, arg->tiling_seg, arg->pass, arg->passes, arg->mingap, arg->minextent, arg->fraction, arg->prefilter, arg->postfilter, arg->filter, arg);
+	while (geompos < geomlen) {
+		int z;
+		unsigned x, y;
 
-			if (len < 0) {
-				int *err = &arg->err;
-				*err = z - 1;
-				return err;
-			}
+		char *header = geom + geompos;
+		deserialize_int(&header, &z);
+		deserialize_uint(&header, &x);
+		deserialize_uint(&header, &y);
+		geompos = header - geom;
 
-			if (pthread_mutex_lock(&var_lock) != 0) {
-				perror("pthread_mutex_lock");
-				exit(EXIT_FAILURE);
-			}
+		arg->wrote_zoom = z;
+
+		// fprintf(stderr, "%d/%u/%u\n", z, x, y);
+
+		long long len = write_tile(geom, &geompos, arg->metabase, arg->stringpool, z, x, y, z == arg->maxzoom ? arg->full_detail : arg->low_detail, arg->min_detail, arg->writer, arg->buffer, arg->fname, arg->geomfile, arg->minzoom, arg->maxzoom, arg->todo, arg->along, geompos, arg->gamma, arg->child_shards, arg->meta_off, arg->pool_off, arg->initial_x, arg->initial_y, arg->running, arg->simplification, arg->layermaps, arg->layer_unmaps, arg->tiling_seg, arg->pass, arg->passes, arg->mingap, arg->minextent, arg->fraction, arg->prefilter, arg->postfilter, arg->filter, arg);
+
+		if (len < 0) {
+			arg->err = z - 1;
+			return false;
+		}
+
+		if (pthread_mutex_lock(&var_lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_FAILURE);
+		}
+
+		if (z == arg->maxzoom) {
+			if (len > *arg->most) {
+				*arg->midx = x;
+				*arg->midy = y;
+				*arg->most = len;
+			} else if (len == *arg->most) {
+				unsigned long long a = (((unsigned long long) x) << 32) | y;
+				unsigned long long b = (((unsigned long long) *arg->midx) << 32) | *arg->midy;
 
-			if (z == arg->maxzoom) {
-				if (len > *arg->most) {
+				if (a < b) {
 					*arg->midx = x;
 					*arg->midy = y;
 					*arg->most = len;
-				} else if (len == *arg->most) {
-					unsigned long long a = (((unsigned long long) x) << 32) | y;
-					unsigned long long b = (((unsigned long long) *arg->midx) << 32) | *arg->midy;
-
-					if (a < b) {
-						*arg->midx = x;
-						*arg->midy = y;
-						*arg->most = len;
-					}
 				}
 			}
+		}
 
-			*arg->along += geompos - prevgeom;
-			prevgeom = geompos;
+		*arg->along += geompos - prevgeom;
+		prevgeom = geompos;
 
-			if (pthread_mutex_unlock(&var_lock) != 0) {
-				perror("pthread_mutex_unlock");
+		if (pthread_mutex_unlock(&var_lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return true;
+}
+
+void *run_thread(void *vargs) {
+	write_tile_args *arg = (write_tile_args *) vargs;
+	struct task task;
+
+	while (next_task(arg, &task)) {
+		if (!run_task(arg, task, arg->geommap[task.fileno])) {
+			arg->running--;
+			partial_pool_wake();
+			return &arg->err;
+		}
+	}
+
+	arg->running--;
+	partial_pool_wake();
+	return NULL;
+}
+
+// With --pipeline-zooms, the shards of each zoom level are a "generation."
+// Each tiling thread writes the next generation's data into its own slice
+// of that generation's shards, and as soon as a thread can no longer receive
+// any more work from the current generation, its slice of the next one is
+// finished and its tiles are queued, while other threads are still working
+// through the long tail of the current zoom.
+
+struct generation {
+	std::vector<shard_writer> sub;
+	std::vector<int> subfd;
+	std::vector<char *> geommap;
+	std::vector<off_t> geom_size;
+	std::vector<std::vector<long long>> tile_starts;
+	std::vector<std::deque<struct task>> queues;  // one per thread
+	std::vector<bool> finished;		      // whether each thread's slice has been queued
+	size_t slices_finished = 0;
+	size_t queued = 0;
+	long long todo = 0;
+	std::atomic<long long> along;
+
+	generation()
+	    : along(0) {
+	}
+};
+
+struct pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	std::deque<generation> gens;
+	size_t gen_base = 0;		// generation number of gens[0]
+	std::vector<ssize_t> current;	// generation each thread is working on, or -1
+	size_t threads = 0;
+	size_t shards = 0;  // in each generation after the first
+	size_t child_shards = 0;
+	const char *tmpdir = NULL;
+	const char *fname = NULL;
+	int err = INT_MAX;
+};
+
+static void pipeline_add_generation(pipeline *p) {
+	p->gens.emplace_back();
+	generation &g = p->gens.back();
+
+	g.sub.resize(p->shards);
+	g.subfd.resize(p->shards);
+	g.geommap.resize(p->shards);
+	g.geom_size.resize(p->shards);
+	g.tile_starts.resize(p->shards);
+	g.queues.resize(p->threads);
+	g.finished.resize(p->threads);
+
+	for (size_t j = 0; j < p->shards; j++) {
+		g.sub[j].fp = open_shard(p->tmpdir, j, &g.subfd[j]);
+		g.geommap[j] = NULL;
+		g.geom_size[j] = 0;
+	}
+	for (size_t t = 0; t < p->threads; t++) {
+		g.finished[t] = false;
+	}
+}
+
+// Close one thread's slice of a generation's shards and queue its tiles.
+// Called with the pipeline locked.
+static void pipeline_finish_slice(pipeline *p, generation &g, size_t thread, long long task_size) {
+	std::vector<struct task> tasks;
+
+	for (size_t j = thread * p->child_shards; j < (thread + 1) * p->child_shards; j++) {
+		shard_close(&g.sub[j], p->fname);
+
+		struct stat geomst;
+		if (fstat(g.subfd[j], &geomst) != 0) {
+			perror("stat geom\n");
+			exit(EXIT_FAILURE);
+		}
+
+		g.geom_size[j] = geomst.st_size;
+		g.geommap[j] = map_shard(g.subfd[j], g.geom_size[j]);
+		g.todo += g.geom_size[j];
+
+		if (close(g.subfd[j]) != 0) {
+			perror("close geom");
+			exit(EXIT_FAILURE);
+		}
+		g.subfd[j] = -1;
+
+		split_shard(j, g.tile_starts[j], g.geom_size[j], task_size, tasks);
+	}
+
+	for (size_t k = 0; k < tasks.size(); k++) {
+		g.queues[thread].push_back(tasks[k]);
+	}
+	g.queued += tasks.size();
+
+	g.finished[thread] = true;
+	g.slices_finished++;
+}
+
+static void pipeline_release_generation(generation &g) {
+	for (size_t j = 0; j < g.sub.size(); j++) {
+		if (g.sub[j].fp != NULL) {
+			if (fclose(g.sub[j].fp) != 0) {
+				perror("close subfile");
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (g.subfd[j] >= 0) {
+			if (close(g.subfd[j]) != 0) {
+				perror("close geom");
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (g.geommap[j] != NULL) {
+			if (munmap(g.geommap[j], g.geom_size[j]) != 0) {
+				perror("munmap geom");
 				exit(EXIT_FAILURE);
 			}
 		}
+	}
+}
 
-		if (arg->pass == 1) {
-			// Since the fclose() has closed the underlying file descriptor
-			arg->geomfd[j] = -1;
-		} else {
-			int newfd = dup(arg->geomfd[j]);
-			if (newfd < 0) {
-				perror("dup geometry");
+// Finish every slice that can no longer receive any data, and release
+// generations that nothing can read from any more.
+// Called with the pipeline locked.
+static void pipeline_advance(pipeline *p) {
+	for (size_t g = 0; g + 1 < p->gens.size(); g++) {
+		generation &from = p->gens[g];
+		generation &to = p->gens[g + 1];
+
+		if (from.slices_finished < p->threads || from.queued > 0) {
+			continue;
+		}
+
+		long long task_size = from.todo / (p->threads * 16);
+		if (task_size < 1) {
+			task_size = 1;
+		}
+
+		for (size_t t = 0; t < p->threads; t++) {
+			if (!to.finished[t] && p->current[t] != (ssize_t) (p->gen_base + g)) {
+				pipeline_finish_slice(p, to, t, task_size);
+			}
+		}
+	}
+
+	while (p->gens.size() > 1 && p->gens[1].slices_finished == p->threads) {
+		pipeline_release_generation(p->gens[0]);
+		p->gens.pop_front();
+		p->gen_base++;
+	}
+}
+
+// Find a task from the oldest generation that has one, preferring
+// this thread's own queue and otherwise stealing from another's.
+// A generation's tiles can't be taken while they would need a new generation
+// to be opened for their children and two are already open.
+// Called with the pipeline locked.
+static bool pipeline_next_task(pipeline *p, size_t thread, size_t *gen, struct task *out) {
+	// Only two generations' worth of shards fit in the file descriptor budget
+	size_t open = 0;
+	for (size_t g = 0; g < p->gens.size(); g++) {
+		if (p->gens[g].slices_finished < p->threads) {
+			open++;
+		}
+	}
+
+	for (size_t g = 0; g < p->gens.size(); g++) {
+		generation &from = p->gens[g];
+
+		if (from.queued == 0) {
+			continue;
+		}
+		if (g + 1 == p->gens.size() && open >= 2) {
+			continue;  // would have to open another generation
+		}
+
+		for (size_t i = 0; i < p->threads; i++) {
+			std::deque<struct task> &q = from.queues[(thread + i) % p->threads];
+
+			if (q.size() > 0) {
+				if (i == 0) {
+					*out = q.front();
+					q.pop_front();
+				} else {
+					*out = q.back();
+					q.pop_back();
+				}
+
+				from.queued--;
+				*gen = g;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+static bool pipeline_done(pipeline *p) {
+	for (size_t t = 0; t < p->threads; t++) {
+		if (p->current[t] >= 0) {
+			return false;
+		}
+	}
+
+	for (size_t g = 0; g < p->gens.size(); g++) {
+		if (p->gens[g].slices_finished < p->threads || p->gens[g].queued > 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static unsigned long long cluster_mingap(int z) {
+	return ((1LL << (32 - z)) / 256 * cluster_distance) * ((1LL << (32 - z)) / 256 * cluster_distance);
+}
+
+void *run_pipeline_thread(void *vargs) {
+	write_tile_args *arg = (write_tile_args *) vargs;
+	pipeline *p = arg->pipeline;
+	size_t thread = arg->queue;
+
+	if (pthread_mutex_lock(&p->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+
+	while (p->err == INT_MAX) {
+		pipeline_advance(p);
+
+		size_t g;
+		struct task task;
+
+		if (pipeline_next_task(p, thread, &g, &task)) {
+			// The next generation has to exist before anything can be written to it
+			if (g + 1 == p->gens.size()) {
+				pipeline_add_generation(p);
+			}
+
+			generation &from = p->gens[g];
+			generation &to = p->gens[g + 1];
+			p->current[thread] = p->gen_base + g;
+
+			char *geommap = from.geommap[task.fileno];
+			char *header = geommap + task.start;
+			int z;
+			deserialize_int(&header, &z);
+
+			arg->geomfile = &to.sub[thread * p->child_shards];
+			arg->tile_starts = &to.tile_starts[thread * p->child_shards];
+			arg->todo = from.todo;
+			arg->along = &from.along;
+			arg->mingap = cluster_mingap(z);
+			arg->mingap_out = arg->mingap;
+
+			if (pthread_mutex_unlock(&p->lock) != 0) {
+				perror("pthread_mutex_unlock");
 				exit(EXIT_FAILURE);
 			}
-			if (lseek(newfd, 0, SEEK_SET) < 0) {
-				perror("lseek geometry");
+
+			bool ok = run_task(arg, task, geommap);
+
+			if (pthread_mutex_lock(&p->lock) != 0) {
+				perror("pthread_mutex_lock");
+				exit(EXIT_FAILURE);
+			}
+
+			p->current[thread] = -1;
+			if (!ok && arg->err < p->err) {
+				p->err = arg->err;
+			}
+
+			if (pthread_cond_broadcast(&p->cond) != 0) {
+				perror("pthread_cond_broadcast");
 				exit(EXIT_FAILURE);
 			}
-			arg->geomfd[j] = newfd;
+			continue;
 		}
 
-		if (fclose(geom) != 0) {
-			perror("close geom");
+		if (pipeline_done(p)) {
+			break;
+		}
+
+		arg->running--;
+		partial_pool_wake();
+		if (pthread_cond_wait(&p->cond, &p->lock) != 0) {
+			perror("pthread_cond_wait");
 			exit(EXIT_FAILURE);
 		}
+		arg->running++;
+	}
+
+	if (pthread_cond_broadcast(&p->cond) != 0) {
+		perror("pthread_cond_broadcast");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pthread_mutex_unlock(&p->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
 	}
 
 	arg->running--;
+	partial_pool_wake();
 	return NULL;
 }
 
-int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpool, std::atomic<unsigned> *midx, std::atomic<unsigned> *midy, int &maxzoom, int minzoom, sqlite3 *outdb, const char *outdir, int buffer, const char *fname, const char *tmpdir, double gamma, int full_detail, int low_detail, int min_detail, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, double simplification, std::vector<std::map<std::string, layermap_entry>> &layermaps, const char *prefilter, const char *postfilter, std::map<std::string, attribute_op> const *attribute_accum, struct json_object *filter) {
+// How many file descriptors this process has open
+static long long count_open_files() {
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+		perror("getrlimit");
+		exit(EXIT_FAILURE);
+	}
+
+	// Descriptors are allocated lowest first, so anything open
+	// is almost certainly well below this
+	long long limit = rl.rlim_cur;
+	if (limit > 65536) {
+		limit = 65536;
+	}
+
+	long long open = 0;
+	for (long long fd = 0; fd < limit; fd++) {
+		if (fcntl(fd, F_GETFD) != -1) {
+			open++;
+		}
+	}
+
+	return open;
+}
+
+static int traverse_zooms_pipelined(int *geomfd, off_t *geom_size, char *metabase, char *stringpool, std::atomic<unsigned> *midx, std::atomic<unsigned> *midy, int maxzoom, int minzoom, mbtiles_writer *writer, int buffer, const char *fname, const char *tmpdir, double gamma, int full_detail, int low_detail, int min_detail, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, double simplification, std::vector<std::map<std::string, layermap_entry>> &layermaps, size_t layermaps_off, std::vector<std::vector<std::string>> &layer_unmaps, const char *prefilter, const char *postfilter, std::map<std::string, attribute_op> const *attribute_accum, struct json_object *filter) {
+	pipeline p;
+	p.tmpdir = tmpdir;
+	p.fname = fname;
+
+	// Each generation gets as many shards as the unpipelined tiling would use,
+	// if that fits in the file descriptors that are still free. Two generations
+	// can be open for writing at once, while the one before them is still being
+	// tiled, and each shard being written takes two descriptors.
+	p.shards = CPUS * 4;
+	long long headroom = MAX_FILES - count_open_files();
+	if ((long long) p.shards > headroom / 4) {
+		p.shards = headroom / 4;
+	}
+	if (p.shards < 4) {
+		p.shards = 4;  // the least that one thread can work with
+	}
+
+	// The thread count, and with it the number of child shards per thread,
+	// has to stay the same from one generation to the next.
+	p.threads = CPUS;
+	if (p.threads > p.shards / 4) {
+		p.threads = p.shards / 4;
+	}
+	for (int e = 0; e < 30; e++) {
+		if (p.threads >= (1U << e) && p.threads < (1U << (e + 1))) {
+			p.threads = 1U << e;
+			break;
+		}
+	}
+	if (p.threads < 1) {
+		p.threads = 1;
+	}
+	if (p.threads < CPUS && !quiet) {
+		fprintf(stderr, "Warning: only enough file descriptors to pipeline zoom levels with %zu of %zu threads\n", p.threads, CPUS);
+	}
+	p.child_shards = p.shards / p.threads;
+	for (int e = 0; e < 30; e++) {
+		if (p.child_shards >= (1U << e) && p.child_shards < (1U << (e + 1))) {
+			p.child_shards = 1U << e;
+			break;
+		}
+	}
+	p.shards = p.child_shards * p.threads;
+	p.current.resize(p.threads);
+	for (size_t t = 0; t < p.threads; t++) {
+		p.current[t] = -1;
+	}
+
+	if (pthread_mutex_init(&p.lock, NULL) != 0) {
+		perror("pthread_mutex_init");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_cond_init(&p.cond, NULL) != 0) {
+		perror("pthread_cond_init");
+		exit(EXIT_FAILURE);
+	}
+
+	// The initial generation is the single tile that has already been written
+	p.gens.emplace_back();
+	generation &first = p.gens.back();
+	first.sub.resize(TEMP_FILES);
+	first.subfd.resize(TEMP_FILES);
+	first.geommap.resize(TEMP_FILES);
+	first.geom_size.resize(TEMP_FILES);
+	first.queues.resize(p.threads);
+	first.finished.resize(p.threads);
+
+	for (size_t j = 0; j < TEMP_FILES; j++) {
+		first.subfd[j] = -1;
+		first.geom_size[j] = geom_size[j];
+		first.geommap[j] = map_shard(geomfd[j], geom_size[j]);
+		first.todo += geom_size[j];
+
+		if (geomfd[j] >= 0) {
+			if (close(geomfd[j]) != 0) {
+				perror("close geom");
+				exit(EXIT_FAILURE);
+			}
+			geomfd[j] = -1;
+		}
+
+		if (geom_size[j] > 0) {
+			struct task t;
+			t.fileno = j;
+			t.start = 0;
+			t.end = geom_size[j];
+			first.queues[0].push_back(t);
+			first.queued++;
+		}
+	}
+	for (size_t t = 0; t < p.threads; t++) {
+		first.finished[t] = true;
+	}
+	first.slices_finished = p.threads;
+
+	std::atomic<long long> most(0);
+	std::atomic<int> running(p.threads);
+	pthread_t pthreads[p.threads];
+	std::vector<write_tile_args> args;
+	args.resize(p.threads);
+
+	for (size_t thread = 0; thread < p.threads; thread++) {
+		args[thread].metabase = metabase;
+		args[thread].stringpool = stringpool;
+		args[thread].min_detail = min_detail;
+		args[thread].writer = writer;
+		args[thread].buffer = buffer;
+		args[thread].fname = fname;
+		args[thread].gamma = gamma;
+		args[thread].gamma_out = gamma;
+		args[thread].minextent = 0;
+		args[thread].minextent_out = 0;
+		args[thread].fraction = 1;
+		args[thread].fraction_out = 1;
+		args[thread].child_shards = p.child_shards;
+		args[thread].simplification = simplification;
+
+		args[thread].midx = midx;  // locked with var_lock
+		args[thread].midy = midy;  // locked with var_lock
+		args[thread].maxzoom = maxzoom;
+		args[thread].minzoom = minzoom;
+		args[thread].full_detail = full_detail;
+		args[thread].low_detail = low_detail;
+		args[thread].most = &most;  // locked with var_lock
+		args[thread].meta_off = meta_off;
+		args[thread].pool_off = pool_off;
+		args[thread].initial_x = initial_x;
+		args[thread].initial_y = initial_y;
+		args[thread].layermaps = &layermaps;
+		args[thread].layer_unmaps = &layer_unmaps;
+		args[thread].tiling_seg = thread + layermaps_off;
+		args[thread].prefilter = prefilter;
+		args[thread].postfilter = postfilter;
+		args[thread].attribute_accum = attribute_accum;
+		args[thread].filter = filter;
+
+		args[thread].pipeline = &p;
+		args[thread].queue = thread;
+		args[thread].running = &running;
+		args[thread].pass = 1;
+		args[thread].passes = 1;
+		args[thread].wrote_zoom = -1;
+		args[thread].still_dropping = false;
+
+		if (pthread_create(&pthreads[thread], NULL, run_pipeline_thread, &args[thread]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (size_t thread = 0; thread < p.threads; thread++) {
+		void *retval;
+
+		if (pthread_join(pthreads[thread], &retval) != 0) {
+			perror("pthread_join");
+		}
+	}
+
+	for (size_t g = 0; g < p.gens.size(); g++) {
+		pipeline_release_generation(p.gens[g]);
+	}
+
+	if (pthread_cond_destroy(&p.cond) != 0) {
+		perror("pthread_cond_destroy");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_mutex_destroy(&p.lock) != 0) {
+		perror("pthread_mutex_destroy");
+		exit(EXIT_FAILURE);
+	}
+
+	if (p.err != INT_MAX) {
+		return p.err;
+	}
+
+	if (!quiet) {
+		fprintf(stderr, "\n");
+	}
+	return maxzoom;
+}
+
+int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpool, std::atomic<unsigned> *midx, std::atomic<unsigned> *midy, int &maxzoom, int minzoom, mbtiles_writer *writer, int buffer, const char *fname, const char *tmpdir, double gamma, int full_detail, int low_detail, int min_detail, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, double simplification, std::vector<std::map<std::string, layermap_entry>> &layermaps, const char *prefilter, const char *postfilter, std::map<std::string, attribute_op> const *attribute_accum, struct json_object *filter) {
 	last_progress = 0;
 
 	// The existing layermaps are one table per input thread.
@@ -2671,27 +3836,50 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 		}
 	}
 
+	// Dropping as needed has to see a whole zoom level before it can
+	// tile any of it, and extending zooms can't know until the end
+	// whether there will be another one, so those can't be pipelined.
+	bool dropping_pass = additional[A_INCREASE_GAMMA_AS_NEEDED] || additional[A_DROP_DENSEST_AS_NEEDED] || additional[A_COALESCE_DENSEST_AS_NEEDED] || additional[A_CLUSTER_DENSEST_AS_NEEDED] || additional[A_DROP_FRACTION_AS_NEEDED] || additional[A_COALESCE_FRACTION_AS_NEEDED] || additional[A_DROP_SMALLEST_AS_NEEDED] || additional[A_COALESCE_SMALLEST_AS_NEEDED];
+
+	if (additional[A_PIPELINE_ZOOMS] && (dropping_pass || additional[A_EXTEND_ZOOMS]) && !quiet) {
+		fprintf(stderr, "Warning: --pipeline-zooms has no effect with --*-as-needed or --extend-zooms-if-still-dropping\n");
+	}
+	if (additional[A_PIPELINE_ZOOMS] && !dropping_pass && !additional[A_EXTEND_ZOOMS]) {
+		return traverse_zooms_pipelined(geomfd, geom_size, metabase, stringpool, midx, midy, maxzoom, minzoom, writer, buffer, fname, tmpdir, gamma, full_detail, low_detail, min_detail, meta_off, pool_off, initial_x, initial_y, simplification, layermaps, layermaps_off, layer_unmaps, prefilter, postfilter, attribute_accum, filter);
+	}
+
+	// The initial shard holds a single tile
+	std::vector<std::vector<long long>> tile_starts;
+	tile_starts.resize(TEMP_FILES);
+	for (size_t j = 0; j < TEMP_FILES; j++) {
+		if (geom_size[j] > 0) {
+			tile_starts[j].push_back(0);
+		}
+	}
+
 	int i;
 	for (i = 0; i <= maxzoom; i++) {
 		std::atomic<long long> most(0);
 
-		FILE *sub[TEMP_FILES];
+		std::vector<shard_writer> sub(TEMP_FILES);
 		int subfd[TEMP_FILES];
 		for (size_t j = 0; j < TEMP_FILES; j++) {
-			char geomname[strlen(tmpdir) + strlen("/geom.XXXXXXXX" XSTRINGIFY(INT_MAX)) + 1];
-			sprintf(geomname, "%s/geom%zu.XXXXXXXX", tmpdir, j);
-			subfd[j] = mkstemp_cloexec(geomname);
-			// printf("%s\n", geomname);
-			if (subfd[j] < 0) {
-				perror(geomname);
-				exit(EXIT_FAILURE);
-			}
-			sub[j] = fopen_oflag(geomname, "wb", O_WRONLY | O_CLOEXEC);
-			if (sub[j] == NULL) {
-				perror(geomname);
-				exit(EXIT_FAILURE);
+			sub[j].fp = open_shard(tmpdir, j, &subfd[j]);
+		}
+
+		std::vector<char *> geommap;
+		geommap.resize(TEMP_FILES);
+		for (size_t j = 0; j < TEMP_FILES; j++) {
+			geommap[j] = map_shard(geomfd[j], geom_size[j]);
+
+			// Can be < 0 if there is only one source file, at z0
+			if (geomfd[j] >= 0) {
+				if (close(geomfd[j]) != 0) {
+					perror("close geom");
+					exit(EXIT_FAILURE);
+				}
+				geomfd[j] = -1;
 			}
-			unlink(geomname);
 		}
 
 		size_t useful_threads = 0;
@@ -2699,7 +3887,7 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 		for (size_t j = 0; j < TEMP_FILES; j++) {
 			todo += geom_size[j];
 			if (geom_size[j] > 0) {
-				useful_threads++;
+				useful_threads += tile_starts[j].size();
 			}
 		}
 
@@ -2728,63 +3916,38 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 			threads = 1;
 		}
 
-		// Assign temporary files to threads
+		// Cut the shards into runs of whole tiles, small enough that
+		// there are many more of them than threads, so that a shard full
+		// of dense tiles can be spread across threads by stealing.
 
 		std::vector<struct task> tasks;
-		tasks.resize(TEMP_FILES);
-
-		struct dispatch {
-			struct task *tasks = NULL;
-			long long todo = 0;
-			struct dispatch *next = NULL;
-		};
-		std::vector<struct dispatch> dispatches;
-		dispatches.resize(threads);
-
-		struct dispatch *dispatch_head = &dispatches[0];
-		for (size_t j = 0; j < threads; j++) {
-			dispatches[j].tasks = NULL;
-			dispatches[j].todo = 0;
-			if (j + 1 < threads) {
-				dispatches[j].next = &dispatches[j + 1];
-			} else {
-				dispatches[j].next = NULL;
-			}
+		long long task_size = todo / (threads * 16);
+		if (task_size < 1) {
+			task_size = 1;
 		}
 
 		for (size_t j = 0; j < TEMP_FILES; j++) {
-			if (geom_size[j] == 0) {
-				continue;
-			}
-
-			tasks[j].fileno = j;
-			tasks[j].next = dispatch_head->tasks;
-			dispatch_head->tasks = &tasks[j];
-			dispatch_head->todo += geom_size[j];
-
-			struct dispatch *here = dispatch_head;
-			dispatch_head = dispatch_head->next;
+			split_shard(j, tile_starts[j], geom_size[j], task_size, tasks);
+		}
 
-			dispatch **d;
-			for (d = &dispatch_head; *d != NULL; d = &((*d)->next)) {
-				if (here->todo < (*d)->todo) {
-					break;
-				}
-			}
+		// The largest tasks are dealt out first, each to the least-loaded thread
+		std::stable_sort(tasks.begin(), tasks.end(), [](struct task const &a, struct task const &b) {
+			return a.end - a.start > b.end - b.start;
+		});
 
-			here->next = *d;
-			*d = here;
-		}
+		// Where each tile begins in each shard written for the next zoom
+		std::vector<std::vector<long long>> sub_tile_starts;
+		sub_tile_starts.resize(TEMP_FILES);
 
 		int err = INT_MAX;
 
 		size_t start = 1;
-		if (additional[A_INCREASE_GAMMA_AS_NEEDED] || additional[A_DROP_DENSEST_AS_NEEDED] || additional[A_COALESCE_DENSEST_AS_NEEDED] || additional[A_CLUSTER_DENSEST_AS_NEEDED] || additional[A_DROP_FRACTION_AS_NEEDED] || additional[A_COALESCE_FRACTION_AS_NEEDED] || additional[A_DROP_SMALLEST_AS_NEEDED] || additional[A_COALESCE_SMALLEST_AS_NEEDED]) {
+		if (dropping_pass) {
 			start = 0;
 		}
 
 		double zoom_gamma = gamma;
-		unsigned long long zoom_mingap = ((1LL << (32 - i)) / 256 * cluster_distance) * ((1LL << (32 - i)) / 256 * cluster_distance);
+		unsigned long long zoom_mingap = cluster_mingap(i);
 		long long zoom_minextent = 0;
 		double zoom_fraction = 1;
 
@@ -2795,15 +3958,39 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 			std::atomic<int> running(threads);
 			std::atomic<long long> along(0);
 
+			std::vector<task_queue> queues;
+			queues.resize(threads);
+			std::vector<long long> queued;
+			queued.resize(threads);
+
+			for (size_t j = 0; j < threads; j++) {
+				if (pthread_mutex_init(&queues[j].lock, NULL) != 0) {
+					perror("pthread_mutex_init");
+					exit(EXIT_FAILURE);
+				}
+				queued[j] = 0;
+			}
+
+			for (size_t j = 0; j < tasks.size(); j++) {
+				size_t least = 0;
+				for (size_t k = 1; k < threads; k++) {
+					if (queued[k] < queued[least]) {
+						least = k;
+					}
+				}
+
+				queues[least].tasks.push_back(tasks[j]);
+				queued[least] += tasks[j].end - tasks[j].start;
+			}
+
 			for (size_t thread = 0; thread < threads; thread++) {
 				args[thread].metabase = metabase;
 				args[thread].stringpool = stringpool;
 				args[thread].min_detail = min_detail;
-				args[thread].outdb = outdb;  // locked with db_lock
-				args[thread].outdir = outdir;
+				args[thread].writer = writer;
 				args[thread].buffer = buffer;
 				args[thread].fname = fname;
-				args[thread].geomfile = sub + thread * (TEMP_FILES / threads);
+				args[thread].geomfile = sub.data() + thread * (TEMP_FILES / threads);
 				args[thread].todo = todo;
 				args[thread].along = &along;  // locked with var_lock
 				args[thread].gamma = zoom_gamma;
@@ -2817,8 +4004,8 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 				args[thread].child_shards = TEMP_FILES / threads;
 				args[thread].simplification = simplification;
 
-				args[thread].geomfd = geomfd;
-				args[thread].geom_size = geom_size;
+				args[thread].geommap = geommap.data();
+				args[thread].tile_starts = &sub_tile_starts[thread * (TEMP_FILES / threads)];
 				args[thread].midx = midx;  // locked with var_lock
 				args[thread].midy = midy;  // locked with var_lock
 				args[thread].maxzoom = maxzoom;
@@ -2838,7 +4025,8 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 				args[thread].attribute_accum = attribute_accum;
 				args[thread].filter = filter;
 
-				args[thread].tasks = dispatches[thread].tasks;
+				args[thread].queues = &queues;
+				args[thread].queue = thread;
 				args[thread].running = &running;
 				args[thread].pass = pass;
 				args[thread].passes = 2 - start;
@@ -2884,20 +4072,23 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 					maxzoom++;
 				}
 			}
+
+			for (size_t j = 0; j < threads; j++) {
+				if (pthread_mutex_destroy(&queues[j].lock) != 0) {
+					perror("pthread_mutex_destroy");
+					exit(EXIT_FAILURE);
+				}
+			}
 		}
 
 		for (size_t j = 0; j < TEMP_FILES; j++) {
-			// Can be < 0 if there is only one source file, at z0
-			if (geomfd[j] >= 0) {
-				if (close(geomfd[j]) != 0) {
-					perror("close geom");
+			if (geommap[j] != NULL) {
+				if (munmap(geommap[j], geom_size[j]) != 0) {
+					perror("munmap geom");
 					exit(EXIT_FAILURE);
 				}
 			}
-			if (fclose(sub[j]) != 0) {
-				perror("close subfile");
-				exit(EXIT_FAILURE);
-			}
+			shard_close(&sub[j], fname);
 
 			struct stat geomst;
 			if (fstat(subfd[j], &geomst) != 0) {
@@ -2909,6 +4100,8 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 			geom_size[j] = geomst.st_size;
 		}
 
+		tile_starts.swap(sub_tile_starts);
+
 		if (err != INT_MAX) {
 			return err;
 		}
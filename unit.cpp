@@ -1,6 +1,14 @@
 #define CATCH_CONFIG_MAIN
 #include "catch/catch.hpp"
 #include "text.hpp"
+#include "mvt.hpp"
+#include "sort.hpp"
+#include "jsonpull/jsonpull.h"
+#include "protozero/pbf_writer.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
 
 TEST_CASE("UTF-8 enforcement", "[utf8]") {
 	REQUIRE(check_utf8("") == std::string(""));
@@ -18,3 +26,583 @@ TEST_CASE("UTF-8 truncation", "[trunc]") {
 	REQUIRE(truncate16("0123456789😀😬😁😂😃😄😅😆", 17) == std::string("0123456789😀😬😁"));
 	REQUIRE(truncate16("0123456789あいうえおかきくけこさ", 16) == std::string("0123456789あいうえおか"));
 }
+
+TEST_CASE("Encoded tile size", "[mvt]") {
+	mvt_tile tile;
+	mvt_layer layer;
+	layer.name = "layer";
+	layer.version = 2;
+	layer.extent = 4096;
+
+	mvt_feature point;
+	point.type = mvt_point;
+	point.geometry.push_back(mvt_geometry(mvt_moveto, 100, -100));
+	point.id = 1234567890123ULL;
+	point.has_id = true;
+
+	mvt_value v;
+	v.type = mvt_string;
+	v.string_value = "hello";
+	layer.tag(point, "name", v);
+	v.type = mvt_sint;
+	v.numeric_value.sint_value = -7000000000LL;
+	layer.tag(point, "population", v);
+	layer.features.push_back(point);
+
+	mvt_feature polygon;
+	polygon.type = mvt_polygon;
+	polygon.geometry.push_back(mvt_geometry(mvt_moveto, 0, 0));
+	polygon.geometry.push_back(mvt_geometry(mvt_lineto, 70000, 0));
+	polygon.geometry.push_back(mvt_geometry(mvt_lineto, 70000, 70000));
+	polygon.geometry.push_back(mvt_geometry(mvt_lineto, 0, 70000));
+	polygon.geometry.push_back(mvt_geometry(mvt_closepath, 0, 0));
+	v.type = mvt_double;
+	v.numeric_value.double_value = 3.5;
+	layer.tag(polygon, "area", v);
+	v.type = mvt_bool;
+	v.numeric_value.bool_value = true;
+	layer.tag(polygon, "big", v);
+	layer.features.push_back(polygon);
+
+	tile.layers.push_back(layer);
+	REQUIRE(tile.encoded_size() == tile.encode().size());
+
+	tile.layers.push_back(mvt_layer());
+	REQUIRE(tile.encoded_size() == tile.encode().size());
+}
+
+// The encoder as it was before it wrote nested messages in place,
+// building each layer, value, and feature as a separate string
+static std::string encode_by_copying(mvt_tile &tile) {
+	std::string data;
+	protozero::pbf_writer writer(data);
+
+	for (size_t i = 0; i < tile.layers.size(); i++) {
+		mvt_layer &layer = tile.layers[i];
+		std::string layer_string;
+		protozero::pbf_writer layer_writer(layer_string);
+
+		layer_writer.add_uint32(15, layer.version);
+		layer_writer.add_string(1, layer.name);
+		layer_writer.add_uint32(5, layer.extent);
+
+		for (size_t j = 0; j < layer.keys.size(); j++) {
+			layer_writer.add_string(3, layer.keys[j]);
+		}
+
+		for (size_t v = 0; v < layer.values.size(); v++) {
+			std::string value_string;
+			protozero::pbf_writer value_writer(value_string);
+			mvt_value &pbv = layer.values[v];
+
+			if (pbv.type == mvt_string) {
+				value_writer.add_string(1, pbv.string_value);
+			} else if (pbv.type == mvt_float) {
+				value_writer.add_float(2, pbv.numeric_value.float_value);
+			} else if (pbv.type == mvt_double) {
+				value_writer.add_double(3, pbv.numeric_value.double_value);
+			} else if (pbv.type == mvt_int) {
+				value_writer.add_int64(4, pbv.numeric_value.int_value);
+			} else if (pbv.type == mvt_uint) {
+				value_writer.add_uint64(5, pbv.numeric_value.uint_value);
+			} else if (pbv.type == mvt_sint) {
+				value_writer.add_sint64(6, pbv.numeric_value.sint_value);
+			} else if (pbv.type == mvt_bool) {
+				value_writer.add_bool(7, pbv.numeric_value.bool_value);
+			}
+
+			layer_writer.add_message(4, value_string);
+		}
+
+		for (size_t f = 0; f < layer.features.size(); f++) {
+			mvt_feature &feature = layer.features[f];
+			std::string feature_string;
+			protozero::pbf_writer feature_writer(feature_string);
+
+			feature_writer.add_enum(3, feature.type);
+			feature_writer.add_packed_uint32(2, std::begin(feature.tags), std::end(feature.tags));
+
+			if (feature.has_id) {
+				feature_writer.add_uint64(1, feature.id);
+			}
+
+			std::vector<uint32_t> geometry;
+			long long px = 0, py = 0;
+			int cmd_idx = -1;
+			int cmd = -1;
+			int length = 0;
+
+			for (size_t g = 0; g < feature.geometry.size(); g++) {
+				int op = feature.geometry[g].op;
+
+				if (op != cmd) {
+					if (cmd_idx >= 0) {
+						geometry[cmd_idx] = (length << 3) | (cmd & ((1 << 3) - 1));
+					}
+
+					cmd = op;
+					length = 0;
+					cmd_idx = geometry.size();
+					geometry.push_back(0);
+				}
+
+				if (op == mvt_moveto || op == mvt_lineto) {
+					geometry.push_back(protozero::encode_zigzag32(feature.geometry[g].x - px));
+					geometry.push_back(protozero::encode_zigzag32(feature.geometry[g].y - py));
+					px = feature.geometry[g].x;
+					py = feature.geometry[g].y;
+				}
+				length++;
+			}
+
+			if (cmd_idx >= 0) {
+				geometry[cmd_idx] = (length << 3) | (cmd & ((1 << 3) - 1));
+			}
+
+			feature_writer.add_packed_uint32(4, std::begin(geometry), std::end(geometry));
+			layer_writer.add_message(2, feature_string);
+		}
+
+		writer.add_message(3, layer_string);
+	}
+
+	return data;
+}
+
+// Like a low-zoom tile: many features, many attribute values
+static mvt_tile dense_tile(size_t features) {
+	srand(1);
+
+	mvt_tile tile;
+	for (size_t l = 0; l < 3; l++) {
+		mvt_layer layer;
+		layer.name = "layer" + std::to_string(l);
+		layer.version = 2;
+		layer.extent = 4096;
+
+		for (size_t i = 0; i < features; i++) {
+			mvt_feature feature;
+			feature.type = 1 + i % 3;
+			if (i % 2 == 0) {
+				feature.id = rand();
+				feature.has_id = true;
+			}
+
+			size_t points = feature.type == mvt_point ? 1 : 2 + rand() % 30;
+			for (size_t p = 0; p < points; p++) {
+				feature.geometry.push_back(mvt_geometry(p == 0 ? mvt_moveto : mvt_lineto, rand() % 8192 - 2048, rand() % 8192 - 2048));
+			}
+			if (feature.type == mvt_polygon) {
+				feature.geometry.push_back(mvt_geometry(mvt_closepath, 0, 0));
+			}
+
+			mvt_value v;
+			v.type = mvt_string;
+			v.string_value = "name " + std::to_string(rand() % 1000);
+			layer.tag(feature, "name", v);
+			v.type = mvt_sint;
+			v.numeric_value.sint_value = rand() - RAND_MAX / 2;
+			layer.tag(feature, "rank", v);
+			v.type = mvt_double;
+			v.numeric_value.double_value = rand() / 7.0;
+			layer.tag(feature, "area", v);
+
+			layer.features.push_back(feature);
+		}
+
+		tile.layers.push_back(layer);
+	}
+
+	return tile;
+}
+
+static bool read_fixture(const char *fname, std::string &out) {
+	FILE *f = fopen(fname, "rb");
+	if (f == NULL) {
+		return false;
+	}
+
+	char buf[2000];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+		out.append(buf, n);
+	}
+	fclose(f);
+	return true;
+}
+
+TEST_CASE("Encoding in place", "[mvt]") {
+	mvt_tile tile = dense_tile(1000);
+	std::string expected = encode_by_copying(tile);
+	REQUIRE(tile.encode() == expected);
+
+	// A reused buffer is replaced, not appended to
+	std::string buffer = "left over";
+	tile.encode(buffer);
+	REQUIRE(buffer == expected);
+
+	std::string pbf;
+	REQUIRE(read_fixture("tests/pbf/11-328-791.vector.pbf", pbf));
+	mvt_tile fixture;
+	bool was_compressed;
+	REQUIRE(fixture.decode(pbf, was_compressed));
+	REQUIRE(fixture.encode() == encode_by_copying(fixture));
+	REQUIRE(fixture.encoded_size() == fixture.encode().size());
+}
+
+TEST_CASE("Tag interning", "[mvt]") {
+	mvt_tag_tables reused;
+
+	for (size_t round = 0; round < 3; round++) {
+		mvt_layer layer;
+		std::swap(layer.tag_tables, reused);
+		layer.tag_tables.clear();
+
+		// String pool entries: a type byte, then the stringified value
+		std::string pool;
+		pool += (char) mvt_string;
+		pool += std::string("name") + '\0';
+		pool += (char) mvt_double;
+		pool += std::string("12") + '\0';
+		pool += (char) mvt_double;
+		pool += std::string("12.0") + '\0';
+		const char *name = pool.c_str();
+		const char *twelve = name + 6;
+		const char *twelve_again = twelve + 4;
+
+		for (size_t i = 0; i < 1000; i++) {
+			mvt_feature feature;
+
+			mvt_value v;
+			v.type = mvt_double;
+			v.numeric_value.double_value = i % 100;
+			layer.tag(feature, "n" + std::to_string(i % 10), v);
+			layer.tag_pooled(feature, name, i % 2 == 0 ? twelve : twelve_again);
+
+			REQUIRE(feature.tags.size() == 4);
+			REQUIRE(layer.keys[feature.tags[0]] == "n" + std::to_string(i % 10));
+			REQUIRE(layer.values[feature.tags[1]] == v);
+			REQUIRE(layer.keys[feature.tags[2]] == "name");
+			layer.features.push_back(feature);
+		}
+
+		// Both stringifications of 12 become the same integer value,
+		// which is distinct from the doubles 0 to 99
+		REQUIRE(layer.keys.size() == 11);
+		REQUIRE(layer.values.size() == 101);
+		REQUIRE(layer.features[0].tags[3] == layer.features[1].tags[3]);
+
+		std::swap(layer.tag_tables, reused);
+	}
+
+	// Tables are rebuilt for decoded tiles, so more tagging still shares constants
+	mvt_tile tile = dense_tile(100);
+	std::string pbf = tile.encode();
+	mvt_tile decoded;
+	bool was_compressed;
+	REQUIRE(decoded.decode(pbf, was_compressed));
+	size_t values = decoded.layers[0].values.size();
+	mvt_feature feature;
+	decoded.layers[0].tag(feature, "name", decoded.layers[0].values[values / 2]);
+	REQUIRE(decoded.layers[0].values.size() == values);
+	REQUIRE(feature.tags[1] == values / 2);
+}
+
+// Not run by default: ./unit "[benchmark]"
+TEST_CASE("Tile encoding speed", "[.][benchmark]") {
+	std::vector<std::pair<std::string, mvt_tile>> tiles;
+
+	std::string pbf;
+	REQUIRE(read_fixture("tests/pbf/11-328-791.vector.pbf", pbf));
+	mvt_tile fixture;
+	bool was_compressed;
+	REQUIRE(fixture.decode(pbf, was_compressed));
+	tiles.push_back(std::make_pair("tests/pbf fixture", fixture));
+	tiles.push_back(std::make_pair("dense tile", dense_tile(100000)));
+
+	for (auto &t : tiles) {
+		size_t reps = 20;
+		size_t size = 0;
+
+		auto t0 = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < reps; i++) {
+			size += encode_by_copying(t.second).size();
+		}
+		auto t1 = std::chrono::steady_clock::now();
+		std::string buffer;
+		for (size_t i = 0; i < reps; i++) {
+			t.second.encode(buffer);
+			size -= buffer.size();
+		}
+		auto t2 = std::chrono::steady_clock::now();
+
+		printf("%s: copying %lld us, in place %lld us\n", t.first.c_str(),
+		       (long long) std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count() / (long long) reps,
+		       (long long) std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() / (long long) reps);
+		REQUIRE(size == 0);
+	}
+}
+
+TEST_CASE("JSON scanning", "[json]") {
+	srand(1);
+
+	// Enough of each to cross several buffer boundaries
+	std::vector<std::string> numbers;
+	std::vector<std::string> strings;
+	for (size_t i = 0; i < 20000; i++) {
+		char buf[100];
+		switch (i % 6) {
+		case 0:
+			snprintf(buf, sizeof(buf), "%d", rand() - RAND_MAX / 2);
+			break;
+		case 1:
+			snprintf(buf, sizeof(buf), "%.*f", rand() % 17, (rand() - RAND_MAX / 2) / 1e6);
+			break;
+		case 2:
+			snprintf(buf, sizeof(buf), "%.*e", rand() % 20, (rand() - RAND_MAX / 2) * 1e-3);
+			break;
+		case 3:
+			snprintf(buf, sizeof(buf), "%d%de%d", rand(), rand(), rand() % 700 - 350);
+			break;
+		case 4:
+			snprintf(buf, sizeof(buf), "%s0.%05d%d", rand() % 2 ? "-" : "", rand() % 100, rand());
+			break;
+		case 5:
+			snprintf(buf, sizeof(buf), "%d%d%d%d", rand(), rand(), rand(), rand());
+			break;
+		}
+		numbers.push_back(buf);
+
+		std::string s;
+		for (size_t j = rand() % 60; j > 0; j--) {
+			s.push_back(rand() % 20 == 0 ? "\"\\\n\t/"[rand() % 5] : 'a' + rand() % 26);
+		}
+		strings.push_back(s);
+	}
+
+	std::string json = "[\n";
+	for (size_t i = 0; i < numbers.size(); i++) {
+		json += std::string(rand() % 40, ' ') + numbers[i] + ",\n\"";
+		for (char c : strings[i]) {
+			switch (c) {
+			case '"':
+				json += "\\\"";
+				break;
+			case '\\':
+				json += "\\\\";
+				break;
+			case '\n':
+				json += "\\n";
+				break;
+			case '\t':
+				json += "\\t";
+				break;
+			case '/':
+				json += "\\/";
+				break;
+			default:
+				json.push_back(c);
+			}
+		}
+		json += "\",\r\n";
+	}
+	json += "true ]\n";
+
+	json_pull *jp = json_begin_string(json.c_str());
+	json_object *o = json_read_tree(jp);
+	REQUIRE(o != NULL);
+	REQUIRE(o->type == JSON_ARRAY);
+	REQUIRE(o->length == 2 * numbers.size() + 1);
+
+	for (size_t i = 0; i < numbers.size(); i++) {
+		json_object *n = o->array[2 * i];
+		REQUIRE(n->type == JSON_NUMBER);
+		REQUIRE(std::string(n->string) == numbers[i]);
+
+		double expected = atof(numbers[i].c_str());
+		REQUIRE(memcmp(&n->number, &expected, sizeof(double)) == 0);
+
+		json_object *s = o->array[2 * i + 1];
+		REQUIRE(s->type == JSON_STRING);
+		REQUIRE(std::string(s->string) == strings[i]);
+	}
+
+	REQUIRE(json_read_tree(jp) == NULL);
+	REQUIRE(jp->error == NULL);
+	REQUIRE(jp->line == (int) (2 * numbers.size() + 3));
+	json_end(jp);
+
+	// Malformed numbers are still reported, on the right line
+	for (const char *bad : {"[\n\n  1.x ]", "[\n\n  1e+ ]"}) {
+		jp = json_begin_string(bad);
+		REQUIRE(json_read_tree(jp) == NULL);
+		REQUIRE(jp->error != NULL);
+		REQUIRE(jp->line == 3);
+		json_end(jp);
+	}
+}
+
+TEST_CASE("JSON coordinate packing", "[json]") {
+	const char *json =
+		"{ \"type\": \"Feature\", \"properties\": { \"g\": { \"coordinates\": [ 1, 2 ] } },\n"
+		"  \"geometry\": { \"type\": \"MultiPoint\", \"coordinates\": [ [ 1.5, -2e3 ],\n [ 3, 4, 5 ], [ ] ] } }\n"
+		"{ \"geometry\": { \"coordinates\": [ [ 1, 2 ], [ 3, null ] ] } }\n";
+
+	json_pull *jp = json_begin_string(json);
+	jp->pack_coordinates = 1;
+
+	json_object *o = json_read_tree(jp);
+	REQUIRE(o != NULL);
+
+	json_object *coordinates = json_hash_get(json_hash_get(o, "geometry"), "coordinates");
+	REQUIRE(coordinates->type == JSON_COORDINATES);
+	REQUIRE(std::string(coordinates->string) == "[[##][###][]]");
+	REQUIRE(coordinates->numbers[0] == 1.5);
+	REQUIRE(coordinates->numbers[1] == -2000);
+	REQUIRE(coordinates->numbers[4] == 5);
+
+	// Within properties, the ordinary structure is kept
+	json_object *g = json_hash_get(json_hash_get(json_hash_get(o, "properties"), "g"), "coordinates");
+	REQUIRE(g->type == JSON_ARRAY);
+	REQUIRE(g->length == 2);
+
+	char *s = json_stringify(o);
+	REQUIRE(std::string(s) == "{\"type\":\"Feature\",\"properties\":{\"g\":{\"coordinates\":[1,2]}},\"geometry\":{\"type\":\"MultiPoint\",\"coordinates\":[[1.5,-2000],[3,4,5],[]]}}");
+	free(s);
+	json_free(o);
+
+	// Anything other than numbers falls back to ordinary arrays
+	o = json_read_tree(jp);
+	REQUIRE(o != NULL);
+	coordinates = json_hash_get(json_hash_get(o, "geometry"), "coordinates");
+	REQUIRE(coordinates->type == JSON_ARRAY);
+	REQUIRE(coordinates->length == 2);
+	REQUIRE(coordinates->array[0]->length == 2);
+	REQUIRE(std::string(coordinates->array[0]->array[1]->string) == "2");
+	REQUIRE(coordinates->array[1]->array[0]->number == 3);
+	REQUIRE(coordinates->array[1]->array[1]->type == JSON_NULL);
+	json_free(o);
+
+	REQUIRE(json_read_tree(jp) == NULL);
+	REQUIRE(jp->error == NULL);
+	REQUIRE(jp->line == 5);
+	json_end(jp);
+
+	// Errors within coordinates are still reported
+	jp = json_begin_string("{ \"coordinates\": [ [ 1,\n 2. ] ] }");
+	jp->pack_coordinates = 1;
+	REQUIRE(json_read_tree(jp) == NULL);
+	REQUIRE(jp->error != NULL);
+	REQUIRE(jp->line == 2);
+	json_end(jp);
+}
+
+TEST_CASE("JSON arena", "[json]") {
+	std::string json = "{ \"type\": \"FeatureCollection\", \"features\": [\n";
+	for (size_t i = 0; i < 10000; i++) {
+		json += "{ \"type\": \"Feature\", \"properties\": { \"name\": \"feature " + std::to_string(i) + "\", \"long\": \"" + std::string(i, 'x') + "\" },";
+		json += " \"geometry\": { \"type\": \"Point\", \"coordinates\": [ " + std::to_string(i) + ", 2 ] } },\n";
+	}
+	json += "{ } ] }\n";
+
+	json_pull *jp = json_begin_string(json.c_str());
+	jp->use_arena = 1;
+	jp->pack_coordinates = 1;
+
+	size_t features = 0;
+
+	json_object *j;
+	while ((j = json_read(jp)) != NULL) {
+		json_object *type = json_hash_get(j, "type");
+		if (type == NULL || type->type != JSON_STRING || strcmp(type->string, "Feature") != 0) {
+			continue;
+		}
+
+		json_object *name = json_hash_get(json_hash_get(j, "properties"), "name");
+		REQUIRE(std::string(name->string) == "feature " + std::to_string(features));
+		json_set_string(name, "renamed");
+		REQUIRE(std::string(name->string) == "renamed");
+
+		json_object *coordinates = json_hash_get(json_hash_get(j, "geometry"), "coordinates");
+		REQUIRE(coordinates->numbers[0] == features);
+
+		json_free(j);
+		features++;
+	}
+
+	REQUIRE(jp->error == NULL);
+	REQUIRE(features == 10000);
+	json_end(jp);
+}
+
+static bool index_less(struct index const &a, struct index const &b) {
+	return indexcmp(&a, &b) < 0;
+}
+
+TEST_CASE("Index sort", "[sort]") {
+	srand(1);
+
+	for (size_t n : {0, 1, 2, 100, 100000}) {
+		for (bool seq_ordered : {false, true}) {
+			std::vector<struct index> ix(n);
+			for (size_t i = 0; i < n; i++) {
+				// Few distinct keys so that there are plenty of ties,
+				// and high bits set so that every byte gets sorted
+				ix[i].ix = ((unsigned long long) (rand() % 50) << 56) | (rand() % 3);
+				if (seq_ordered) {
+					ix[i].seq = i / 3;
+				} else {
+					ix[i].seq = ((unsigned long long) (rand() % 4) << 40) | (rand() % 5);
+				}
+				ix[i].start = i;
+			}
+
+			std::vector<struct index> expected = ix;
+			std::stable_sort(expected.begin(), expected.end(), index_less);
+
+			sort_index(ix.data(), ix.size());
+			for (size_t i = 0; i < n; i++) {
+				REQUIRE(ix[i].ix == expected[i].ix);
+				REQUIRE(ix[i].seq == expected[i].seq);
+				REQUIRE(ix[i].start == expected[i].start);
+			}
+		}
+	}
+}
+
+// Not run by default: ./unit "[benchmark]"
+TEST_CASE("Index sort speed", "[.][benchmark]") {
+	const size_t n = 4000000;
+	srand(1);
+
+	std::vector<struct index> uniform(n);
+	std::vector<struct index> clustered(n);
+	for (size_t i = 0; i < n; i++) {
+		uniform[i].ix = ((unsigned long long) rand() << 32) ^ rand();
+		uniform[i].seq = i;
+
+		// Like real input: features come in runs that are near each other
+		clustered[i].ix = ((unsigned long long) (i / 1000 * 7919 % 4096) << 52) | ((unsigned long long) rand() << 16);
+		clustered[i].seq = i;
+	}
+
+	for (auto const &data : {std::make_pair("uniform", &uniform), std::make_pair("clustered", &clustered)}) {
+		std::vector<struct index> a = *data.second;
+		std::vector<struct index> b = *data.second;
+
+		auto t0 = std::chrono::steady_clock::now();
+		qsort(a.data(), a.size(), sizeof(struct index), indexcmp);
+		auto t1 = std::chrono::steady_clock::now();
+		sort_index(b.data(), b.size());
+		auto t2 = std::chrono::steady_clock::now();
+
+		printf("%s: qsort %lld ms, sort_index %lld ms\n", data.first,
+		       (long long) std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count(),
+		       (long long) std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count());
+
+		for (size_t i = 0; i < n; i++) {
+			REQUIRE(a[i].ix == b[i].ix);
+			REQUIRE(a[i].seq == b[i].seq);
+		}
+	}
+}